@@ -29,9 +29,59 @@ export const DATA_TYPES = new Set([bool, byte, f32, f64, i16, i32, i64, u16, u32
  * @typedef {{ [name: string]: TypeAnnotation }} DataMemberObject
  */
 
+/**
+ * @typedef {{ hot?: boolean, enableable?: boolean }} ComponentOptions
+ */
+
 export class DataComponent {
+  constructor(/**@type {DataMemberObject}*/ members, /**@type {ComponentOptions}*/ options = {}) {
+    this.members = members
+    this.hot = options.hot === true // read or written by hot loops, see COMPONENT_FLAG_HOT
+    this.enableable = options.enableable === true // can be turned off per entity, see COMPONENT_FLAG_ENABLEABLE
+  }
+}
+
+// A component without data. Tag components take up no space in chunks, they are used to filter entities.
+export class TagComponent {
+  constructor(/**@type {{ enableable?: boolean }}*/ options = {}) {
+    this.members = {}
+    this.hot = false
+    this.enableable = options.enableable === true
+  }
+}
+
+// A component whose value is stored once per chunk instead of once per entity, see COMPONENT_FLAG_SHARED. Entities with
+// different values are kept in different chunks so values should come from a small set (a material, a LOD bucket).
+export class SharedComponent {
+  constructor(/**@type {DataMemberObject}*/ members) {
+    this.members = members
+    this.hot = false
+    this.shared = true
+  }
+}
+
+// A component whose data is stored once per chunk, see COMPONENT_FLAG_CHUNK. Used for data about all the entities in a
+// chunk such as their combined bounds.
+export class ChunkComponent {
   constructor(/**@type {DataMemberObject}*/ members) {
     this.members = members
+    this.hot = false
+    this.chunk = true
+  }
+}
+
+/**
+ * @typedef {{ capacity?: number }} BufferComponentOptions
+ */
+
+// A variable length array of elements per entity (a dynamic buffer), see COMPONENT_FLAG_BUFFER. The members describe
+// one element. The first capacity elements are stored in the chunk, more elements spill to overflow storage.
+export class BufferComponent {
+  constructor(/**@type {DataMemberObject}*/ members, /**@type {BufferComponentOptions}*/ options = {}) {
+    this.members = members
+    this.hot = false
+    this.buffer = true
+    this.capacity = options.capacity !== undefined ? options.capacity : 8
   }
 }
 
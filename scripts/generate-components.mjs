@@ -42,8 +42,14 @@ import("file:///" + resolve(argv[0])).then(
     hh += "namespace game {\n"
     for (const [component, meta] of componentTypeMap) {
       hh += "struct " + meta.name + " {\n"
-      hh += "  enum { COMPONENT_TYPE = " + meta.typeId + " };\n"
-      hh += "\n"
+      if (component.buffer) {
+        hh += "  enum { COMPONENT_TYPE = " + meta.typeId + ", BUFFER_CAPACITY = " + component.capacity + " };\n"
+      } else {
+        hh += "  enum { COMPONENT_TYPE = " + meta.typeId + " };\n"
+      }
+      if (0 < Object.keys(component.members).length) {
+        hh += "\n"
+      }
       for (const [name, desc] of Object.entries(component.members)) {
         if (isDataType(desc)) {
           hh += "  " + desc.description + " " + getMemberName(name) + ";\n"
@@ -63,8 +69,27 @@ import("file:///" + resolve(argv[0])).then(
     cc += "Slice<const TypeInfo> game::" + typeInfoAccessor + "() {\n"
     cc += "  static const TypeInfo components[] = {\n"
     cc += "    GAME_COMPONENT(Entity),\n"
-    for (const [_, meta] of componentTypeMap) {
-      cc += "    GAME_COMPONENT(" + meta.name + "),\n"
+    for (const [component, meta] of componentTypeMap) {
+      const flags = []
+      if (component.hot) {
+        flags.push("COMPONENT_FLAG_HOT")
+      }
+      if (component.shared) {
+        flags.push("COMPONENT_FLAG_SHARED")
+      }
+      if (component.chunk) {
+        flags.push("COMPONENT_FLAG_CHUNK")
+      }
+      if (component.enableable) {
+        flags.push("COMPONENT_FLAG_ENABLEABLE")
+      }
+      if (component.buffer) {
+        cc += "    GAME_COMPONENT_BUFFER(" + meta.name + "),\n"
+      } else if (0 < flags.length) {
+        cc += "    GAME_COMPONENT_FLAGS(" + meta.name + ", " + flags.join(" | ") + "),\n"
+      } else {
+        cc += "    GAME_COMPONENT(" + meta.name + "),\n"
+      }
     }
     cc += "  };\n"
     cc += "  return slice::FromArray(components);\n"
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "intrin.hh"
+
+// Atomic read-modify-write operations on plain integers. These are all sequentially consistent (full barrier).
+
+namespace game {
+inline u64 atomic_load_u64(const volatile u64* ptr) {
+#if _WIN32
+  return *ptr; // aligned 64-bit loads are atomic on x64 and volatile reads have acquire semantics with MSVC
+#else
+  return __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Returns the value before the operation
+inline u64 atomic_or_u64(volatile u64* ptr, u64 value) {
+#if _WIN32
+  return u64(_InterlockedOr64((volatile long long*)ptr, (long long)value));
+#else
+  return __atomic_fetch_or(ptr, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Returns the value before the operation
+inline u64 atomic_and_u64(volatile u64* ptr, u64 value) {
+#if _WIN32
+  return u64(_InterlockedAnd64((volatile long long*)ptr, (long long)value));
+#else
+  return __atomic_fetch_and(ptr, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Store desired if the current value is equal to expected. Returns the value before the operation (the operation succeeded if the return value is equal to expected).
+inline u64 atomic_cmpxchg_u64(volatile u64* ptr, u64 expected, u64 desired) {
+#if _WIN32
+  return u64(_InterlockedCompareExchange64((volatile long long*)ptr, (long long)desired, (long long)expected));
+#else
+  __atomic_compare_exchange_n(ptr, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return expected;
+#endif
+}
+
+// A lock for very short critical sections that we don't expect to be contended
+struct SpinLock {
+  volatile u64 v_;
+
+  void Lock() {
+    while (atomic_cmpxchg_u64(&v_, 0, 1) != 0) {
+      while (atomic_load_u64(&v_) != 0) {
+        _mm_pause();
+      }
+    }
+  }
+
+  void Unlock() {
+    u64 v = atomic_and_u64(&v_, 0);
+    assert(v == 1 && "lock is not locked");
+  }
+};
+} // namespace game
@@ -2,9 +2,33 @@
 
 #include "type-system.hh"
 
+#include <type_traits>
+
 // Define component
 #define GAME_COMPONENT(Component)                                                                                      \
-  { ::game::GetComponentTypeId<Component>(), u16(sizeof(Component)), u16(alignof(Component)), #Component }
+  { ::game::GetComponentTypeId<Component>(),                                                                           \
+    ::game::GetComponentSize<Component>(),                                                                             \
+    u16(alignof(Component)),                                                                                           \
+    #Component,                                                                                                        \
+    ::game::GetComponentImplicitFlags<Component>() }
+
+// Define component with flags (see ComponentFlags)
+#define GAME_COMPONENT_FLAGS(Component, flags)                                                                         \
+  { ::game::GetComponentTypeId<Component>(),                                                                           \
+    ::game::GetComponentSize<Component>(),                                                                             \
+    u16(alignof(Component)),                                                                                           \
+    #Component,                                                                                                        \
+    u32(flags) | ::game::GetComponentImplicitFlags<Component>() }
+
+// Define dynamic buffer component, Component is the element type and must declare BUFFER_CAPACITY (see
+// COMPONENT_FLAG_BUFFER)
+#define GAME_COMPONENT_BUFFER(Component)                                                                               \
+  { ::game::GetComponentTypeId<Component>(),                                                                           \
+    ::game::GetBufferComponentSize<Component>(),                                                                       \
+    u16(::game::BUFFER_ALIGNMENT),                                                                                     \
+    #Component,                                                                                                        \
+    u32(::game::COMPONENT_FLAG_BUFFER),                                                                                \
+    u16(sizeof(Component)) }
 
 namespace game {
 struct Entity {
@@ -32,10 +56,64 @@ template <typename T> constexpr ComponentTypeId GetComponentTypeId() {
   return ComponentTypeId{ T::COMPONENT_TYPE };
 };
 
+enum ComponentFlags {
+  // The component is read or written by hot loops. With the packed archetype layout the component array is aligned and padded to SIMD width.
+  COMPONENT_FLAG_HOT = 1 << 0,
+
+  // The component is an empty struct (a tag component). Tag components are part of the archetype identity but they
+  // have no component array. This flag is set by GAME_COMPONENT.
+  COMPONENT_FLAG_TAG = 1 << 1,
+
+  // The component value is stored once per chunk instead of once per entity (a shared component). Entities with
+  // different values end up in different chunks of the same archetype.
+  COMPONENT_FLAG_SHARED = 1 << 2,
+
+  // The component data is stored once per chunk (a chunk component), e.g. the bounds of all entities in the chunk.
+  // Chunk component data is found at the end of the chunk buffer.
+  COMPONENT_FLAG_CHUNK = 1 << 3,
+
+  // The component is a variable length array of elements (a dynamic buffer). The first BUFFER_CAPACITY elements are
+  // stored in the component array of the chunk, after a buffer header, more elements spill to overflow storage owned
+  // by the entity manager.
+  COMPONENT_FLAG_BUFFER = 1 << 4,
+
+  // The component can be turned off per entity without a structural change. Each chunk keeps an enabled bit per entity
+  // for the component type and queries skip entities where a required enableable component is disabled.
+  COMPONENT_FLAG_ENABLEABLE = 1 << 5,
+};
+
+// Every buffer starts with a header (see BufferHeader), the inline elements follow it
+enum {
+  BUFFER_HEADER_SIZE = 16,
+  BUFFER_ALIGNMENT   = 16,
+};
+
+// The size of a buffer in the component array: the header plus the inline elements, padded to the buffer alignment
+template <typename T> constexpr u16 GetBufferComponentSize() {
+  static_assert(alignof(T) <= BUFFER_ALIGNMENT, "buffer element is over-aligned");
+  const i32 size = BUFFER_HEADER_SIZE + T::BUFFER_CAPACITY * i32(sizeof(T));
+  return u16((size + BUFFER_ALIGNMENT - 1) & ~(BUFFER_ALIGNMENT - 1));
+}
+
+// An empty struct has a size of 1 in C++ but a tag component takes up no space in chunks
+template <typename T> constexpr u16 GetComponentSize() {
+  return std::is_empty<T>::value ? 0 : u16(sizeof(T));
+}
+
+template <typename T> constexpr u32 GetComponentImplicitFlags() {
+  return std::is_empty<T>::value ? u32(COMPONENT_FLAG_TAG) : 0;
+}
+
 struct TypeInfo {
   ComponentTypeId type_id_;
   u16             size_;
   u16             alignment_;
   const char*     name_;
+  u32             flags_;        // ComponentFlags
+  u16             element_size_; // The size of a buffer element (buffer components only)
+
+  // The number of bytes that each entity takes up in the component array. Tag, shared and chunk components have no
+  // array.
+  i32 ChunkArraySize() const { return (flags_ & (COMPONENT_FLAG_SHARED | COMPONENT_FLAG_CHUNK)) ? 0 : i32(size_); }
 };
 } // namespace game
\ No newline at end of file
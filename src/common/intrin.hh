@@ -16,4 +16,16 @@ inline u64 tzcnt_u64(u64 v) {
   // https://stackoverflow.com/questions/62348210/bitscanforward64-can-not-be-found#comment110268539_62348210
   return _tzcnt_u64(v);
 }
+
+// Count the number of leading zero bits in unsigned 64-bit integer
+// https://en.wikipedia.org/wiki/X86_Bit_manipulation_instruction_set ABM
+inline u64 lzcnt_u64(u64 v) {
+  return _lzcnt_u64(v);
+}
+
+// Count the number of set bits in unsigned 64-bit integer
+// https://en.wikipedia.org/wiki/X86_Bit_manipulation_instruction_set ABM
+inline u64 popcnt_u64(u64 v) {
+  return u64(_mm_popcnt_u64(v));
+}
 } // namespace game
@@ -141,5 +141,13 @@ template <typename T> struct List {
   T* end() {
     return ptr_ + len_;
   }
+
+  const T* begin() const {
+    return ptr_;
+  }
+
+  const T* end() const {
+    return ptr_ + len_;
+  }
 };
 } // namespace game
\ No newline at end of file
@@ -79,6 +79,9 @@ enum {
   // When the CPU fetches from memory it doesn't fetch a byte or a word it fetches a cache line. In a multi-core system, if a cache line is shared, a cache coherency protocol must be used to maintain a coherent view of the data. Cache coherency protocols can kill performance (see false sharing) and sometimes, by taking up a whole cache line, we can ensure that data is not shared by accident.
   MEM_CACHE_LINE_SIZE = 64,
   MEM_CACHE_LINE_BITS = 6, // (1 << MEM_CACHE_LINE_BITS) == MEM_CACHE_LINE_SIZE
+
+  // The width of a SIMD register (AVX)
+  MEM_SIMD_SIZE = 32,
 };
 
 // Returns the smallest power of two greater than or equal to the input.
@@ -174,6 +177,32 @@ inline void MemZeroInit(void* block, i32 size) {
 // Test if block is zero initialized
 bool MemIsZero(const void* block, i32 size);
 
+// ---
+// Virtual memory (see mem_windows.cc and mem_linux.cc)
+// ---
+
+enum {
+  MEM_PAGE_SIZE      = 4 * 1024,
+  MEM_HUGE_PAGE_SIZE = 2 * 1024 * 1024, // x64 large page
+};
+
+// Reserve a range of virtual address space. No physical memory is used until a part of the range is committed and the range cannot be accessed before then.
+// On Linux, ranges that are at least MEM_HUGE_PAGE_SIZE are aligned to MEM_HUGE_PAGE_SIZE (for transparent huge pages).
+byte* MemReserve(size_t size);
+
+// Commit memory in a reserved range. The pointer and size must be multiples of the page size.
+// Committed memory is zero initialized (as long as it was not already committed) and physical pages are allocated on first touch.
+void MemCommit(void* ptr, size_t size);
+
+// Return the physical memory of a committed range to the OS. The range stays reserved and can be committed again.
+void MemDecommit(void* ptr, size_t size);
+
+// Hint that a reserved range should be backed by huge pages. This is transparent huge pages on Linux and does nothing on Windows (large pages require a privilege that we don't want to depend on).
+void MemAdviseHugePages(void* ptr, size_t size);
+
+// Release a reserved range. This must be the pointer and size that was used to reserve the range.
+void MemRelease(void* ptr, size_t size);
+
 template <typename T> T* MemResizeArray(Allocator allocator, T* old_ptr, i32 old_len, i32 new_len) {
   T* new_ptr = nullptr;
   if (0 < new_len) {
@@ -182,8 +211,8 @@ template <typename T> T* MemResizeArray(Allocator allocator, T* old_ptr, i32 old
       memcpy(new_ptr, old_ptr, i32(sizeof(T)) * old_len);
     }
   }
-  if (0 < old_len) {
-    MemFree(allocator, old_ptr);
+  if (old_ptr != nullptr) {
+    MemFree(allocator, old_ptr); // an emptied array still owns its memory
   }
   return new_ptr;
 }
@@ -0,0 +1,62 @@
+#include "mem.hh"
+
+#include <sys/mman.h>
+
+#include <cstdlib>
+
+using namespace game;
+
+byte* game::MemReserve(size_t size) {
+  // Over reserve so that we can trim the range to a huge page boundary. A transparent huge page can only be used for a huge page aligned part of the range.
+  size_t alignment = size < MEM_HUGE_PAGE_SIZE ? MEM_PAGE_SIZE : MEM_HUGE_PAGE_SIZE;
+  size_t padded    = size + alignment - MEM_PAGE_SIZE;
+
+  // MAP_NORESERVE, address space is not backed by swap until it is committed
+  void* ptr = mmap(nullptr, padded, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (ptr == MAP_FAILED) {
+    assert(false && "cannot reserve virtual memory");
+    abort();
+  }
+
+  byte* begin   = (byte*)ptr;
+  byte* aligned = (byte*)MemAlign(size_t(begin), alignment);
+  byte* end     = begin + padded;
+
+  if (begin < aligned) {
+    munmap(begin, size_t(aligned - begin));
+  }
+  if (aligned + size < end) {
+    munmap(aligned + size, size_t(end - (aligned + size)));
+  }
+
+  return aligned;
+}
+
+void game::MemCommit(void* ptr, size_t size) {
+  // Anonymous memory is zero initialized by the kernel when first touched. There's nothing to allocate upfront.
+  if (mprotect(ptr, size, PROT_READ | PROT_WRITE) != 0) {
+    assert(false && "cannot commit virtual memory");
+    abort();
+  }
+}
+
+void game::MemDecommit(void* ptr, size_t size) {
+  // MADV_DONTNEED drops the pages. The next time the range is touched it is backed by zero pages again.
+  if ((madvise(ptr, size, MADV_DONTNEED) != 0) || (mprotect(ptr, size, PROT_NONE) != 0)) {
+    assert(false && "cannot decommit virtual memory");
+    abort();
+  }
+}
+
+void game::MemAdviseHugePages(void* ptr, size_t size) {
+#ifdef MADV_HUGEPAGE
+  madvise(ptr, size, MADV_HUGEPAGE); // this is only a hint, transparent huge pages may be disabled
+#endif
+}
+
+void game::MemRelease(void* ptr, size_t size) {
+  if (munmap(ptr, size) != 0) {
+    assert(false && "cannot release virtual memory");
+    abort();
+  }
+}
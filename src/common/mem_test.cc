@@ -50,5 +50,23 @@ int main(int argc, char* argv[]) {
     MemFree(MEM_ALLOC_HEAP, align_as_8);
   }
 
+  TEST_CASE("MemReserve") {
+    const size_t size = 4 * MEM_HUGE_PAGE_SIZE;
+
+    byte* ptr = MemReserve(size);
+    ASSERT_TRUE(ptr);
+
+    MemCommit(ptr + MEM_HUGE_PAGE_SIZE, MEM_HUGE_PAGE_SIZE);
+    ASSERT_TRUE(MemIsZero(ptr + MEM_HUGE_PAGE_SIZE, MEM_HUGE_PAGE_SIZE));
+    memset(ptr + MEM_HUGE_PAGE_SIZE, 0xCD, MEM_HUGE_PAGE_SIZE);
+
+    // memory is zero initialized when it is committed again
+    MemDecommit(ptr + MEM_HUGE_PAGE_SIZE, MEM_HUGE_PAGE_SIZE);
+    MemCommit(ptr + MEM_HUGE_PAGE_SIZE, MEM_HUGE_PAGE_SIZE);
+    ASSERT_TRUE(MemIsZero(ptr + MEM_HUGE_PAGE_SIZE, MEM_HUGE_PAGE_SIZE));
+
+    MemRelease(ptr, size);
+  }
+
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,42 @@
+#include "mem.hh"
+
+#include <Windows.h> // todo: use a common include file for windows...
+
+#include <cstdlib>
+
+using namespace game;
+
+byte* game::MemReserve(size_t size) {
+  void* ptr = VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+  if (ptr == nullptr) {
+    assert(false && "cannot reserve virtual memory");
+    abort();
+  }
+  return (byte*)ptr;
+}
+
+void game::MemCommit(void* ptr, size_t size) {
+  // Committed pages are zero initialized and the physical memory is not allocated until the page is first touched
+  if (VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE) == nullptr) {
+    assert(false && "cannot commit virtual memory");
+    abort();
+  }
+}
+
+void game::MemDecommit(void* ptr, size_t size) {
+  if (!VirtualFree(ptr, size, MEM_DECOMMIT)) {
+    assert(false && "cannot decommit virtual memory");
+    abort();
+  }
+}
+
+void game::MemAdviseHugePages(void* ptr, size_t size) {
+  // Large pages require SeLockMemoryPrivilege and must be allocated upfront (MEM_LARGE_PAGES), we don't do that
+}
+
+void game::MemRelease(void* ptr, size_t size) {
+  if (!VirtualFree(ptr, 0, MEM_RELEASE)) { // size must be zero when releasing
+    assert(false && "cannot release virtual memory");
+    abort();
+  }
+}
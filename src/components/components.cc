@@ -7,10 +7,11 @@ using namespace game;
 Slice<const TypeInfo> game::GetComponentTypeInfoArray() {
   static const TypeInfo components[] = {
     GAME_COMPONENT(Entity),
-    GAME_COMPONENT(LocalToWorld),
-    GAME_COMPONENT(Rotation),
-    GAME_COMPONENT(Scale),
-    GAME_COMPONENT(Translation),
+    GAME_COMPONENT_FLAGS(ChunkWorldBounds, COMPONENT_FLAG_CHUNK),
+    GAME_COMPONENT_FLAGS(LocalToWorld, COMPONENT_FLAG_HOT),
+    GAME_COMPONENT_FLAGS(Rotation, COMPONENT_FLAG_HOT),
+    GAME_COMPONENT_FLAGS(Scale, COMPONENT_FLAG_HOT),
+    GAME_COMPONENT_FLAGS(Translation, COMPONENT_FLAG_HOT),
   };
   return slice::FromArray(components);
 }
@@ -6,26 +6,33 @@
 #include "../math/data.hh"
 
 namespace game {
-struct LocalToWorld {
+struct ChunkWorldBounds {
   enum { COMPONENT_TYPE = 1 };
 
+  vec3 min_;
+  vec3 max_;
+};
+
+struct LocalToWorld {
+  enum { COMPONENT_TYPE = 2 };
+
   mat4 value_;
 };
 
 struct Rotation {
-  enum { COMPONENT_TYPE = 2 };
+  enum { COMPONENT_TYPE = 3 };
 
   quat value_;
 };
 
 struct Scale {
-  enum { COMPONENT_TYPE = 3 };
+  enum { COMPONENT_TYPE = 4 };
 
   f32 value_;
 };
 
 struct Translation {
-  enum { COMPONENT_TYPE = 4 };
+  enum { COMPONENT_TYPE = 5 };
 
   vec3 value_;
 };
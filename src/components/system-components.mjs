@@ -1,9 +1,12 @@
 // This is where we define all built-in system components
 // non specific game components
 
-import { DataComponent, f32, mat4, quat, vec3 } from "../../scripts/component-types.mjs"
+import { ChunkComponent, DataComponent, f32, mat4, quat, vec3 } from "../../scripts/component-types.mjs"
 
-export const Translation = new DataComponent({ value: vec3 })
-export const Rotation = new DataComponent({ value: quat })
-export const Scale = new DataComponent({ value: f32 })
-export const LocalToWorld = new DataComponent({ value: mat4 })
+export const Translation = new DataComponent({ value: vec3 }, { hot: true })
+export const Rotation = new DataComponent({ value: quat }, { hot: true })
+export const Scale = new DataComponent({ value: f32 }, { hot: true })
+export const LocalToWorld = new DataComponent({ value: mat4 }, { hot: true })
+
+// The bounds of the world space positions of all entities in a chunk (see ChunkWorldBoundsSystem)
+export const ChunkWorldBounds = new ChunkComponent({ min: vec3, max: vec3 })
@@ -2,11 +2,154 @@
 
 using namespace game;
 
-void ArchetypeChunkData::Create(i32 component_count, i32 chunk_entity_capacity) {
+namespace {
+i32 CacheLineChunkLayout(const TypeInfo* const* types, i32 types_len, i32 chunk_buffer_size, i32* offsets) {
+  auto CalculateSpaceRequirement = [types, types_len](i32 entity_count) -> i32 {
+    i32 size = 0;
+    for (i32 i = 0; i < types_len; i++) {
+      size += i32(MemAlign(types[i]->ChunkArraySize() * entity_count, MEM_CACHE_LINE_SIZE));
+    }
+    return size;
+  };
+
+  i32 total_size = 0;
+  for (i32 i = 0; i < types_len; i++) {
+    total_size += types[i]->ChunkArraySize();
+  }
+  // guess
+  i32 capacity = chunk_buffer_size / total_size;
+  // adjust
+  while (!(CalculateSpaceRequirement(capacity) < chunk_buffer_size)) {
+    capacity--;
+  }
+  capacity = Min(capacity, chunk_buffer_size / i32(sizeof(Entity)));
+
+  if (offsets != nullptr) {
+    i32 used_bytes = 0; // relative chunk buffer
+    for (i32 i = 0; i < types_len; i++) {
+      offsets[i] = types[i]->ChunkArraySize() == 0 ? 0 : used_bytes; // tag and shared components have no array
+      used_bytes += i32(MemAlign(types[i]->ChunkArraySize() * capacity, MEM_CACHE_LINE_SIZE));
+    }
+  }
+
+  return capacity;
+}
+
+i32 PackedArrayAlignment(const TypeInfo* type) {
+  return (type->flags_ & COMPONENT_FLAG_HOT) ? Max(i32(type->alignment_), i32(MEM_SIMD_SIZE)) : i32(type->alignment_);
+}
+
+// Component arrays are ordered by alignment, largest first. The size of a type is a multiple of its alignment and
+// alignments are powers of two so every array starts at its alignment without any padding in between. The exceptions
+// are hot arrays, which are aligned and padded to SIMD width, and the entity array which must come first and is padded
+// to the largest alignment of the arrays that follow it.
+i32 PackedChunkLayout(const TypeInfo* const* types, i32 types_len, i32 chunk_buffer_size, i32* offsets) {
+  i32 max_alignment = 0;
+  i32 total_size    = 0;
+  for (i32 i = 0; i < types_len; i++) {
+    max_alignment = Max(max_alignment, PackedArrayAlignment(types[i]));
+    total_size += types[i]->ChunkArraySize();
+  }
+
+  auto CalculateSpaceRequirement = [types, types_len, max_alignment](i32 entity_count) -> i32 {
+    i32 size = i32(MemAlign(types[0]->ChunkArraySize() * entity_count, max_alignment));
+    for (i32 i = 1; i < types_len; i++) {
+      size += i32(MemAlign(types[i]->ChunkArraySize() * entity_count, PackedArrayAlignment(types[i])));
+    }
+    return size;
+  };
+
+  // Without padding this is exactly the number of entities that fit. The padding is less than the sum of the alignments
+  // so this is only ever off by a few entities.
+  i32 capacity = Min(chunk_buffer_size / total_size, chunk_buffer_size / i32(sizeof(Entity)));
+  while (chunk_buffer_size < CalculateSpaceRequirement(capacity)) {
+    capacity--;
+  }
+
+  if (offsets != nullptr) {
+    // stable insertion sort by alignment, largest first
+    auto order = MemStackalloc(i32, types_len - 1, types_len);
+    for (i32 i = 1; i < types_len; i++) {
+      i32 j = i - 1;
+      for (; (0 < j) && (PackedArrayAlignment(types[order[j - 1]]) < PackedArrayAlignment(types[i])); j--) {
+        order[j] = order[j - 1];
+      }
+      order[j] = i;
+    }
+
+    offsets[0]     = 0;
+    i32 used_bytes = i32(MemAlign(types[0]->ChunkArraySize() * capacity, max_alignment));
+    for (i32 i : order) {
+      offsets[i] = types[i]->ChunkArraySize() == 0 ? 0 : used_bytes; // tag and shared components have no array
+      used_bytes += i32(MemAlign(types[i]->ChunkArraySize() * capacity, PackedArrayAlignment(types[i])));
+    }
+
+    assert(used_bytes <= chunk_buffer_size);
+  }
+
+  return capacity;
+}
+} // namespace
+
+i32 game::ArchetypeChunkLayout(
+    ArchetypeLayout        layout,
+    const TypeInfo* const* types,
+    i32                    types_len,
+    i32                    chunk_buffer_size,
+    i32*                   offsets) {
+  // Tag components take up no space but the entity array is always there so every entity takes up some space
+  assert((0 < types_len) && (types[0]->type_id_ == GetComponentTypeId<Entity>()));
+
+  // Chunk components are stored once at the end of the chunk buffer, the component arrays get what's left
+  const i32 chunk_components_size = ChunkComponentsSize(types, types_len);
+  const i32 component_arrays_size = chunk_buffer_size - chunk_components_size;
+  i32       capacity              = 0;
+
+  switch (layout) {
+  case ARCHETYPE_LAYOUT_CACHE_LINE:
+    capacity = CacheLineChunkLayout(types, types_len, component_arrays_size, offsets);
+    break;
+  case ARCHETYPE_LAYOUT_PACKED:
+    capacity = PackedChunkLayout(types, types_len, component_arrays_size, offsets);
+    break;
+  default:
+    assert(false && "unknown archetype layout");
+    return 0;
+  }
+
+  if (offsets != nullptr) {
+    i32 used_bytes = component_arrays_size;
+    for (i32 i = 0; i < types_len; i++) {
+      if (types[i]->flags_ & COMPONENT_FLAG_CHUNK) {
+        used_bytes = i32(MemAlign(used_bytes, types[i]->alignment_));
+        offsets[i] = used_bytes;
+        used_bytes += types[i]->size_;
+      }
+    }
+    assert(used_bytes <= chunk_buffer_size);
+  }
+
+  return capacity;
+}
+
+i32 game::ChunkComponentsSize(const TypeInfo* const* types, i32 types_len) {
+  i32 size = 0;
+  for (i32 i = 0; i < types_len; i++) {
+    if (types[i]->flags_ & COMPONENT_FLAG_CHUNK) {
+      size = i32(MemAlign(size, types[i]->alignment_)) + types[i]->size_;
+    }
+  }
+  return i32(MemAlign(size, MEM_CACHE_LINE_SIZE));
+}
+
+void ArchetypeChunkData::Create(
+    i32 component_count, i32 shared_component_count, i32 enableable_component_count, i32 chunk_entity_capacity) {
   MemZeroInit(this);
 
-  component_count_       = component_count;
-  chunk_entity_capacity_ = chunk_entity_capacity;
+  component_count_            = component_count;
+  shared_component_count_     = shared_component_count;
+  enableable_component_count_ = enableable_component_count;
+  chunk_entity_capacity_      = chunk_entity_capacity;
 }
 
 void ArchetypeChunkData::Destroy() {
@@ -14,13 +157,15 @@ void ArchetypeChunkData::Destroy() {
     MemFree(MEM_ALLOC_HEAP, ptr_);
     ptr_ = nullptr;
   }
-  len_                   = 0;
-  cap_                   = 0;
-  component_count_       = 0;
-  chunk_entity_capacity_ = 0;
+  len_                        = 0;
+  cap_                        = 0;
+  component_count_            = 0;
+  shared_component_count_     = 0;
+  enableable_component_count_ = 0;
+  chunk_entity_capacity_      = 0;
 }
 
-void ArchetypeChunkData::Add(Chunk* chunk, u32 change_version) {
+void ArchetypeChunkData::Add(Chunk* chunk, u32 change_version, const i32* shared_values) {
   if (!(len_ < cap_)) {
     auto temp = *this;
 
@@ -28,8 +173,16 @@ void ArchetypeChunkData::Add(Chunk* chunk, u32 change_version) {
     ptr_ = MemAlloc(MEM_ALLOC_HEAP, _BufferSize(), 16);
 
     MemCopy(ChunkPtrArray(), temp.ChunkPtrArray(), temp._ChunkPtrArraySize());
-    MemCopy(ChangeVersionArray(), temp.ChangeVersionArray(), temp._ChangeVersionArraySize());
+    for (int i = 0; i < enableable_component_count_; i++) {
+      MemCopy(EnabledBits(i, 0), temp.EnabledBits(i, 0), 8 * temp.cap_ * EnabledWords());
+    }
+    for (int i = 0; i < component_count_; i++) {
+      MemCopy(ChangeVersionArray(i), temp.ChangeVersionArray(i), 4 * temp.cap_); // the rows are cap_ apart
+    }
     MemCopy(EntityCountArray(), temp.EntityCountArray(), temp._EntityCountArraySize());
+    for (int i = 0; i < shared_component_count_; i++) {
+      MemCopy(SharedValueArray(i), temp.SharedValueArray(i), 4 * temp.cap_);
+    }
 
     temp.Destroy();
 
@@ -52,6 +205,38 @@ void ArchetypeChunkData::Add(Chunk* chunk, u32 change_version) {
   }
 
   EntityCountArray()[chunk_index] = chunk->EntityCount();
+
+  for (int i = 0; i < shared_component_count_; i++) {
+    SharedValueArray(i)[chunk_index] = shared_values != nullptr ? shared_values[i] : 0;
+  }
+
+  for (int i = 0; i < enableable_component_count_; i++) {
+    memset(EnabledBits(i, chunk_index), 0, size_t(8 * EnabledWords()));
+  }
+}
+
+void ArchetypeChunkData::RemoveAtSwapBack(i32 chunk_index) {
+  assert((0 <= chunk_index) & (chunk_index < len_));
+
+  const int last_index = --len_;
+  if (chunk_index < last_index) {
+    Chunk* last_chunk               = ChunkPtrArray()[last_index];
+    last_chunk->header_.list_index_ = chunk_index;
+    ChunkPtrArray()[chunk_index]    = last_chunk;
+    EntityCountArray()[chunk_index] = EntityCountArray()[last_index];
+
+    for (int i = 0; i < component_count_; i++) {
+      ChangeVersionArray(i)[chunk_index] = ChangeVersionArray(i)[last_index];
+    }
+
+    for (int i = 0; i < shared_component_count_; i++) {
+      SharedValueArray(i)[chunk_index] = SharedValueArray(i)[last_index];
+    }
+
+    for (int i = 0; i < enableable_component_count_; i++) {
+      MemCopy(EnabledBits(i, chunk_index), EnabledBits(i, last_index), 8 * EnabledWords());
+    }
+  }
 }
 
 Archetype* ArchetypeListMap::TryGet(Slice<const ComponentTypeId> types) {
@@ -12,25 +12,74 @@ struct EntityQuery;
 struct Archetype;
 struct ArchetypeChunkData;
 
+// How component arrays are laid out in the chunks of an archetype
+enum ArchetypeLayout {
+  // Every component array starts on a cache line
+  ARCHETYPE_LAYOUT_CACHE_LINE,
+
+  // Component arrays are ordered by alignment and only padded to their natural alignment (SIMD width for hot components)
+  ARCHETYPE_LAYOUT_PACKED,
+};
+
+// Compute the number of entities that fit in a chunk buffer and, if offsets is not null, the offset of each component array.
+// The first type must be Entity, the entity array is always found at the beginning of the chunk buffer.
+// Tag and shared components have no array and an offset of 0. Chunk components are found at the end of the chunk
+// buffer.
+i32 ArchetypeChunkLayout(
+    ArchetypeLayout        layout,
+    const TypeInfo* const* types,
+    i32                    types_len,
+    i32                    chunk_buffer_size,
+    i32*                   offsets);
+
+// The number of bytes at the end of the chunk buffer that are set aside for chunk components (a multiple of the cache
+// line size)
+i32 ChunkComponentsSize(const TypeInfo* const* types, i32 types_len);
+
+// How well the chunks of one or more archetypes are utilized
+struct ChunkOccupancy {
+  i32 entity_count_;
+  i32 entity_capacity_; // The total capacity of all chunks
+  i32 chunk_count_;
+
+  // The fraction of entity slots in use (an empty set of chunks is considered fully occupied)
+  f32 Ratio() const { return 0 < entity_capacity_ ? f32(entity_count_) / f32(entity_capacity_) : 1.0f; }
+
+  void Add(const ChunkOccupancy& other) {
+    entity_count_ += other.entity_count_;
+    entity_capacity_ += other.entity_capacity_;
+    chunk_count_ += other.chunk_count_;
+  }
+};
+
+// Is the change version newer than version (change versions wrap around)
+inline bool DidChange(u32 change_version, u32 version) {
+  return 0 < i32(change_version - version);
+}
+
 // The first time an entity of a particular archetype is added to the chunk it will be added to this data
 struct ArchetypeChunkData {
   // This is just a bunch of arrays concatenated after each other
   // this has been done to minimize the number of allocations
 
   // Chunk* chunks_[];
+  // u64    enabled_bits_[];
   // u32    change_version_[];
   // u32    entity_count_[];
-  // shared component data could go here...
+  // i32    shared_value_index_[];
 
   void* ptr_;
   i32   len_;
   i32   cap_;
-  i32   component_count_;       // Same as Archetype::component_count_ (the number of component types in the archetype)
-  i32   chunk_entity_capacity_; // Same as Archetype::chunk_entity_capacity_
+  i32   component_count_;            // The number of component types in the archetype (Archetype::types_len_)
+  i32   shared_component_count_;     // Same as Archetype::shared_types_len_
+  i32   enableable_component_count_; // Same as Archetype::enableable_types_len_
+  i32   chunk_entity_capacity_;      // Same as Archetype::chunk_entity_capacity_
 
   // ---
 
-  void Create(i32 component_count, i32 chunk_entity_capacity);
+  void Create(
+      i32 component_count, i32 shared_component_count, i32 enableable_component_count, i32 chunk_entity_capacity);
 
   void Destroy();
 
@@ -40,7 +89,11 @@ struct ArchetypeChunkData {
 
   i32 Cap() const { return cap_; }
 
-  void Add(Chunk* chunk, u32 change_version);
+  // The chunk gets one shared value index per shared component type of the archetype (null means the zero values)
+  void Add(Chunk* chunk, u32 change_version, const i32* shared_values);
+
+  // Remove the chunk at index by moving the last chunk into its place
+  void RemoveAtSwapBack(i32 chunk_index);
 
   // ---
 
@@ -48,8 +101,19 @@ struct ArchetypeChunkData {
 
   i32 _ChunkPtrArraySize() const { return i32(sizeof(Chunk**)) * cap_; }
 
+  // Enableable component types have an enabled bit per entity. The bits of a chunk are EnabledWords() words, a multiple
+  // of SIMD width, and the bits beyond the entity count of the chunk are always clear.
+  i32 EnabledWords() const { return i32(MemAlign(chunk_entity_capacity_, 256)) / 64; }
+
+  u64* EnabledBits(i32 archetype_enableable_type_index, i32 chunk_index) const {
+    return (u64*)((byte*)ptr_ + _ChunkPtrArraySize())
+           + (archetype_enableable_type_index * cap_ + chunk_index) * EnabledWords();
+  }
+
+  i32 _EnabledBitsSize() const { return 8 * enableable_component_count_ * cap_ * EnabledWords(); }
+
   // Each component type has it's own change version in the chunk metadata
-  u32* ChangeVersionArray() const { return (u32*)((byte*)ptr_ + _ChunkPtrArraySize()); }
+  u32* ChangeVersionArray() const { return (u32*)((byte*)ptr_ + _ChunkPtrArraySize() + _EnabledBitsSize()); }
 
   // Find the change version array for a sequence of chunks based on the component type index for the archetype
   u32* ChangeVersionArray(i32 archetype_component_type_index) const {
@@ -58,50 +122,143 @@ struct ArchetypeChunkData {
 
   i32 _ChangeVersionArraySize() const { return 4 * component_count_ * cap_; }
 
-  i32* EntityCountArray() const { return (i32*)((byte*)ptr_ + _ChunkPtrArraySize() + _ChangeVersionArraySize()); }
+  i32* EntityCountArray() const { return (i32*)((byte*)ChangeVersionArray() + _ChangeVersionArraySize()); }
 
   i32 _EntityCountArraySize() const { return 4 * cap_; }
 
+  // The shared component values of the chunks are indices into the shared component store of the entity manager. They
+  // are stored like the change versions, one array per shared component type of the archetype.
+  i32* SharedValueArray(i32 archetype_shared_type_index) const {
+    return (i32*)((byte*)EntityCountArray() + _EntityCountArraySize()) + archetype_shared_type_index * cap_;
+  }
+
+  i32 _SharedValueArraySize() const { return 4 * shared_component_count_ * cap_; }
+
+  // Copy the shared values of the chunk at chunk_index to values
+  void GetSharedValues(i32 chunk_index, i32* values) const {
+    for (i32 i = 0; i < shared_component_count_; i++) {
+      values[i] = SharedValueArray(i)[chunk_index];
+    }
+  }
+
+  // Does the chunk at chunk_index have these shared values (null means the zero values)
+  bool HasSharedValues(i32 chunk_index, const i32* values) const {
+    for (i32 i = 0; i < shared_component_count_; i++) {
+      if (SharedValueArray(i)[chunk_index] != (values != nullptr ? values[i] : 0)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
   // ---
 
   // The total allocated bytes of this buffer
   i32 _BufferSize() const {
-    return _ChunkPtrArraySize() + _ChunkPtrArraySize() + _ChangeVersionArraySize() + _EntityCountArraySize();
+    return _ChunkPtrArraySize() + _EnabledBitsSize() + _ChangeVersionArraySize() + _EntityCountArraySize()
+           + _SharedValueArraySize();
   }
 };
 
+// A cached transition to the archetype that you get by adding or removing a component type
+struct ArchetypeEdge {
+  ComponentTypeId type_id_;
+  Archetype*      add_;    // The archetype with type_id_ added (null until first needed)
+  Archetype*      remove_; // The archetype with type_id_ removed (null until first needed)
+};
+
 // as long as it is no virtual member it has a standard layout and we could make these non-copyable because it is a mistake to copy these...
 struct Archetype {
-  ComponentTypeId*   types_;
-  i32                types_len_;
-  u16*               sizes_;                  // size of each component
-  i32*               offsets_;                // offset to component data array in chunk
-  i32                chunk_entity_capacity_;  // Maximum number of entities per chunk
-  ArchetypeChunkData chunk_data_;             // chunks?
-  List<Chunk*>       chunk_with_empty_slots_; // Chunk free list (chunks that have space)
-  i32                entity_count_;           // number of entities allocated of this archetype
-  const char*        label_;
-  List<EntityQuery*> matching_queries_;
+  ComponentTypeId*    types_;
+  i32                 types_len_;
+  u16*                sizes_;                   // size of each component
+  i32*                offsets_;                 // offset to component data array in chunk
+  ArchetypeLayout     layout_;                  // How the component arrays are laid out in the chunk
+  ChunkSizeClass      chunk_size_class_;        // The size of the chunks used by this archetype
+  i32                 chunk_entity_capacity_;   // Maximum number of entities per chunk
+  ArchetypeChunkData  chunk_data_;              // chunks?
+  List<Chunk*>        chunk_with_empty_slots_;  // Chunk free list (chunks that have space)
+  i32                 entity_count_;            // number of entities allocated of this archetype
+  const char*         label_;
+  List<EntityQuery*>  matching_queries_;
+  List<ArchetypeEdge> edges_;                   // Cached structural changes (add/remove component type)
+  ComponentTypeId*    shared_types_;            // The shared component types of the archetype (a subset of types_)
+  i32                 shared_types_len_;
+  i32                 chunk_components_offset_; // Chunk component data is found at the end of the chunk buffer
+  i32                 chunk_components_size_;   // Zero if the archetype has no chunk components
+  i32*                buffer_type_indices_;     // Indices (into types_) of the buffer component types
+  i32                 buffer_types_len_;
+  ComponentTypeId*    enableable_types_;        // The enableable component types of the archetype (a subset of types_)
+  i32                 enableable_types_len_;
+  i16*                index_by_type_;           // The index into types_ of every registered component type (or -1)
+  i32                 index_by_type_len_;       // The number of registered component types
+  i16*                shared_index_;            // The index into shared_types_ of each of types_ (or -1)
+  i16*                enableable_index_;        // The index into enableable_types_ of each of types_ (or -1)
+  u64*                type_mask_;               // The component types as a mask (see ComponentRegistry::TypeMaskWords)
+  i32                 type_mask_words_;
+
+  // The most shared component types an archetype can have
+  static const i32 SHARED_COMPONENT_MAX = 8;
 
   // The type identity of an archetype is a sorted set of component types
   Slice<const ComponentTypeId> TypeId() const { return { types_, types_len_, types_len_ }; }
 
-  // // Find the index of the component type within this archetype. If the component type is not present the return value is -1
-  // i32 _FindComponentTypeIndex(ComponentTypeId type_id) const {
-  //   ComponentTypeId* types     = types_;
-  //   i32              types_len = types_len_;
-  //   for (i32 i = 0; i < types_len; i++) {
-  //     if (types[i] == type_id) {
-  //       return i;
-  //     }
-  //   }
-  //   return -1;
-  // }
+  ChunkOccupancy Occupancy() const {
+    return { entity_count_, chunk_data_.Len() * chunk_entity_capacity_, chunk_data_.Len() };
+  }
+
+  // Find the index of the component type within this archetype, -1 if the archetype doesn't have the component type
+  i32 _TypeIndex(ComponentTypeId type_id) const {
+    return type_id.Index() < index_by_type_len_ ? index_by_type_[type_id.Index()] : -1;
+  }
+
+  bool _HasComponentType(ComponentTypeId type_id) const { return _TypeIndex(type_id) != -1; }
+
+  // Find the index of the shared component type within the shared component types of this archetype, -1 if the
+  // archetype doesn't have the shared component type
+  i32 _SharedComponentIndex(ComponentTypeId type_id) const {
+    const i32 i = _TypeIndex(type_id);
+    return i != -1 ? shared_index_[i] : -1;
+  }
+
+  // Find the index of the enableable component type within the enableable component types of this archetype, -1 if the
+  // archetype doesn't have the enableable component type
+  i32 _EnableableComponentIndex(ComponentTypeId type_id) const {
+    const i32 i = _TypeIndex(type_id);
+    return i != -1 ? enableable_index_[i] : -1;
+  }
+
+  // Find the edge for a component type, if there is no edge one is added
+  ArchetypeEdge* _GetEdge(ComponentTypeId type_id) {
+    for (auto& edge : edges_) {
+      if (edge.type_id_ == type_id) {
+        return &edge;
+      }
+    }
+    edges_.Add({ type_id, nullptr, nullptr });
+    return &edges_[edges_.Len() - 1];
+  }
+
+  void _AddChunkWithEmptySlots(Chunk* chunk) {
+    chunk->header_.free_list_index_ = chunk_with_empty_slots_.Len();
+    chunk_with_empty_slots_.Add(chunk);
+  }
+
+  void _RemoveChunkWithEmptySlots(Chunk* chunk) {
+    i32 free_list_index = chunk->header_.free_list_index_;
+    assert(chunk_with_empty_slots_[free_list_index] == chunk);
+    chunk_with_empty_slots_.RemoveAtSwapBack(free_list_index);
+    if (free_list_index < chunk_with_empty_slots_.Len()) {
+      chunk_with_empty_slots_[free_list_index]->header_.free_list_index_ = free_list_index;
+    }
+    chunk->header_.free_list_index_ = -1;
+  }
 
   void Destroy() {
     chunk_data_.Destroy();
     chunk_with_empty_slots_.Destroy();
     matching_queries_.Destroy();
+    edges_.Destroy();
   }
 };
 
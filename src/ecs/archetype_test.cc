@@ -2,20 +2,69 @@
 
 #include "archetype.hh"
 
+#include "../components/components.hh"
+
+#include <cstdio>
+
 using namespace game;
 
+namespace {
+struct Small {
+  enum { COMPONENT_TYPE = 1 };
+
+  f32 value_;
+};
+
+struct alignas(16) Medium {
+  enum { COMPONENT_TYPE = 2 };
+
+  f32 value_[4];
+};
+
+struct alignas(64) Large {
+  enum { COMPONENT_TYPE = 3 };
+
+  f32 value_[16];
+};
+
+// Call f(types, types_len, name) for every combination of the components in components.mjs (with the entity first)
+// until it returns false. Returns false if f did.
+template <typename F> bool ForEachComponentCombination(F f) {
+  auto components = GetComponentTypeInfoArray();
+
+  for (int mask = 1; mask < (1 << (components.Len() - 1)); mask++) {
+    const TypeInfo* types[16] = { &components[0] };
+    i32             types_len = 1;
+
+    char name[256] = "Entity";
+    for (int i = 1; i < components.Len(); i++) {
+      if (mask & (1 << (i - 1))) {
+        types[types_len++] = &components[i];
+        strcat(name, " ");
+        strcat(name, components[i].name_);
+      }
+    }
+
+    if (!f(types, types_len, name)) {
+      return false;
+    }
+  }
+  return true;
+}
+} // namespace
+
 int main(int argc, char* argv[]) {
   test_init(argc, argv);
 
   TEST_CASE("ArchetypeChunkDataTest") {
     ArchetypeChunkData data;
 
-    data.Create(1, 2040);
+    data.Create(1, 1, 0, 2040);
 
     Chunk chunk1;
     MemZeroInit(&chunk1);
 
-    data.Add(&chunk1, 1);
+    data.Add(&chunk1, 1, nullptr);
 
     ASSERT_EQUAL_PTR(&chunk1, data.ChunkPtrArray()[0]);
     ASSERT_EQUAL_U32(1, data.ChangeVersionArray(0)[0]);
@@ -24,7 +73,9 @@ int main(int argc, char* argv[]) {
     Chunk chunk2;
     MemZeroInit(&chunk2);
 
-    data.Add(&chunk2, 2);
+    const i32 shared_values[] = { 7 };
+
+    data.Add(&chunk2, 2, shared_values);
 
     ASSERT_EQUAL_PTR(&chunk1, data.ChunkPtrArray()[0]);
     ASSERT_EQUAL_U32(1, data.ChangeVersionArray(0)[0]);
@@ -34,6 +85,104 @@ int main(int argc, char* argv[]) {
     ASSERT_EQUAL_U32(2, data.ChangeVersionArray(0)[1]);
     ASSERT_EQUAL_U32(0, data.EntityCountArray()[1]);
 
+    ASSERT_EQUAL_I32(0, data.SharedValueArray(0)[0]);
+    ASSERT_EQUAL_I32(7, data.SharedValueArray(0)[1]);
+
+    data.RemoveAtSwapBack(0);
+
+    ASSERT_EQUAL_PTR(&chunk2, data.ChunkPtrArray()[0]);
+    ASSERT_EQUAL_I32(7, data.SharedValueArray(0)[0]);
+
+    data.Destroy();
+  }
+
+  TEST_CASE("ArchetypeChunkDataGrowTest") {
+    ArchetypeChunkData data;
+
+    data.Create(2, 0, 0, 2040);
+
+    Chunk chunks[5];
+
+    for (int i = 0; i < 3; i++) {
+      MemZeroInit(&chunks[i]);
+      data.Add(&chunks[i], u32(10 + i), nullptr);
+      data.ChangeVersionArray(1)[i] = u32(20 + i);
+    }
+
+    // the change versions of each component type are kept apart when the arrays grow
+    for (int i = 3; i < 5; i++) {
+      MemZeroInit(&chunks[i]);
+      data.Add(&chunks[i], u32(20 + i), nullptr);
+    }
+
+    for (int i = 0; i < 5; i++) {
+      ASSERT_EQUAL_PTR(&chunks[i], data.ChunkPtrArray()[i]);
+      ASSERT_EQUAL_U32(u32(i < 3 ? 10 + i : 20 + i), data.ChangeVersionArray(0)[i]);
+      ASSERT_EQUAL_U32(u32(20 + i), data.ChangeVersionArray(1)[i]);
+    }
+
     data.Destroy();
   }
+
+  TEST_CASE("ArchetypeChunkLayoutTest") {
+    const TypeInfo components[] = {
+      GAME_COMPONENT(Entity),
+      GAME_COMPONENT(Small),
+      GAME_COMPONENT_FLAGS(Medium, COMPONENT_FLAG_HOT),
+      GAME_COMPONENT(Large),
+    };
+
+    const TypeInfo* types[] = { &components[0], &components[1], &components[2], &components[3] };
+
+    i32 offsets[ArrayLength(types)];
+
+    // every array starts on a cache line
+    i32 capacity =
+        ArchetypeChunkLayout(ARCHETYPE_LAYOUT_CACHE_LINE, types, ArrayLength(types), CHUNK_BUFFER_SIZE, offsets);
+    ASSERT_EQUAL_I32(176, capacity);
+    for (int i = 0; i < ArrayLength(types); i++) {
+      ASSERT_EQUAL_I32(0, offsets[i] % MEM_CACHE_LINE_SIZE);
+    }
+
+    // entity array first, then by alignment: Large, Medium (hot) and Small
+    capacity = ArchetypeChunkLayout(ARCHETYPE_LAYOUT_PACKED, types, ArrayLength(types), CHUNK_BUFFER_SIZE, offsets);
+    ASSERT_EQUAL_I32(176, capacity);
+    ASSERT_EQUAL_I32(0, offsets[0]);
+    ASSERT_EQUAL_I32(MemAlign(8 * capacity, 64), offsets[3]);
+    ASSERT_EQUAL_I32(offsets[3] + 64 * capacity, offsets[2]);
+    ASSERT_EQUAL_I32(offsets[2] + MemAlign(16 * capacity, MEM_SIMD_SIZE), offsets[1]);
+    ASSERT_TRUE(offsets[1] + 4 * capacity <= CHUNK_BUFFER_SIZE);
+  }
+
+  TEST_CASE("ArchetypeChunkLayoutComponentsTest") {
+    // The packed layout never fits fewer entities per chunk, for every combination of the components in components.mjs
+
+    ASSERT_TRUE(ForEachComponentCombination([](const TypeInfo** types, i32 types_len, const char*) {
+      for (int size_class = 0; size_class < CHUNK_SIZE_CLASS_COUNT; size_class++) {
+        i32 chunk_buffer_size = ChunkBufferSize(ChunkSizeClass(size_class));
+        i32 cache_line = ArchetypeChunkLayout(ARCHETYPE_LAYOUT_CACHE_LINE, types, types_len, chunk_buffer_size, nullptr);
+        i32 packed     = ArchetypeChunkLayout(ARCHETYPE_LAYOUT_PACKED, types, types_len, chunk_buffer_size, nullptr);
+
+        if (packed < cache_line) {
+          return false;
+        }
+      }
+      return true;
+    }));
+  }
+
+#if ARCHETYPE_LAYOUT_REPORT
+  // Entities per default size chunk with both layouts, build with ARCHETYPE_LAYOUT_REPORT defined to print the table
+
+  printf("\n%-64s %10s %10s\n", "Archetype", "Cache line", "Packed");
+
+  ForEachComponentCombination([](const TypeInfo** types, i32 types_len, const char* name) {
+    i32 chunk_buffer_size = ChunkBufferSize(CHUNK_SIZE_CLASS_DEFAULT);
+    i32 cache_line = ArchetypeChunkLayout(ARCHETYPE_LAYOUT_CACHE_LINE, types, types_len, chunk_buffer_size, nullptr);
+    i32 packed     = ArchetypeChunkLayout(ARCHETYPE_LAYOUT_PACKED, types, types_len, chunk_buffer_size, nullptr);
+
+    printf("%-64s %10i %10i\n", name, cache_line, packed);
+    return true;
+  });
+#endif
 }
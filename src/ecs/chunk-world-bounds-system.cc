@@ -0,0 +1,43 @@
+#include "chunk-world-bounds-system.hh"
+
+using namespace game;
+
+namespace {
+struct ChunkWorldBoundsJobData {
+  ComponentDataReader<LocalToWorld>           local_to_world_handle_;
+  ComponentDataReaderWriter<ChunkWorldBounds> chunk_world_bounds_handle_;
+};
+
+void ChunkWorldBoundsJobKernel(ChunkWorldBoundsJobData& data, const SystemChunk& chunk) {
+  const LocalToWorld* local_to_world = chunk.GetArray(data.local_to_world_handle_);
+  ChunkWorldBounds*   bounds         = chunk.GetChunkComponentData(data.chunk_world_bounds_handle_);
+
+  // The position of an entity is the translation of its local to world transform
+  vec3 min = xyz(local_to_world[0].value_.c3);
+  vec3 max = min;
+  for (i32 i = 1; i < chunk.Len(); i++) {
+    const vec4& p = local_to_world[i].value_.c3;
+
+    min.x = p.x < min.x ? p.x : min.x;
+    min.y = p.y < min.y ? p.y : min.y;
+    min.z = p.z < min.z ? p.z : min.z;
+    max.x = max.x < p.x ? p.x : max.x;
+    max.y = max.y < p.y ? p.y : max.y;
+    max.z = max.z < p.z ? p.z : max.z;
+  }
+
+  bounds->min_ = min;
+  bounds->max_ = max;
+}
+} // namespace
+
+void ChunkWorldBoundsSystem::OnCreate(SystemState& state) {
+  // Chunks where nothing has moved keep their bounds
+  q_ = state.EntityManager().CreateQuery(
+      { ComponentDataAccess::Read<LocalToWorld>().WithChangeFilter(), ComponentDataAccess::Write<ChunkWorldBounds>() });
+}
+
+void ChunkWorldBoundsSystem::OnUpdate(SystemState& state) {
+  ChunkWorldBoundsJobData data{};
+  ExecuteJob(q_, data, ChunkWorldBoundsJobKernel);
+}
\ No newline at end of file
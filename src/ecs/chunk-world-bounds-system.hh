@@ -0,0 +1,26 @@
+#pragma once
+
+#include "system.hh"
+
+#include "../components/components.hh"
+
+namespace game {
+struct EntityQuery;
+
+// Keeps the ChunkWorldBounds chunk component up to date. The bounds of a chunk are only recomputed when the
+// LocalToWorld data of the chunk has changed since the last update.
+struct ChunkWorldBoundsSystem : public System {
+  EntityQuery* q_;
+
+  void OnCreate(SystemState& state) override;
+
+  void OnUpdate(SystemState& state) override;
+};
+
+// Does the box [min, max] overlap the bounds of the chunk. When it doesn't none of the entities in the chunk need to be
+// looked at.
+inline bool Overlaps(const ChunkWorldBounds& bounds, const vec3& min, const vec3& max) {
+  return (bounds.min_.x <= max.x) & (min.x <= bounds.max_.x) & (bounds.min_.y <= max.y) & (min.y <= bounds.max_.y)
+         & (bounds.min_.z <= max.z) & (min.z <= bounds.max_.z);
+}
+} // namespace game
\ No newline at end of file
@@ -0,0 +1,89 @@
+#include "../test/test.h"
+
+#include "chunk-world-bounds-system.hh"
+
+#include "world.hh"
+
+using namespace game;
+
+namespace {
+ChunkWorldBounds* GetChunkWorldBounds(EntityManager& entity_manager, Entity entity) {
+  Chunk*     chunk     = entity_manager._Record(entity.index_).chunk_;
+  Archetype& archetype = chunk->Archetype();
+  for (int i = 0; i < archetype.types_len_; i++) {
+    if (archetype.types_[i] == GetComponentTypeId<ChunkWorldBounds>()) {
+      return (ChunkWorldBounds*)((byte*)chunk->Buffer() + archetype.offsets_[i]);
+    }
+  }
+  return nullptr;
+}
+
+LocalToWorld At(f32 x, f32 y, f32 z) {
+  LocalToWorld local_to_world;
+  local_to_world.value_    = mat4::Identity();
+  local_to_world.value_.c3 = { x, y, z, 1 };
+  return local_to_world;
+}
+} // namespace
+
+int main(int argc, char* argv[]) {
+  test_init(argc, argv);
+
+  TEST_CASE("ChunkWorldBoundsSystemTest") {
+    World world;
+
+    world.Create(GetComponentTypeInfoArray());
+
+    EntityManager& m = world.EntityManager();
+
+    Archetype* archetype = m.CreateArchetype({ GetComponentTypeId<LocalToWorld>() });
+
+    Entity entities[3];
+    m.CreateEntities(archetype, entities, 3);
+
+    m.SetComponentData(entities[0], At(1, 2, 3));
+    m.SetComponentData(entities[1], At(-1, 5, 0));
+    m.SetComponentData(entities[2], At(4, -2, 1));
+
+    // the chunk component is added to the existing chunk, it is stored at the end of the chunk buffer
+    auto query = m.CreateQuery({ ComponentDataAccess::Read<LocalToWorld>() });
+    m.AddComponent<ChunkWorldBounds>(query);
+
+    Archetype* bounds_archetype = m.CreateArchetype(
+        { GetComponentTypeId<LocalToWorld>(), GetComponentTypeId<ChunkWorldBounds>() });
+
+    ASSERT_EQUAL_I32(3, bounds_archetype->entity_count_);
+    ASSERT_EQUAL_I32(MEM_CACHE_LINE_SIZE, bounds_archetype->chunk_components_size_);
+    ASSERT_TRUE(bounds_archetype->chunk_entity_capacity_ < archetype->chunk_entity_capacity_);
+
+    ChunkWorldBoundsSystem system{};
+
+    world.Register(&system);
+    world.Update();
+
+    ChunkWorldBounds* bounds = GetChunkWorldBounds(m, entities[0]);
+
+    ASSERT_TRUE((bounds->min_.x == -1) & (bounds->min_.y == -2) & (bounds->min_.z == 0));
+    ASSERT_TRUE((bounds->max_.x == 4) & (bounds->max_.y == 5) & (bounds->max_.z == 3));
+
+    ASSERT_TRUE(Overlaps(*bounds, { 3, 3, 0 }, { 5, 5, 1 }));
+    ASSERT_FALSE(Overlaps(*bounds, { 5, 0, 0 }, { 6, 1, 1 }));
+
+    // nothing has changed, the bounds are left alone
+    bounds->max_.x = 100;
+    world.Update();
+    ASSERT_TRUE(bounds->max_.x == 100);
+
+    // an entity has moved
+    m.SetComponentData(entities[1], At(8, 0, 0));
+    world.Update();
+    ASSERT_TRUE(bounds->max_.x == 8);
+
+    // an entity is gone
+    m.DestroyEntity(entities[1]);
+    world.Update();
+    ASSERT_TRUE(bounds->max_.x == 4);
+
+    world.Destroy();
+  }
+}
@@ -4,62 +4,356 @@
 
 using namespace game;
 
-Chunk* ChunkAllocator::Allocate() {
-  for (int i = 0; i < MEGA_CHUNK_MAX; i++) {
-    auto use = chunk_use_[i];
-    if (use & 0x0000000000000001ULL) {
-      continue; // chunk is full (no trailing zero bits)
-    } else if (use != 0) {
-      uint64_t bit  = tzcnt_u64(use) - 1; // tzcnt_u64(0x8000000000000000ULL) = 63
-      auto     mask = 1ULL << bit;
-      chunk_use_[i] |= mask;
-      return (Chunk*)(mega_chunks_[i] + bit * CHUNK_SIZE);
-    } else {
-      // use is zero, allocate a new mega chunk and return last chunk (64)
-      auto mega_chunk = (uint8_t*)MemAlloc(MEM_ALLOC_HEAP, MEGA_CHUNK_SIZE, MEM_CACHE_LINE_SIZE);
-      memset(mega_chunk, 0, size_t(MEGA_CHUNK_SIZE));
-      mega_chunks_[i] = mega_chunk;
-      chunk_use_[i]   = 0x8000000000000000ULL; // tzcnt_u64(0x0000000000000000ULL) = 64
-      return (Chunk*)(mega_chunks_[i] + MEGA_CHUNK_SIZE - CHUNK_SIZE);
+void ChunkPool::Create(i32 chunk_bits, bool use_huge_pages) {
+  MemZeroInit(this);
+
+  chunk_bits_       = chunk_bits;
+  mega_chunk_count_ = i32(Min64(MEGA_CHUNK_MAX, i64(RESERVE_MAX >> _MegaChunkBits())));
+
+  base_ = MemReserve(_ReserveSize());
+
+  if (use_huge_pages) {
+    MemAdviseHugePages(base_, _ReserveSize());
+  }
+
+  retention_ = ChunkRetentionPolicy::Default();
+
+  // Mega chunks beyond the reserved range look full so that we never try to allocate from them
+  for (i32 i = mega_chunk_count_; i < MEGA_CHUNK_MAX; i++) {
+    chunk_use_[i] = ~0ULL;
+    full_[i / 64] |= 1ULL << (i & 63);
+  }
+  for (i32 i = mega_chunk_count_ / 64; i < FULL_MAX; i++) {
+    if (full_[i] == ~0ULL) {
+      full_summary_[i / 64] |= 1ULL << (i & 63);
     }
   }
-  assert(false && "cannot allocate chunk");
-  return nullptr;
-}
-
-void ChunkAllocator::Free(Chunk* chunk) {
-  for (int i = 0; i < MEGA_CHUNK_MAX; i++) {
-    auto mega_chunk = mega_chunks_[i];
-    if (mega_chunk != nullptr) {
-      auto begin = (Chunk*)(mega_chunk);
-      auto end   = (Chunk*)(mega_chunk + MEGA_CHUNK_SIZE);
-      if ((begin <= chunk) & (chunk <= end)) {
-        auto bit  = (uint64_t)((uint8_t*)chunk - mega_chunk) >> CHUNK_BITS;
-        auto mask = 1ULL << bit;
-        chunk_use_[i] &= ~mask;
-        if (chunk_use_[i] == 0) {
-          MemFree(MEM_ALLOC_HEAP, mega_chunk);
-          mega_chunks_[i] = nullptr;
-        } else {
-          memset(chunk, 0, CHUNK_SIZE);
-        }
-        break;
+}
+
+namespace {
+// Set the full summary bit but only if the word in the full bitmask is still full
+void MarkFullSummary(u64* full, u64* full_summary, i32 full_index) {
+  u64 summary_mask = 1ULL << (full_index & 63);
+  atomic_or_u64(&full_summary[full_index / 64], summary_mask);
+  if (atomic_load_u64(&full[full_index]) != ~0ULL) {
+    atomic_and_u64(&full_summary[full_index / 64], ~summary_mask); // a chunk was freed in the meantime
+  }
+}
+
+// Find the first mega chunk that isn't full, the return value is -1 if all mega chunks are full
+i32 FindVacantMegaChunk(u64* full, u64* full_summary) {
+  for (int i = 0; i < ChunkPool::FULL_SUMMARY_MAX;) {
+    u64 summary = atomic_load_u64(&full_summary[i]);
+    if (summary == ~0ULL) {
+      i++;
+      continue; // all mega chunks in this range are full
+    }
+
+    i32 full_index = i * 64 + i32(tzcnt_u64(~summary));
+    u64 full_word  = atomic_load_u64(&full[full_index]);
+    if (full_word == ~0ULL) {
+      MarkFullSummary(full, full_summary, full_index); // the summary is lagging behind
+      continue;
+    }
+
+    return full_index * 64 + i32(tzcnt_u64(~full_word));
+  }
+  return -1;
+}
+} // namespace
+
+void ChunkPool::AllocateBatch(Chunk** chunks, i32 count) {
+  for (i32 n = 0; n < count;) {
+    i32 mega_chunk_index = FindVacantMegaChunk(full_, full_summary_);
+    if (mega_chunk_index == -1) {
+      assert(false && "cannot allocate chunk");
+      for (; n < count; n++) {
+        chunks[n] = nullptr;
       }
+      return;
+    }
+
+    if (atomic_load_u64(&chunk_use_[mega_chunk_index]) == 0) {
+      n += _ClaimEmpty(mega_chunk_index, chunks + n, count - n);
     } else {
-      assert(false && "cannot free chunk");
+      n += _Claim(mega_chunk_index, chunks + n, count - n);
+    }
+  }
+}
+
+namespace {
+// Hand out chunks that have been claimed. Chunks that were freed but not yet zeroed are zeroed here.
+i32 TakeClaimed(ChunkPool* pool, i32 mega_chunk_index, u64 claim, Chunk** chunks) {
+  u64   dirty      = atomic_and_u64(&pool->chunk_dirty_[mega_chunk_index], ~claim) & claim;
+  byte* mega_chunk = pool->_MegaChunk(mega_chunk_index);
+  i32   n          = 0;
+  for (; claim != 0; claim &= claim - 1) {
+    u64    bit   = tzcnt_u64(claim);
+    Chunk* chunk = (Chunk*)(mega_chunk + (bit << pool->chunk_bits_));
+    if (dirty & (1ULL << bit)) {
+      memset(chunk, 0, pool->ChunkSize());
+    }
+    chunks[n++] = chunk;
+  }
+  return n;
+}
+} // namespace
+
+i32 ChunkPool::_Claim(i32 mega_chunk_index, Chunk** chunks, i32 count) {
+  u64* use_ptr = &chunk_use_[mega_chunk_index];
+  for (;;) {
+    u64 use = atomic_load_u64(use_ptr);
+    if (use == 0) {
+      return 0; // the mega chunk became empty, this must go through _ClaimEmpty
+    }
+    if (use == ~0ULL) {
+      _MarkFull(mega_chunk_index);
+      return 0;
+    }
+
+    // lowest vacant chunks first
+    u64 vacant = ~use;
+    u64 claim  = 0;
+    for (i32 i = 0; (i < count) & (vacant != 0); i++) {
+      u64 lowest = vacant & (0 - vacant);
+      claim |= lowest;
+      vacant ^= lowest;
+    }
+
+    if (atomic_cmpxchg_u64(use_ptr, use, use | claim) == use) {
+      if ((use | claim) == ~0ULL) {
+        _MarkFull(mega_chunk_index);
+      }
+      return TakeClaimed(this, mega_chunk_index, claim, chunks);
+    }
+  }
+}
+
+i32 ChunkPool::_ClaimEmpty(i32 mega_chunk_index, Chunk** chunks, i32 count) {
+  i32 full_index      = mega_chunk_index / 64;
+  u64 mega_chunk_mask = 1ULL << (mega_chunk_index & 63);
+
+  commit_lock_.Lock();
+
+  if (atomic_load_u64(&chunk_use_[mega_chunk_index]) != 0) {
+    commit_lock_.Unlock();
+    return 0; // another thread got here first
+  }
+
+  if (!(commit_[full_index] & mega_chunk_mask)) {
+    // freshly committed memory is already zero initialized
+    MemCommit(_MegaChunk(mega_chunk_index), size_t(_MegaChunkSize()));
+    commit_[full_index] |= mega_chunk_mask;
+    committed_bytes_ += _MegaChunkSize();
+  } else if (empty_[full_index] & mega_chunk_mask) {
+    // reuse retained mega chunk
+    empty_[full_index] &= ~mega_chunk_mask;
+    retained_bytes_ -= _MegaChunkSize();
+  }
+
+  // While the mega chunk is empty only the thread that holds the lock can claim chunks from it
+  u64 claim = count < 64 ? (1ULL << count) - 1 : ~0ULL;
+  atomic_or_u64(&chunk_use_[mega_chunk_index], claim);
+
+  commit_lock_.Unlock();
+
+  if (claim == ~0ULL) {
+    _MarkFull(mega_chunk_index);
+  }
+
+  return TakeClaimed(this, mega_chunk_index, claim, chunks);
+}
+
+void ChunkPool::_MarkFull(i32 mega_chunk_index) {
+  i32 full_index      = mega_chunk_index / 64;
+  u64 mega_chunk_mask = 1ULL << (mega_chunk_index & 63);
+
+  atomic_or_u64(&full_[full_index], mega_chunk_mask);
+
+  // Free clears the chunk bit before it clears the full bit. If we see a vacant chunk here we must undo
+  if (atomic_load_u64(&chunk_use_[mega_chunk_index]) != ~0ULL) {
+    atomic_and_u64(&full_[full_index], ~mega_chunk_mask);
+    return;
+  }
+
+  if (atomic_load_u64(&full_[full_index]) == ~0ULL) {
+    MarkFullSummary(full_, full_summary_, full_index);
+  }
+}
+
+void ChunkPool::Free(Chunk* chunk) {
+  assert(_Contains(chunk) && "chunk was not allocated by this pool");
+
+  i32 mega_chunk_index = _MegaChunkIndex(chunk);
+  i32 full_index       = mega_chunk_index / 64;
+  u64 mega_chunk_mask  = 1ULL << (mega_chunk_index & 63);
+
+  auto bit  = (u64)((byte*)chunk - _MegaChunk(mega_chunk_index)) >> chunk_bits_;
+  auto mask = 1ULL << bit;
+
+  // the chunk must be marked dirty before it can be claimed again
+  atomic_or_u64(&chunk_dirty_[mega_chunk_index], mask);
+
+  u64 use = atomic_and_u64(&chunk_use_[mega_chunk_index], ~mask);
+
+  assert((use & mask) && "chunk is not allocated");
+
+  // the mega chunk has a vacant chunk now
+  atomic_and_u64(&full_[full_index], ~mega_chunk_mask);
+  atomic_and_u64(&full_summary_[full_index / 64], ~(1ULL << (full_index & 63)));
+
+  if ((use & ~mask) == 0) {
+    commit_lock_.Lock();
+
+    // The mega chunk may have been claimed again (and maybe freed again) before we got the lock
+    if ((atomic_load_u64(&chunk_use_[mega_chunk_index]) == 0) & !(empty_[full_index] & mega_chunk_mask)) {
+      empty_[full_index] |= mega_chunk_mask;
+      empty_frame_[mega_chunk_index] = frame_;
+      retained_bytes_ += _MegaChunkSize();
+
+      if ((retention_.idle_frames_ == 0) & (_RetainMegaChunkCount() == 0)) {
+        _Decommit(mega_chunk_index);
+      }
     }
+
+    commit_lock_.Unlock();
+  }
+}
+
+void ChunkPool::Update() {
+  commit_lock_.Lock();
+
+  frame_++;
+
+  i32 retained_count = i32(retained_bytes_ / _MegaChunkSize());
+  i32 retain_count   = _RetainMegaChunkCount();
+
+  // Return memory from the end of the reserved range first since Allocate prefers the beginning of the reserved range
+  for (i32 i = FULL_MAX - 1; (0 <= i) & (retain_count < retained_count); i--) {
+    u64 empty = empty_[i];
+    for (; (empty != 0) & (retain_count < retained_count);) {
+      i32 bit              = 63 - i32(lzcnt_u64(empty));
+      i32 mega_chunk_index = i * 64 + bit;
+
+      empty &= ~(1ULL << bit);
+
+      if (u32(retention_.idle_frames_) <= frame_ - empty_frame_[mega_chunk_index]) {
+        _Decommit(mega_chunk_index);
+        retained_count--;
+      }
+    }
+  }
+
+  commit_lock_.Unlock();
+}
+
+void ChunkPool::_Decommit(i32 mega_chunk_index) {
+  i32 full_index      = mega_chunk_index / 64;
+  u64 mega_chunk_mask = 1ULL << (mega_chunk_index & 63);
+
+  assert(chunk_use_[mega_chunk_index] == 0);
+
+  MemDecommit(_MegaChunk(mega_chunk_index), size_t(_MegaChunkSize()));
+
+  commit_[full_index] &= ~mega_chunk_mask;
+  empty_[full_index] &= ~mega_chunk_mask;
+
+  chunk_dirty_[mega_chunk_index] = 0; // decommitted memory is zero initialized when it is committed again
+
+  committed_bytes_ -= _MegaChunkSize();
+  retained_bytes_ -= _MegaChunkSize();
+  returned_bytes_ += _MegaChunkSize();
+}
+
+void ChunkPool::Destroy() {
+  if (base_ != nullptr) {
+    MemRelease(base_, _ReserveSize());
+    base_ = nullptr;
+  }
+  MemZeroInit(this);
+}
+
+// ---
+
+void ChunkAllocator::Create(bool use_huge_pages) {
+  for (i32 i = 0; i < CHUNK_SIZE_CLASS_COUNT; i++) {
+    pools_[i].Create(ChunkBits(ChunkSizeClass(i)), use_huge_pages);
+  }
+}
+
+void ChunkAllocator::SetRetentionPolicy(const ChunkRetentionPolicy& retention) {
+  for (i32 i = 0; i < CHUNK_SIZE_CLASS_COUNT; i++) {
+    pools_[i].SetRetentionPolicy(retention);
+  }
+}
+
+ChunkSizeClass ChunkAllocator::SizeClass(const Chunk* chunk) const {
+  for (i32 i = 0; i < CHUNK_SIZE_CLASS_COUNT; i++) {
+    if (pools_[i]._Contains(chunk)) {
+      return ChunkSizeClass(i);
+    }
+  }
+  assert(false && "chunk was not allocated by this allocator");
+  return CHUNK_SIZE_CLASS_DEFAULT;
+}
+
+void ChunkAllocator::Update() {
+  for (i32 i = 0; i < CHUNK_SIZE_CLASS_COUNT; i++) {
+    pools_[i].Update();
   }
 }
 
 void ChunkAllocator::Destroy() {
-  for (int i = 0; i < MEGA_CHUNK_MAX; i++) {
-    auto mega_chunk = mega_chunks_[i];
-    if (mega_chunk != nullptr) {
-      MemFree(MEM_ALLOC_HEAP, mega_chunk);
-      mega_chunks_[i] = nullptr;
-      chunk_use_[i]   = 0;
-    } else {
-      break;
+  for (i32 i = 0; i < CHUNK_SIZE_CLASS_COUNT; i++) {
+    pools_[i].Destroy();
+  }
+}
+
+u64 ChunkAllocator::CommittedBytes() const {
+  u64 committed_bytes = 0;
+  for (i32 i = 0; i < CHUNK_SIZE_CLASS_COUNT; i++) {
+    committed_bytes += pools_[i].committed_bytes_;
+  }
+  return committed_bytes;
+}
+
+// ---
+
+namespace {
+// Chunks are at least page aligned, the lowest bit of a cached chunk pointer is used to track if the chunk must be zeroed
+Chunk* Untag(Chunk* chunk) {
+  return (Chunk*)((u64)chunk & ~1ULL);
+}
+} // namespace
+
+void ChunkMagazine::Destroy() {
+  for (i32 i = 0; i < len_; i++) {
+    pool_->Free(Untag(chunks_[i]));
+  }
+  len_ = 0;
+}
+
+Chunk* ChunkMagazine::Allocate() {
+  if (len_ == 0) {
+    pool_->AllocateBatch(chunks_, BATCH);
+    len_ = BATCH;
+  }
+  Chunk* chunk = chunks_[--len_];
+  if ((u64)chunk & 1) {
+    chunk = Untag(chunk);
+    memset(chunk, 0, pool_->ChunkSize());
+  }
+  return chunk;
+}
+
+void ChunkMagazine::Free(Chunk* chunk) {
+  if (len_ == CAPACITY) {
+    // give the least recently freed half back
+    for (i32 i = 0; i < BATCH; i++) {
+      pool_->Free(Untag(chunks_[i]));
     }
+    memmove(&chunks_[0], &chunks_[BATCH], sizeof(Chunk*) * (CAPACITY - BATCH));
+    len_ -= BATCH;
   }
+  chunks_[len_++] = (Chunk*)((u64)chunk | 1);
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "../common/atomic.hh"
 #include "../common/mem.hh"
 
 namespace game {
@@ -8,21 +9,51 @@ struct Entity;
 
 enum {
   CHUNK_BITS        = 14,
-  CHUNK_SIZE        = 1 << 14,             // 16384
+  CHUNK_SIZE        = 1 << 14,             // 16384 (the default size class)
   CHUNK_HEADER_SIZE = MEM_CACHE_LINE_SIZE, // cache line
   CHUNK_BUFFER_SIZE = CHUNK_SIZE - CHUNK_HEADER_SIZE,
 };
 
+// Chunks come in a few sizes. Archetypes with a lot of entities use big chunks so that systems move between chunks less often.
+// Archetypes with only a few entities use small chunks so that we don't waste memory.
+enum ChunkSizeClass {
+  CHUNK_SIZE_CLASS_4K,
+  CHUNK_SIZE_CLASS_16K,
+  CHUNK_SIZE_CLASS_64K,
+  CHUNK_SIZE_CLASS_256K,
+  CHUNK_SIZE_CLASS_COUNT,
+  CHUNK_SIZE_CLASS_DEFAULT = CHUNK_SIZE_CLASS_16K, // CHUNK_SIZE
+};
+
+enum {
+  CHUNK_SIZE_MAX            = 256 * 1024,                               // The size of the largest size class
+  CHUNK_ENTITY_CAPACITY_MAX = (CHUNK_SIZE_MAX - CHUNK_HEADER_SIZE) / 8, // The most entities a chunk can ever hold
+};
+
+// log2 of the chunk size
+inline i32 ChunkBits(ChunkSizeClass size_class) {
+  return 12 + 2 * i32(size_class);
+}
+
+inline i32 ChunkSize(ChunkSizeClass size_class) {
+  return 1 << ChunkBits(size_class);
+}
+
+inline i32 ChunkBufferSize(ChunkSizeClass size_class) {
+  return ChunkSize(size_class) - CHUNK_HEADER_SIZE;
+}
+
 struct alignas(MEM_CACHE_LINE_SIZE) ChunkHeader {
   Archetype* archetype_;
   i32        len_; // entity count
   i32        cap_; // The max number of entities for the chunk
   uint64_t   sequence_number_;
   i32        list_index_;      // The index of the chunk in "archetype chunk data". (allocated)
-  i32        free_list_index_; // The index of the chunk in the free list (unallocated)
+  i32        free_list_index_; // The index of the chunk in the free list (unallocated), -1 if the chunk is full
+  i32        select_slot_;     // The bucket of the chunk while entities are selected (see _SelectEntity), -1 otherwise
 };
 
-// A chunk is a block of memory (16 KiB). The fist 64 bytes are reserved for the header the remaining laid out in memory as dictated by the archetype.
+// A chunk is a block of memory (4 KiB to 256 KiB, see ChunkSizeClass). The fist 64 bytes are reserved for the header the remaining laid out in memory as dictated by the archetype.
 // All chunks have an entity array that can be accessed regardless of what else may be found in the chunk.
 struct Chunk {
   ChunkHeader header_;
@@ -40,7 +71,7 @@ struct Chunk {
   // The index of this chunk in the chunk list
   int ListIndex() { return header_.list_index_; }
 
-  // The index of this chunk in the free list
+  // The index of this chunk in the free list, -1 if the chunk is full
   int FreeListIndex() { return header_.free_list_index_; }
 
   // Gets a pointer to the beginning of the usable memory portion of the chunk
@@ -49,28 +80,188 @@ struct Chunk {
   Entity* EntityArray() { return (Entity*)Buffer(); }
 };
 
-struct ChunkAllocator {
+// Controls how much memory the chunk allocator keeps around when mega chunks become empty.
+// Spawning and despawning entities in waves would otherwise have us commit and decommit the same memory over and over again.
+struct ChunkRetentionPolicy {
+  i32 mega_chunk_count_; // Keep this many empty mega chunks committed indefinitely
+  i32 mega_bytes_;       // Keep this many MiB of empty mega chunks committed indefinitely (the larger of the two is used)
+  i32 idle_frames_;      // Empty mega chunks beyond what we keep are decommitted when they have been idle for this many frames
+
+  static ChunkRetentionPolicy Default() { return { 0, 16, 300 }; }
+
+  // Decommit mega chunks as soon as they become empty
+  static ChunkRetentionPolicy None() { return { 0, 0, 0 }; }
+};
+
+// A pool of chunks of a single size
+struct ChunkPool {
   // The chunk store is a humongous bitmask.
-  // Every time a chunk is to be allocated we search for vacant chunk amongst our allocated mega chunks.
-  // We use a word size of 64-bits to represent a mega chunk. 16 KiB * 64 = 1 MiB.
-  // Each bit of the word is used to reserve one or more chunks within the mega chunk.
-  // It is possible to request more than 1 chunk at a time but we will only ever be able to serve up to 64 in a single request (often less).
+  // We use a word size of 64-bits to represent a mega chunk. For 16 KiB chunks that is 16 KiB * 64 = 1 MiB.
+  // Each bit of the word is used to reserve one chunk within the mega chunk.
+  // All mega chunks live in a single reserved range of address space. This way we can compute which mega chunk a chunk belongs to from the chunk pointer alone.
+  // To find a vacant chunk we use a hierarchy of bitmasks where each bit in a level tells us if the corresponding word in the level below is full.
+  // We track full rather than free so that a zero initialized pool is empty.
+  //
+  // Allocate, AllocateBatch and Free are thread-safe.
+  // Chunks are claimed by atomically setting bits in chunk_use_, the full bitmasks are only hints that are updated after the fact.
+  // Committing a mega chunk, reusing a retained mega chunk and returning memory to the OS are serialized by a spin lock. These are rare events.
+  // Update must not run concurrently with anything else.
 
-  static const int MEGA_CHUNK_SIZE = 64 * CHUNK_SIZE; // A mega chunk is exactly 64 chunks (1 MiB)
-  static const int MEGA_CHUNK_MAX  = 16 * 1024;       // Maximum number of mega chunks allowed (16 GiB)
+  static const int MEGA_CHUNK_MAX   = 16 * 1024;           // Maximum number of mega chunks allowed
+  static const int FULL_MAX         = MEGA_CHUNK_MAX / 64; // Number of words in the full bitmask
+  static const int FULL_SUMMARY_MAX = FULL_MAX / 64;       // Number of words in the full summary bitmask
 
-  // mega chunk pointer is stored here
-  byte* mega_chunks_[MEGA_CHUNK_MAX];
+  static const size_t RESERVE_MAX = size_t(16) * 1024 * 1024 * 1024; // Maximum amount of address space reserved (16 GiB)
+
+  // The reserved range of address space, mega chunk i is found at base_ + i * _MegaChunkSize()
+  byte* base_;
+
+  i32 chunk_bits_;       // log2(chunk size)
+  i32 mega_chunk_count_; // The number of mega chunks that fit in the reserved range
 
   // For each chunk that is allocated in a mega chunk the corresponding bit position is set here
   u64 chunk_use_[MEGA_CHUNK_MAX];
 
+  // For each chunk that has been freed but not yet zeroed the corresponding bit position is set here
+  // We zero chunks when they are allocated again, not when they are freed
+  u64 chunk_dirty_[MEGA_CHUNK_MAX];
+
+  // For each mega chunk that has no vacant chunk the corresponding bit position is set here
+  u64 full_[FULL_MAX];
+
+  // For each word in full_ that is all ones the corresponding bit position is set here
+  u64 full_summary_[FULL_SUMMARY_MAX];
+
+  // For each mega chunk that is committed the corresponding bit position is set here
+  u64 commit_[FULL_MAX];
+
+  // For each mega chunk that is committed but has no allocated chunks (retained) the corresponding bit position is set here
+  u64 empty_[FULL_MAX];
+
+  // The frame when the mega chunk became empty
+  u32 empty_frame_[MEGA_CHUNK_MAX];
+
+  ChunkRetentionPolicy retention_;
+  u32                  frame_;
+
+  // Guards commit_, empty_, empty_frame_ and the counters
+  SpinLock commit_lock_;
+
+  // Counters
+  u64 committed_bytes_; // Memory currently committed (including retained memory)
+  u64 retained_bytes_;  // Memory currently committed in empty mega chunks
+  u64 returned_bytes_;  // Total memory that has been returned to the OS
+
+  // Reserve address space for all mega chunks. Physical memory is committed one mega chunk at a time as needed.
+  // With huge pages the mega chunks are backed by transparent huge pages (Linux) when possible, this reduces TLB misses when iterating over lots of chunks.
+  void Create(i32 chunk_bits, bool use_huge_pages = false);
+
+  void SetRetentionPolicy(const ChunkRetentionPolicy& retention) { retention_ = retention; }
+
+  i32 ChunkSize() const { return 1 << chunk_bits_; }
+
   // Allocate a zero initialized chunk
-  Chunk* Allocate();
+  Chunk* Allocate() {
+    Chunk* chunk;
+    AllocateBatch(&chunk, 1);
+    return chunk;
+  }
+
+  // Allocate count zero initialized chunks. Chunks are claimed as many as possible at a time from each mega chunk.
+  void AllocateBatch(Chunk** chunks, i32 count);
 
   void Free(Chunk* chunk);
 
-  // Destroy all allocated chunks and free all mega chunks
+  // Advance the pool one frame. Empty mega chunks that we don't want to keep are decommitted once they have been idle long enough.
+  void Update();
+
+  // Destroy all allocated chunks and release the reserved address space
   void Destroy();
+
+  // ---
+
+  i32 _MegaChunkBits() const { return chunk_bits_ + 6; }
+
+  // A mega chunk is exactly 64 chunks
+  i32 _MegaChunkSize() const { return 1 << _MegaChunkBits(); }
+
+  size_t _ReserveSize() const { return size_t(mega_chunk_count_) * size_t(_MegaChunkSize()); }
+
+  bool _Contains(const Chunk* chunk) const { return size_t((const byte*)chunk - base_) < _ReserveSize(); }
+
+  // The index of the mega chunk that this chunk belongs to
+  i32 _MegaChunkIndex(const Chunk* chunk) const { return i32(size_t((const byte*)chunk - base_) >> _MegaChunkBits()); }
+
+  byte* _MegaChunk(i32 mega_chunk_index) const { return base_ + size_t(mega_chunk_index) * size_t(_MegaChunkSize()); }
+
+  // The number of empty mega chunks that we keep regardless of how long they have been idle
+  i32 _RetainMegaChunkCount() const {
+    return Max(retention_.mega_chunk_count_, i32((i64(retention_.mega_bytes_) << 20) >> _MegaChunkBits()));
+  }
+
+  // Claim up to count vacant chunks from a mega chunk, returns the number of chunks claimed
+  i32 _Claim(i32 mega_chunk_index, Chunk** chunks, i32 count);
+
+  // Commit or reuse an empty mega chunk and claim up to count chunks from it
+  i32 _ClaimEmpty(i32 mega_chunk_index, Chunk** chunks, i32 count);
+
+  void _MarkFull(i32 mega_chunk_index);
+
+  void _Decommit(i32 mega_chunk_index);
+};
+
+// The chunk allocator has one pool per chunk size class
+struct ChunkAllocator {
+  ChunkPool pools_[CHUNK_SIZE_CLASS_COUNT];
+
+  void Create(bool use_huge_pages = false);
+
+  void SetRetentionPolicy(const ChunkRetentionPolicy& retention);
+
+  // Allocate a zero initialized chunk
+  Chunk* Allocate(ChunkSizeClass size_class = CHUNK_SIZE_CLASS_DEFAULT) { return pools_[size_class].Allocate(); }
+
+  // Allocate count zero initialized chunks
+  void AllocateBatch(ChunkSizeClass size_class, Chunk** chunks, i32 count) {
+    pools_[size_class].AllocateBatch(chunks, count);
+  }
+
+  void Free(Chunk* chunk) { pools_[SizeClass(chunk)].Free(chunk); }
+
+  // The size class of a chunk that was allocated by this allocator
+  ChunkSizeClass SizeClass(const Chunk* chunk) const;
+
+  void Update();
+
+  void Destroy();
+
+  // Memory currently committed by all pools (including retained memory)
+  u64 CommittedBytes() const;
+};
+
+// A per thread cache of chunks. Chunks are taken from a chunk pool in batches so that most allocations don't touch memory shared with other threads.
+// Each worker thread that needs to create chunks should have its own magazine (per size class), the entity manager has one per size class. A magazine is not thread-safe.
+struct ChunkMagazine {
+  enum {
+    CAPACITY = 64,
+    BATCH    = CAPACITY / 2, // Number of chunks to take from (or give back to) the chunk pool at a time
+  };
+
+  ChunkPool* pool_;
+  i32        len_;
+  Chunk*     chunks_[CAPACITY]; // The lowest bit is set if the chunk must be zeroed before it is handed out
+
+  void Create(ChunkPool* pool) {
+    MemZeroInit(this);
+    pool_ = pool;
+  }
+
+  // Give all cached chunks back to the chunk pool
+  void Destroy();
+
+  // Allocate a zero initialized chunk
+  Chunk* Allocate();
+
+  void Free(Chunk* chunk);
 };
 } // namespace game
\ No newline at end of file
@@ -2,8 +2,56 @@
 
 #include "chunk.hh"
 
+#include <thread>
+
 using namespace game;
 
+namespace {
+// Make it look like the first n - 1 mega chunks are full without committing any memory for them.
+// The last mega chunk has a single chunk allocated so that it stays committed.
+void FillMegaChunks(ChunkPool* pool, int n) {
+  for (int i = 0; i < n - 1; i++) {
+    pool->chunk_use_[i] = ~0ULL;
+    pool->full_[i / 64] |= 1ULL << (i & 63);
+    if (pool->full_[i / 64] == ~0ULL) {
+      pool->full_summary_[i / (64 * 64)] |= 1ULL << ((i / 64) & 63);
+    }
+  }
+  pool->Allocate();
+}
+
+// Allocate and free chunks in small bursts, every chunk is stamped with a tag that must still be there when it is freed
+template <typename Allocator>
+void Churn(Allocator* allocator, u64 tag, int iterations, bool* ok) {
+  Chunk* chunks[16];
+  for (int i = 0; i < iterations; i++) {
+    for (int j = 0; j < ArrayLength(chunks); j++) {
+      chunks[j] = allocator->Allocate();
+      if (!MemIsZero(chunks[j], CHUNK_SIZE)) {
+        *ok = false;
+      }
+      chunks[j]->header_.sequence_number_ = tag;
+    }
+    for (int j = 0; j < ArrayLength(chunks); j++) {
+      if (chunks[j]->header_.sequence_number_ != tag) {
+        *ok = false;
+      }
+      chunks[j]->buffer_[0] = 1; // the chunk must be zeroed before it is handed out again
+      allocator->Free(chunks[j]);
+    }
+  }
+}
+
+void ChurnMagazine(ChunkPool* pool, u64 tag, int iterations, bool* ok) {
+  ChunkMagazine magazine;
+  magazine.Create(pool);
+  Churn(&magazine, tag, iterations, ok);
+  magazine.Destroy();
+}
+
+const int THREAD_COUNT = 4;
+} // namespace
+
 int main(int argc, char* argv[]) {
   test_init(argc, argv);
 
@@ -20,47 +68,424 @@ int main(int argc, char* argv[]) {
   }
 
   TEST_CASE("ChunkAllocatorTest") {
-    auto allocator = MemAllocZeroInit<ChunkAllocator>(MEM_ALLOC_HEAP);
+    auto allocator = MemAlloc<ChunkAllocator>(MEM_ALLOC_HEAP);
+    allocator->Create();
 
-    ASSERT_FALSE(allocator->mega_chunks_[0]);
+    ASSERT_EQUAL_I32(CHUNK_SIZE, ChunkSize(CHUNK_SIZE_CLASS_DEFAULT));
 
-    auto chunk0 = allocator->Allocate();
-    ASSERT_TRUE(chunk0 != nullptr);
-    ASSERT_EQUAL_U64(0x8000000000000000ULL, allocator->chunk_use_[0]);
-    ASSERT_TRUE(allocator->mega_chunks_[0]);
-    ASSERT_FALSE(allocator->mega_chunks_[1]);
+    // each size class has its own pool
+    Chunk* chunks[CHUNK_SIZE_CLASS_COUNT];
+    for (int i = 0; i < CHUNK_SIZE_CLASS_COUNT; i++) {
+      chunks[i] = allocator->Allocate(ChunkSizeClass(i));
+      ASSERT_EQUAL_PTR(allocator->pools_[i].base_, chunks[i]);
+      ASSERT_EQUAL_I32(i, allocator->SizeClass(chunks[i]));
+      ASSERT_TRUE(MemIsZero(chunks[i], ChunkSize(ChunkSizeClass(i))));
+    }
+
+    ASSERT_EQUAL_I32(64 * 4 * 1024, allocator->pools_[CHUNK_SIZE_CLASS_4K]._MegaChunkSize());
+    ASSERT_EQUAL_I32(64 * 256 * 1024, allocator->pools_[CHUNK_SIZE_CLASS_256K]._MegaChunkSize());
+    ASSERT_EQUAL_U64((256 + 1024 + 4096 + 16384) * 1024, allocator->CommittedBytes());
+
+    // the second chunk of a size class comes right after the first one
+    auto chunk = allocator->Allocate(CHUNK_SIZE_CLASS_64K);
+    ASSERT_EQUAL_PTR((byte*)chunks[CHUNK_SIZE_CLASS_64K] + 64 * 1024, chunk);
+
+    allocator->Free(chunk);
+    for (int i = 0; i < CHUNK_SIZE_CLASS_COUNT; i++) {
+      allocator->Free(chunks[i]);
+      ASSERT_EQUAL_U64(0, allocator->pools_[i].chunk_use_[0]);
+    }
+
+    allocator->Destroy();
+
+    MemFree(MEM_ALLOC_HEAP, allocator);
+  }
+
+  TEST_CASE("ChunkPoolReserveTest") {
+    auto pool = MemAlloc<ChunkPool>(MEM_ALLOC_HEAP);
+    pool->Create(ChunkBits(CHUNK_SIZE_CLASS_256K));
+
+    // big chunks have fewer mega chunks so that the reserved range stays the same size
+    ASSERT_EQUAL_I32(1024, pool->mega_chunk_count_);
+    ASSERT_EQUAL_U64(ChunkPool::RESERVE_MAX, pool->_ReserveSize());
+
+    // mega chunks beyond the reserved range are never allocated
+    ASSERT_EQUAL_U64(0, pool->full_[15]);
+    ASSERT_EQUAL_U64(~0ULL, pool->full_[16]);
+    ASSERT_EQUAL_U64(0x000000000000FFFFULL, ~pool->full_summary_[0]);
+
+    pool->Destroy();
+
+    MemFree(MEM_ALLOC_HEAP, pool);
+  }
 
-    auto chunk1 = allocator->Allocate();
-    ASSERT_TRUE(chunk1 != nullptr);
-    ASSERT_EQUAL_U64(0xC000000000000000ULL, allocator->chunk_use_[0]);
-    ASSERT_TRUE(allocator->mega_chunks_[0]);
-    ASSERT_FALSE(allocator->mega_chunks_[1]);
+  TEST_CASE("ChunkPoolTest") {
+    auto pool = MemAlloc<ChunkPool>(MEM_ALLOC_HEAP);
+    pool->Create(CHUNK_BITS);
 
-    auto chunk2 = allocator->Allocate();
+    ASSERT_EQUAL_U64(0, pool->chunk_use_[0]);
+
+    auto chunk0 = pool->Allocate();
+    ASSERT_EQUAL_PTR(pool->base_, chunk0);
+    ASSERT_EQUAL_U64(0x0000000000000001ULL, pool->chunk_use_[0]);
+    ASSERT_EQUAL_U64(0, pool->chunk_use_[1]);
+
+    auto chunk1 = pool->Allocate();
+    ASSERT_EQUAL_PTR(pool->base_ + CHUNK_SIZE, chunk1);
+    ASSERT_EQUAL_U64(0x0000000000000003ULL, pool->chunk_use_[0]);
+    ASSERT_EQUAL_U64(0, pool->chunk_use_[1]);
+
+    auto chunk2 = pool->Allocate();
     ASSERT_TRUE(chunk2 != nullptr);
-    ASSERT_EQUAL_U64(0xE000000000000000ULL, allocator->chunk_use_[0]);
-    ASSERT_TRUE(allocator->mega_chunks_[0]);
-    ASSERT_FALSE(allocator->mega_chunks_[1]);
+    ASSERT_EQUAL_U64(0x0000000000000007ULL, pool->chunk_use_[0]);
+    ASSERT_EQUAL_U64(0, pool->chunk_use_[1]);
 
-    allocator->Free(chunk1);
-    ASSERT_EQUAL_U64(0xA000000000000000ULL, allocator->chunk_use_[0]);
-    ASSERT_TRUE(allocator->mega_chunks_[0]);
-    ASSERT_FALSE(allocator->mega_chunks_[1]);
+    pool->Free(chunk1);
+    ASSERT_EQUAL_U64(0x0000000000000005ULL, pool->chunk_use_[0]);
+    ASSERT_EQUAL_U64(0, pool->chunk_use_[1]);
 
-    auto chunk3 = allocator->Allocate();
-    ASSERT_TRUE(chunk3 != nullptr);
-    ASSERT_EQUAL_U64(0xB000000000000000ULL, allocator->chunk_use_[0]);
-    ASSERT_TRUE(allocator->mega_chunks_[0]);
-    ASSERT_FALSE(allocator->mega_chunks_[1]);
+    // the hole is reused
+    auto chunk3 = pool->Allocate();
+    ASSERT_EQUAL_PTR(chunk1, chunk3);
+    ASSERT_EQUAL_U64(0x0000000000000007ULL, pool->chunk_use_[0]);
+    ASSERT_EQUAL_U64(0, pool->chunk_use_[1]);
 
-    allocator->Free(chunk0);
-    allocator->Free(chunk2);
-    allocator->Free(chunk3);
+    pool->Free(chunk0);
+    pool->Free(chunk2);
+    pool->Free(chunk3);
 
-    ASSERT_EQUAL_U64(0, allocator->chunk_use_[0]);
-    ASSERT_FALSE(allocator->mega_chunks_[0]);
-    ASSERT_FALSE(allocator->mega_chunks_[1]);
+    ASSERT_EQUAL_U64(0, pool->chunk_use_[0]);
+    ASSERT_EQUAL_U64(0, pool->chunk_use_[1]);
 
-    MemFree(MEM_ALLOC_HEAP, allocator);
+    pool->Destroy();
+
+    MemFree(MEM_ALLOC_HEAP, pool);
   }
+
+  TEST_CASE("ChunkPoolMegaChunkTest") {
+    auto pool = MemAlloc<ChunkPool>(MEM_ALLOC_HEAP);
+    pool->Create(CHUNK_BITS);
+
+    Chunk* chunks[2 * 64 + 1];
+
+    for (int i = 0; i < ArrayLength(chunks); i++) {
+      chunks[i] = pool->Allocate();
+      ASSERT_EQUAL_PTR(pool->base_ + i * CHUNK_SIZE, chunks[i]);
+      ASSERT_EQUAL_I32(i / 64, pool->_MegaChunkIndex(chunks[i]));
+      ASSERT_TRUE(MemIsZero(chunks[i], CHUNK_SIZE));
+    }
+
+    ASSERT_EQUAL_U64(~0ULL, pool->chunk_use_[0]);
+    ASSERT_EQUAL_U64(~0ULL, pool->chunk_use_[1]);
+    ASSERT_EQUAL_U64(0x0000000000000001ULL, pool->chunk_use_[2]);
+    ASSERT_EQUAL_U64(0x0000000000000003ULL, pool->full_[0]);
+
+    // free a chunk in the first mega chunk, the next allocation must find it
+    pool->Free(chunks[42]);
+    ASSERT_EQUAL_U64(0x0000000000000002ULL, pool->full_[0]);
+
+    ASSERT_EQUAL_PTR(chunks[42], pool->Allocate());
+    ASSERT_EQUAL_U64(0x0000000000000003ULL, pool->full_[0]);
+
+    for (int i = 0; i < ArrayLength(chunks); i++) {
+      pool->Free(chunks[i]);
+    }
+
+    ASSERT_EQUAL_U64(0, pool->chunk_use_[0]);
+    ASSERT_EQUAL_U64(0, pool->chunk_use_[1]);
+    ASSERT_EQUAL_U64(0, pool->chunk_use_[2]);
+    ASSERT_EQUAL_U64(0, pool->full_[0]);
+
+    pool->Destroy();
+
+    MemFree(MEM_ALLOC_HEAP, pool);
+  }
+
+  TEST_CASE("ChunkPoolRecommitTest") {
+    auto pool = MemAlloc<ChunkPool>(MEM_ALLOC_HEAP);
+    pool->Create(CHUNK_BITS, true);
+    pool->SetRetentionPolicy(ChunkRetentionPolicy::None());
+
+    auto chunk0 = pool->Allocate();
+    memset(chunk0, 0xCD, CHUNK_SIZE);
+
+    // the mega chunk is decommitted when the last chunk is freed
+    pool->Free(chunk0);
+    ASSERT_EQUAL_U64(0, pool->chunk_use_[0]);
+
+    auto chunk1 = pool->Allocate();
+    ASSERT_EQUAL_PTR(chunk0, chunk1);
+    ASSERT_TRUE(MemIsZero(chunk1, CHUNK_SIZE));
+
+    pool->Free(chunk1);
+
+    ASSERT_EQUAL_U64(0, pool->committed_bytes_);
+    ASSERT_EQUAL_U64(2 * pool->_MegaChunkSize(), pool->returned_bytes_);
+
+    pool->Destroy();
+
+    MemFree(MEM_ALLOC_HEAP, pool);
+  }
+
+  TEST_CASE("ChunkPoolLazyZeroTest") {
+    auto pool = MemAlloc<ChunkPool>(MEM_ALLOC_HEAP);
+    pool->Create(CHUNK_BITS);
+
+    auto chunk0 = pool->Allocate();
+    auto chunk1 = pool->Allocate();
+    memset(chunk1, 0xCD, CHUNK_SIZE);
+
+    // freed chunks are not zeroed until they are allocated again
+    pool->Free(chunk1);
+    ASSERT_EQUAL_U64(0x0000000000000002ULL, pool->chunk_dirty_[0]);
+    ASSERT_FALSE(MemIsZero(chunk1, CHUNK_SIZE));
+
+    auto chunk2 = pool->Allocate();
+    ASSERT_EQUAL_PTR(chunk1, chunk2);
+    ASSERT_EQUAL_U64(0, pool->chunk_dirty_[0]);
+    ASSERT_TRUE(MemIsZero(chunk2, CHUNK_SIZE));
+
+    pool->Free(chunk0);
+    pool->Free(chunk2);
+
+    pool->Destroy();
+
+    MemFree(MEM_ALLOC_HEAP, pool);
+  }
+
+  TEST_CASE("ChunkPoolRetentionTest") {
+    auto pool = MemAlloc<ChunkPool>(MEM_ALLOC_HEAP);
+    pool->Create(CHUNK_BITS);
+    pool->SetRetentionPolicy({ 1, 0, 2 }); // keep 1 mega chunk, return the rest after 2 frames
+
+    Chunk* chunks[3 * 64];
+
+    for (int i = 0; i < ArrayLength(chunks); i++) {
+      chunks[i] = pool->Allocate();
+    }
+
+    ASSERT_EQUAL_U64(3 * pool->_MegaChunkSize(), pool->committed_bytes_);
+
+    for (int i = 0; i < ArrayLength(chunks); i++) {
+      pool->Free(chunks[i]);
+    }
+
+    // empty mega chunks are retained
+    ASSERT_EQUAL_U64(3 * pool->_MegaChunkSize(), pool->committed_bytes_);
+    ASSERT_EQUAL_U64(3 * pool->_MegaChunkSize(), pool->retained_bytes_);
+    ASSERT_EQUAL_U64(0, pool->returned_bytes_);
+
+    pool->Update();
+
+    ASSERT_EQUAL_U64(3 * pool->_MegaChunkSize(), pool->retained_bytes_);
+
+    // reusing a retained mega chunk
+    chunks[0] = pool->Allocate();
+    ASSERT_EQUAL_PTR(pool->base_, chunks[0]);
+    ASSERT_EQUAL_U64(2 * pool->_MegaChunkSize(), pool->retained_bytes_);
+
+    pool->Update();
+
+    // idle for 2 frames, return everything but what we keep
+    ASSERT_EQUAL_U64(2 * pool->_MegaChunkSize(), pool->committed_bytes_);
+    ASSERT_EQUAL_U64(1 * pool->_MegaChunkSize(), pool->retained_bytes_);
+    ASSERT_EQUAL_U64(1 * pool->_MegaChunkSize(), pool->returned_bytes_);
+    ASSERT_EQUAL_U64(0x0000000000000003ULL, pool->commit_[0]);
+
+    pool->Free(chunks[0]);
+
+    pool->Update();
+    pool->Update();
+
+    ASSERT_EQUAL_U64(1 * pool->_MegaChunkSize(), pool->committed_bytes_);
+    ASSERT_EQUAL_U64(2 * pool->_MegaChunkSize(), pool->returned_bytes_);
+    ASSERT_EQUAL_U64(0x0000000000000001ULL, pool->commit_[0]);
+
+    pool->Destroy();
+
+    MemFree(MEM_ALLOC_HEAP, pool);
+  }
+
+  TEST_CASE("ChunkPoolBatchTest") {
+    auto pool = MemAlloc<ChunkPool>(MEM_ALLOC_HEAP);
+    pool->Create(CHUNK_BITS);
+
+    auto chunk0 = pool->Allocate();
+
+    // a batch spans mega chunks, the lowest vacant chunks are claimed first
+    Chunk* chunks[100];
+    pool->AllocateBatch(chunks, ArrayLength(chunks));
+
+    for (int i = 0; i < ArrayLength(chunks); i++) {
+      ASSERT_EQUAL_PTR(pool->base_ + (i + 1) * CHUNK_SIZE, chunks[i]);
+    }
+
+    ASSERT_EQUAL_U64(~0ULL, pool->chunk_use_[0]);
+    ASSERT_EQUAL_U64((1ULL << 37) - 1, pool->chunk_use_[1]);
+    ASSERT_EQUAL_U64(0x0000000000000001ULL, pool->full_[0]);
+
+    pool->Free(chunk0);
+    for (int i = 0; i < ArrayLength(chunks); i++) {
+      pool->Free(chunks[i]);
+    }
+
+    ASSERT_EQUAL_U64(0, pool->chunk_use_[0]);
+    ASSERT_EQUAL_U64(0, pool->chunk_use_[1]);
+    ASSERT_EQUAL_U64(0, pool->full_[0]);
+
+    pool->Destroy();
+
+    MemFree(MEM_ALLOC_HEAP, pool);
+  }
+
+  TEST_CASE("ChunkMagazineTest") {
+    auto pool = MemAlloc<ChunkPool>(MEM_ALLOC_HEAP);
+    pool->Create(CHUNK_BITS);
+
+    ChunkMagazine magazine;
+    magazine.Create(pool);
+
+    // the first allocation refills the magazine
+    auto chunk0 = magazine.Allocate();
+    ASSERT_TRUE(chunk0 != nullptr);
+    ASSERT_EQUAL_I32(ChunkMagazine::BATCH - 1, magazine.len_);
+    ASSERT_EQUAL_U64((1ULL << ChunkMagazine::BATCH) - 1, pool->chunk_use_[0]);
+
+    // freed chunks stay in the magazine and are zeroed when they are handed out again
+    memset(chunk0, 0xCD, CHUNK_SIZE);
+    magazine.Free(chunk0);
+    ASSERT_EQUAL_I32(ChunkMagazine::BATCH, magazine.len_);
+
+    auto chunk1 = magazine.Allocate();
+    ASSERT_EQUAL_PTR(chunk0, chunk1);
+    ASSERT_TRUE(MemIsZero(chunk1, CHUNK_SIZE));
+
+    // a full magazine gives half of its chunks back
+    Chunk* chunks[ChunkMagazine::CAPACITY];
+    for (int i = 0; i < ArrayLength(chunks); i++) {
+      chunks[i] = pool->Allocate();
+    }
+    for (int i = 0; i < ArrayLength(chunks); i++) {
+      magazine.Free(chunks[i]);
+    }
+    ASSERT_TRUE(magazine.len_ <= ChunkMagazine::CAPACITY);
+
+    magazine.Free(chunk1);
+    magazine.Destroy();
+    ASSERT_EQUAL_I32(0, magazine.len_);
+
+    ASSERT_EQUAL_U64(0, pool->chunk_use_[0]);
+    ASSERT_EQUAL_U64(0, pool->chunk_use_[1]);
+
+    pool->Destroy();
+
+    MemFree(MEM_ALLOC_HEAP, pool);
+  }
+
+  TEST_CASE("ChunkPoolThreadTest") {
+    auto pool = MemAlloc<ChunkPool>(MEM_ALLOC_HEAP);
+    pool->Create(CHUNK_BITS);
+    pool->SetRetentionPolicy(ChunkRetentionPolicy::None()); // commit and decommit as often as possible
+
+    bool        ok[2 * THREAD_COUNT] = {};
+    std::thread threads[2 * THREAD_COUNT];
+
+    // half of the threads go straight to the pool and half of them use a magazine
+    for (int i = 0; i < THREAD_COUNT; i++) {
+      ok[2 * i]     = true;
+      ok[2 * i + 1] = true;
+
+      threads[2 * i]     = std::thread(Churn<ChunkPool>, pool, u64(2 * i + 1), 2000, &ok[2 * i]);
+      threads[2 * i + 1] = std::thread(ChurnMagazine, pool, u64(2 * i + 2), 2000, &ok[2 * i + 1]);
+    }
+
+    for (int i = 0; i < ArrayLength(threads); i++) {
+      threads[i].join();
+      ASSERT_TRUE(ok[i]);
+    }
+
+    for (int i = 0; i < 64; i++) {
+      ASSERT_EQUAL_U64(0, pool->chunk_use_[i]);
+    }
+    ASSERT_EQUAL_U64(0, pool->full_[0]);
+    ASSERT_EQUAL_U64(0, pool->committed_bytes_);
+
+    pool->Destroy();
+
+    MemFree(MEM_ALLOC_HEAP, pool);
+  }
+
+  // Allocate and free a chunk when all but the last of N mega chunks are full.
+  // The cost should be the same regardless of the number of mega chunks.
+
+  test_benchmark_set_chunk_iter(1000);
+
+  auto pool = MemAlloc<ChunkPool>(MEM_ALLOC_HEAP);
+
+  pool->Create(CHUNK_BITS);
+  FillMegaChunks(pool, 1);
+  TEST_BENCHMARK("ChunkPool (1)") {
+    pool->Free(pool->Allocate());
+  }
+  pool->Destroy();
+
+  pool->Create(CHUNK_BITS);
+  FillMegaChunks(pool, 64);
+  TEST_BENCHMARK("ChunkPool (64)") {
+    pool->Free(pool->Allocate());
+  }
+  pool->Destroy();
+
+  pool->Create(CHUNK_BITS);
+  FillMegaChunks(pool, 1024);
+  TEST_BENCHMARK("ChunkPool (1024)") {
+    pool->Free(pool->Allocate());
+  }
+  pool->Destroy();
+
+  pool->Create(CHUNK_BITS);
+  FillMegaChunks(pool, ChunkPool::MEGA_CHUNK_MAX);
+  TEST_BENCHMARK("ChunkPool (16384)") {
+    pool->Free(pool->Allocate());
+  }
+  pool->Destroy();
+
+  // The same number of allocations on one thread, on multiple threads sharing the pool and on multiple threads with magazines
+
+  test_benchmark_set_chunk_iter(10);
+
+  pool->Create(CHUNK_BITS);
+  TEST_BENCHMARK("ChunkPool (1 thread)") {
+    bool ok = true;
+    Churn(pool, 1, THREAD_COUNT * 64, &ok);
+  }
+  pool->Destroy();
+
+  pool->Create(CHUNK_BITS);
+  TEST_BENCHMARK("ChunkPool (4 threads)") {
+    bool        ok[THREAD_COUNT];
+    std::thread threads[THREAD_COUNT];
+    for (int i = 0; i < THREAD_COUNT; i++) {
+      threads[i] = std::thread(Churn<ChunkPool>, pool, u64(i + 1), 64, &ok[i]);
+    }
+    for (int i = 0; i < THREAD_COUNT; i++) {
+      threads[i].join();
+    }
+  }
+  pool->Destroy();
+
+  pool->Create(CHUNK_BITS);
+  TEST_BENCHMARK("ChunkMagazine (4 threads)") {
+    bool        ok[THREAD_COUNT];
+    std::thread threads[THREAD_COUNT];
+    for (int i = 0; i < THREAD_COUNT; i++) {
+      threads[i] = std::thread(ChurnMagazine, pool, u64(i + 1), 64, &ok[i]);
+    }
+    for (int i = 0; i < THREAD_COUNT; i++) {
+      threads[i].join();
+    }
+  }
+  pool->Destroy();
+
+  MemFree(MEM_ALLOC_HEAP, pool);
 }
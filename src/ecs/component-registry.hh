@@ -1,6 +1,7 @@
 #pragma once
 
 #include "../common/entity.hh"
+#include "../common/mem.hh"
 
 namespace game {
 struct ComponentRegistry {
@@ -21,5 +22,13 @@ struct ComponentRegistry {
   const TypeInfo* GetComponentTypeInfo(ComponentTypeId component_type_id) {
     return &components_[component_type_id.Index()];
   }
+
+  // The number of words in a component type mask, one bit per registered component type padded to the SIMD width
+  i32 TypeMaskWords() const { return i32(MemAlign(size_t(components_.Len()), 256)) / 64; }
 };
+
+// Add a component type to a component type mask
+inline void SetTypeMaskBit(u64* mask, ComponentTypeId type_id) {
+  mask[type_id.Index() / 64] |= 1ULL << (type_id.Index() & 63);
+}
 } // namespace game
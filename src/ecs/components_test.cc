@@ -3,15 +3,21 @@
 #include "archetype.hh"
 #include "component-registry.hh"
 #include "entity-manager.hh"
+#include "entity-query.hh"
+#include "world.hh"
 
 using namespace game;
 
-// todo: need to use component flags to signal that this component is a zero size component
-
 namespace {
 struct TagComponent {
   enum { COMPONENT_TYPE = 1 };
 };
+
+struct Position {
+  enum { COMPONENT_TYPE = 2 };
+
+  float v_[3];
+};
 } // namespace
 
 int main(int argc, char* argv[]) {
@@ -20,9 +26,59 @@ int main(int argc, char* argv[]) {
   const TypeInfo components[] = {
     GAME_COMPONENT(Entity),
     GAME_COMPONENT(TagComponent),
+    GAME_COMPONENT(Position),
   };
 
   TEST_CASE("TagComponentTest") {
     ASSERT_EQUAL_SIZE(1, sizeof(TagComponent));
+
+    // an empty struct is a tag component
+    ASSERT_EQUAL_I32(0, components[1].size_);
+    ASSERT_EQUAL_U32(COMPONENT_FLAG_TAG, components[1].flags_);
+    ASSERT_EQUAL_U32(0, components[2].flags_);
+  }
+
+  TEST_CASE("TagComponentArchetypeTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    auto untagged = m.CreateArchetype({ GetComponentTypeId<Position>() });
+    auto tagged   = m.CreateArchetype({ GetComponentTypeId<Position>(), GetComponentTypeId<TagComponent>() });
+
+    // tags are part of the archetype identity but take up no space
+    ASSERT_TRUE(untagged != tagged);
+    ASSERT_EQUAL_I32(3, tagged->types_len_);
+    ASSERT_EQUAL_I32(untagged->chunk_entity_capacity_, tagged->chunk_entity_capacity_);
+
+    m.archetype_layout_ = ARCHETYPE_LAYOUT_PACKED;
+
+    auto tag_only = m.CreateArchetype({ GetComponentTypeId<TagComponent>() });
+    ASSERT_EQUAL_I32(CHUNK_BUFFER_SIZE / i32(sizeof(Entity)), tag_only->chunk_entity_capacity_);
+    ASSERT_EQUAL_I32(0, tag_only->offsets_[1]);
+
+    EntityQuery* tag_query = m.CreateQuery({ ComponentDataAccess::Read<TagComponent>() });
+    EntityQuery* query     = m.CreateQuery({ ComponentDataAccess::Read<Position>() });
+
+    ASSERT_EQUAL_I32(2, tag_query->matching_archetypes_.Len());
+
+    Entity entities[10];
+    m.CreateEntities(untagged, entities, ArrayLength(entities));
+
+    // tagging a whole query re-tags the chunk in place
+    Chunk* chunk = untagged->chunk_data_.ChunkPtrArray()[0];
+
+    m.AddComponent<TagComponent>(query);
+
+    ASSERT_EQUAL_PTR(tagged, chunk->header_.archetype_);
+    ASSERT_EQUAL_I32(ArrayLength(entities), tag_query->Count());
+    ASSERT_EQUAL_PTR(chunk, m._Record(entities[0].index_).chunk_);
+
+    m.RemoveComponent<TagComponent>(entities[0]);
+    ASSERT_EQUAL_I32(ArrayLength(entities) - 1, tag_query->Count());
+
+    world.Destroy();
   }
 }
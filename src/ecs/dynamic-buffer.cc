@@ -0,0 +1,104 @@
+#include "dynamic-buffer.hh"
+
+#include "../common/intrin.hh"
+#include "../common/mem.hh"
+
+using namespace game;
+
+void BufferAllocator::Create() {
+  MemZeroInit(this);
+}
+
+void BufferAllocator::Destroy() {
+  for (i32 i = 0; i < CLASS_COUNT; i++) {
+    for (void* block = free_lists_[i]; block != nullptr;) {
+      void* next = *(void**)block;
+      MemFree(MEM_ALLOC_HEAP, block);
+      block = next;
+    }
+    free_lists_[i] = nullptr;
+  }
+}
+
+i32 BufferAllocator::_SizeClass(i32 size) {
+  if (size <= (1 << BLOCK_BITS_MIN)) {
+    return 0;
+  }
+  const i32 bits = 64 - i32(lzcnt_u64(u64(size - 1)));
+  return Min(bits - BLOCK_BITS_MIN, i32(CLASS_COUNT));
+}
+
+byte* BufferAllocator::Allocate(i32 size, i32* block_size) {
+  const i32 size_class = _SizeClass(size);
+  if (size_class == CLASS_COUNT) {
+    *block_size = size;
+    allocated_bytes_ += size;
+    return MemAlloc(MEM_ALLOC_HEAP, size_t(size), BUFFER_ALIGNMENT);
+  }
+
+  *block_size = 1 << (BLOCK_BITS_MIN + size_class);
+  allocated_bytes_ += *block_size;
+
+  void* block = free_lists_[size_class];
+  if (block != nullptr) {
+    free_lists_[size_class] = *(void**)block;
+    return (byte*)block;
+  }
+  return MemAlloc(MEM_ALLOC_HEAP, size_t(*block_size), BUFFER_ALIGNMENT);
+}
+
+void BufferAllocator::Free(void* block, i32 size) {
+  const i32 size_class = _SizeClass(size);
+  if (size_class == CLASS_COUNT) {
+    allocated_bytes_ -= size;
+    MemFree(MEM_ALLOC_HEAP, block);
+    return;
+  }
+
+  allocated_bytes_ -= 1 << (BLOCK_BITS_MIN + size_class);
+
+  *(void**)block          = free_lists_[size_class];
+  free_lists_[size_class] = block;
+}
+
+// ---
+
+void game::BufferReserve(BufferHeader* header, BufferAllocator* allocator, i32 capacity, i32 element_size) {
+  // A buffer that keeps growing at least doubles its capacity each time. Pooled blocks are powers of two anyway but
+  // blocks that are too big to be pooled are exactly the size that is asked for.
+  capacity = Max(capacity, 2 * header->cap_);
+
+  i32   block_size = 0;
+  byte* block      = allocator->Allocate(capacity * element_size, &block_size);
+
+  memcpy(block, BufferData(header), size_t(header->len_ * element_size));
+
+  if (header->overflow_ != nullptr) {
+    allocator->Free(header->overflow_, header->cap_ * element_size);
+  }
+
+  header->overflow_ = block;
+  header->cap_      = block_size / element_size;
+}
+
+void game::BufferRelease(BufferHeader* header, BufferAllocator* allocator, i32 element_size) {
+  if (header->overflow_ != nullptr) {
+    allocator->Free(header->overflow_, header->cap_ * element_size);
+  }
+  header->overflow_ = nullptr;
+  header->len_      = 0;
+  header->cap_      = 0;
+}
+
+void game::BufferCloneOverflow(BufferHeader* header, BufferAllocator* allocator, i32 element_size) {
+  if (header->overflow_ == nullptr) {
+    return;
+  }
+
+  i32   block_size = 0;
+  byte* block      = allocator->Allocate(header->cap_ * element_size, &block_size);
+
+  memcpy(block, header->overflow_, size_t(header->len_ * element_size));
+
+  header->overflow_ = block;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "component-registry.hh"
+
+namespace game {
+// Overflow storage for dynamic buffers. Blocks are powers of two, freed blocks are kept in a free list per size so that
+// buffers that grow and shrink over and over don't go back to the heap every time. Blocks bigger than the largest size
+// class come straight from the heap. Not thread-safe.
+struct BufferAllocator {
+  enum {
+    BLOCK_BITS_MIN = 6,  // 64 bytes
+    CLASS_COUNT    = 12, // The largest pooled block is 128 KiB
+  };
+
+  void* free_lists_[CLASS_COUNT]; // The first word of a free block points to the next free block
+  i64   allocated_bytes_;         // Bytes in blocks that are in use
+
+  void Create();
+
+  // Blocks that are still in use are not freed
+  void Destroy();
+
+  // ---
+
+  // Allocate a block of at least size bytes. The actual size of the block is returned in block_size.
+  byte* Allocate(i32 size, i32* block_size);
+
+  // Give a block back, size is the size that was asked for or the block size
+  void Free(void* block, i32 size);
+
+  // The size class of a block, CLASS_COUNT for blocks that are not pooled
+  static i32 _SizeClass(i32 size);
+};
+
+// The beginning of a buffer in the component array. The first BUFFER_CAPACITY elements are found right after the
+// header (inline), once the buffer has more elements than that all of them are moved to an overflow block.
+//
+// A zeroed header is an empty buffer. Moving a buffer to another chunk is a plain copy of the header and the inline
+// elements, the overflow block goes with it.
+struct BufferHeader {
+  byte* overflow_; // Null while the elements are inline
+  i32   len_;      // Number of elements
+  i32   cap_;      // The capacity of the overflow block in elements (zero while the elements are inline)
+};
+
+static_assert(sizeof(BufferHeader) == BUFFER_HEADER_SIZE, "the buffer header size is baked into the type info");
+
+inline byte* BufferData(BufferHeader* header) {
+  return header->overflow_ != nullptr ? header->overflow_ : (byte*)(header + 1);
+}
+
+// Move the elements to an overflow block with room for at least capacity elements (and at least twice the elements of
+// the current overflow block)
+void BufferReserve(BufferHeader* header, BufferAllocator* allocator, i32 capacity, i32 element_size);
+
+// Give the overflow block back to the allocator, the buffer is left empty
+void BufferRelease(BufferHeader* header, BufferAllocator* allocator, i32 element_size);
+
+// The header was copied from another buffer, give this buffer its own copy of the overflow block
+void BufferCloneOverflow(BufferHeader* header, BufferAllocator* allocator, i32 element_size);
+
+// A view of the buffer of one entity. The view is invalidated by anything that moves the entity.
+template <typename T> struct DynamicBuffer {
+  BufferHeader*    header_;
+  BufferAllocator* allocator_;
+
+  i32 Len() const { return header_->len_; }
+
+  i32 Cap() const { return header_->overflow_ != nullptr ? header_->cap_ : i32(T::BUFFER_CAPACITY); }
+
+  T* Ptr() const { return (T*)BufferData(header_); }
+
+  T& operator[](i32 index) const {
+    assert((0 <= index) & (index < Len()));
+    return Ptr()[index];
+  }
+
+  T* begin() const { return Ptr(); }
+  T* end() const { return Ptr() + Len(); }
+
+  void Reserve(i32 capacity) {
+    if (Cap() < capacity) {
+      BufferReserve(header_, allocator_, capacity, i32(sizeof(T)));
+    }
+  }
+
+  // The value may be an element of this buffer, it is copied before the elements move
+  void Add(const T& value) {
+    const T copy = value;
+    Reserve(Len() + 1);
+    Ptr()[header_->len_++] = copy;
+  }
+
+  // New elements are zero initialized
+  void Resize(i32 len) {
+    Reserve(len);
+    if (Len() < len) {
+      memset(Ptr() + Len(), 0, sizeof(T) * size_t(len - Len()));
+    }
+    header_->len_ = len;
+  }
+
+  void RemoveAtSwapBack(i32 index) {
+    assert((0 <= index) & (index < Len()));
+    T* ptr     = Ptr();
+    ptr[index] = ptr[--header_->len_];
+  }
+
+  // The overflow block is kept
+  void Clear() { header_->len_ = 0; }
+};
+
+// The buffers of the entities in a system chunk (see SystemChunk::GetBufferAccessor)
+template <typename T> struct BufferAccessor {
+  byte*            ptr_;    // The buffer of the first entity
+  i32              stride_; // The size of a buffer in the component array
+  i32              len_;
+  BufferAllocator* allocator_;
+
+  i32 Len() const { return len_; }
+
+  DynamicBuffer<T> operator[](i32 index) const {
+    assert((0 <= index) & (index < len_));
+    return { (BufferHeader*)(ptr_ + index * stride_), allocator_ };
+  }
+};
+} // namespace game
@@ -0,0 +1,276 @@
+#include "entity-command-buffer.hh"
+
+#include "archetype.hh"
+#include "entity-manager.hh"
+
+using namespace game;
+
+namespace {
+// The number of words taken up by a command with size bytes of data
+i32 CommandLen(i32 size) {
+  return i32(sizeof(EntityCommand) / sizeof(u64)) + (size + 7) / 8;
+}
+} // namespace
+
+void EntityCommandStream::Create(i32 index) {
+  MemZeroInit(this);
+
+  index_   = index;
+  buffer_  = List<u64>::WithAllocator(MEM_ALLOC_HEAP);
+  created_ = List<Entity>::WithAllocator(MEM_ALLOC_HEAP);
+}
+
+void EntityCommandStream::Destroy() {
+  buffer_.Destroy();
+  created_.Destroy();
+}
+
+EntityCommand* EntityCommandStream::_Append(EntityCommand::Kind kind, Entity entity, i32 size) {
+  const i32 command_len = CommandLen(size);
+
+  // The buffer grows geometrically, we don't want to copy the commands over and over again
+  if (buffer_.Cap() < buffer_.Len() + command_len) {
+    buffer_.SetCapacity(Max(2 * buffer_.Cap(), buffer_.Len() + command_len));
+  }
+
+  EntityCommand* command = (EntityCommand*)(buffer_.ptr_ + buffer_.len_);
+  buffer_.len_ += command_len;
+
+  MemZeroInit(command);
+
+  command->kind_   = kind;
+  command->entity_ = entity;
+  command->size_   = size;
+
+  return command;
+}
+
+Entity EntityCommandStream::CreateEntity(Archetype* archetype) {
+  Entity placeholder = { -2 - created_count_, u32(index_) };
+
+  created_count_++;
+
+  EntityCommand* command = _Append(EntityCommand::CREATE, placeholder, 0);
+  command->archetype_    = archetype;
+
+  return placeholder;
+}
+
+void EntityCommandStream::DestroyEntity(Entity entity) {
+  _Append(EntityCommand::DESTROY, entity, 0);
+}
+
+void EntityCommandStream::AddComponent(Entity entity, ComponentTypeId type_id) {
+  EntityCommand* command = _Append(EntityCommand::ADD_COMPONENT, entity, 0);
+  command->type_id_      = type_id;
+}
+
+void EntityCommandStream::RemoveComponent(Entity entity, ComponentTypeId type_id) {
+  EntityCommand* command = _Append(EntityCommand::REMOVE_COMPONENT, entity, 0);
+  command->type_id_      = type_id;
+}
+
+void EntityCommandStream::_SetComponentData(Entity entity, ComponentTypeId type_id, const void* data, i32 size) {
+  EntityCommand* command = _Append(EntityCommand::SET_COMPONENT, entity, size);
+  command->type_id_      = type_id;
+  memcpy(command + 1, data, size_t(size));
+}
+
+// ---
+
+void EntityCommandBuffer::Create(i32 stream_count) {
+  MemZeroInit(this);
+
+  assert((0 < stream_count) & (stream_count <= STREAM_MAX));
+
+  streams_      = MemAllocArray<EntityCommandStream>(MEM_ALLOC_HEAP, stream_count);
+  stream_count_ = stream_count;
+
+  for (i32 i = 0; i < stream_count; i++) {
+    streams_[i].Create(i);
+  }
+}
+
+void EntityCommandBuffer::Destroy() {
+  for (i32 i = 0; i < stream_count_; i++) {
+    streams_[i].Destroy();
+  }
+
+  MemFree(MEM_ALLOC_HEAP, streams_);
+
+  streams_      = nullptr;
+  stream_count_ = 0;
+}
+
+Entity EntityCommandBuffer::Resolve(Entity entity) {
+  if (IsPlaceholder(entity)) {
+    EntityCommandStream& stream = Stream(i32(entity.version_));
+    return stream.created_[-2 - entity.index_];
+  }
+  return entity;
+}
+
+namespace {
+// Entities of the same archetype are created together
+struct CreateGroup {
+  Archetype* archetype_;
+  i32        count_;
+  i32        offset_; // The offset of the first entity of this group in the array of created entities
+};
+
+// Call f(command) for each command in each stream, in the order they were recorded
+template <typename F> void ForEachCommand(EntityCommandStream* streams, i32 stream_count, F f) {
+  for (i32 i = 0; i < stream_count; i++) {
+    u64* it  = streams[i].buffer_.ptr_;
+    u64* end = it + streams[i].buffer_.len_;
+    for (; it < end;) {
+      EntityCommand* command = (EntityCommand*)it;
+      f(command);
+      it += CommandLen(command->size_);
+    }
+  }
+}
+} // namespace
+
+void EntityCommandBuffer::Playback(EntityManager* entity_manager) {
+  // 1. Create entities one archetype at a time. Until the entities have been created the placeholder map holds the
+  // group and the index of the entity within the group.
+
+  List<CreateGroup> groups = List<CreateGroup>::WithAllocator(MEM_ALLOC_HEAP);
+
+  i32 created_count = 0;
+
+  for (i32 i = 0; i < stream_count_; i++) {
+    streams_[i].created_.Resize(streams_[i].created_count_);
+    created_count += streams_[i].created_count_;
+  }
+
+  if (0 < created_count) {
+    i32 last_group = -1;
+
+    ForEachCommand(streams_, stream_count_, [this, &groups, &last_group](EntityCommand* command) {
+      if (command->kind_ != EntityCommand::CREATE) {
+        return;
+      }
+
+      // We don't expect a lot of different archetypes, a linear search will do
+      if (!((0 <= last_group) && (groups[last_group].archetype_ == command->archetype_))) {
+        last_group = -1;
+        for (i32 g = 0; g < groups.Len(); g++) {
+          if (groups[g].archetype_ == command->archetype_) {
+            last_group = g;
+            break;
+          }
+        }
+        if (last_group == -1) {
+          last_group = groups.Len();
+          groups.Add({ command->archetype_, 0, 0 });
+        }
+      }
+
+      Entity placeholder = command->entity_;
+      Entity group_index = { last_group, u32(groups[last_group].count_++) };
+
+      streams_[placeholder.version_].created_[-2 - placeholder.index_] = group_index;
+    });
+
+    Entity* created = MemAllocArray<Entity>(MEM_ALLOC_HEAP, created_count);
+
+    i32 offset = 0;
+    for (auto& group : groups) {
+      group.offset_ = offset;
+      entity_manager->CreateEntities(group.archetype_, created + offset, group.count_);
+      offset += group.count_;
+    }
+
+    for (i32 i = 0; i < stream_count_; i++) {
+      for (auto& entity : streams_[i].created_) {
+        entity = created[groups[entity.index_].offset_ + i32(entity.version_)];
+      }
+    }
+
+    MemFree(MEM_ALLOC_HEAP, created);
+  }
+
+  groups.Destroy();
+
+  // 2. Add, remove and set in the order the commands were recorded. Setting component data depends on which component
+  // types the entity has at that point. A run of adds (or removes) of the same component type is applied as one batch,
+  // the entities are moved a chunk at a time. Reordering the commands within a run doesn't change the outcome.
+
+  i32 destroy_count = 0;
+
+  List<Entity>        batch      = List<Entity>::WithAllocator(MEM_ALLOC_HEAP);
+  EntityCommand::Kind batch_kind = EntityCommand::CREATE; // Nothing is batched
+  ComponentTypeId     batch_type = {};
+
+  auto flush_batch = [entity_manager, &batch, &batch_kind, &batch_type]() {
+    if (batch_kind == EntityCommand::ADD_COMPONENT) {
+      entity_manager->AddComponent(batch.ptr_, batch.Len(), batch_type);
+    } else if (batch_kind == EntityCommand::REMOVE_COMPONENT) {
+      entity_manager->RemoveComponent(batch.ptr_, batch.Len(), batch_type);
+    }
+    batch.Resize(0);
+    batch_kind = EntityCommand::CREATE;
+  };
+
+  ForEachCommand(streams_, stream_count_, [&](EntityCommand* command) {
+    switch (command->kind_) {
+    case EntityCommand::CREATE:
+      break;
+
+    case EntityCommand::DESTROY:
+      destroy_count++;
+      break;
+
+    case EntityCommand::ADD_COMPONENT:
+    case EntityCommand::REMOVE_COMPONENT:
+      if (!(batch_kind == command->kind_ && batch_type == command->type_id_)) {
+        flush_batch();
+        batch_kind = command->kind_;
+        batch_type = command->type_id_;
+      }
+      batch.Add(Resolve(command->entity_));
+      break;
+
+    case EntityCommand::SET_COMPONENT:
+      flush_batch();
+      entity_manager->_SetComponentData(Resolve(command->entity_), command->type_id_, command + 1);
+      break;
+
+    default:
+      assert(false && "unknown entity command");
+      abort();
+      break;
+    }
+  });
+
+  flush_batch();
+
+  batch.Destroy();
+
+  // 3. Destroy entities
+
+  if (0 < destroy_count) {
+    Entity* destroyed = MemAllocArray<Entity>(MEM_ALLOC_HEAP, destroy_count);
+
+    i32 n = 0;
+    ForEachCommand(streams_, stream_count_, [this, destroyed, &n](EntityCommand* command) {
+      if (command->kind_ == EntityCommand::DESTROY) {
+        destroyed[n++] = Resolve(command->entity_);
+      }
+    });
+
+    entity_manager->DestroyEntities(destroyed, n);
+
+    MemFree(MEM_ALLOC_HEAP, destroyed);
+  }
+
+  // ---
+
+  // The placeholder map is kept around until the next playback
+  for (i32 i = 0; i < stream_count_; i++) {
+    streams_[i].buffer_.len_   = 0;
+    streams_[i].created_count_ = 0;
+  }
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "../common/list.hh"
+
+#include "component-registry.hh"
+
+namespace game {
+struct Archetype;
+struct EntityManager;
+
+// A recorded structural change. Set commands are followed by the component data (padded to 8 bytes).
+struct EntityCommand {
+  enum Kind : u32 {
+    CREATE,
+    DESTROY,
+    ADD_COMPONENT,
+    REMOVE_COMPONENT,
+    SET_COMPONENT,
+  };
+
+  Kind            kind_;
+  ComponentTypeId type_id_;   // ADD_COMPONENT, REMOVE_COMPONENT and SET_COMPONENT
+  Entity          entity_;    // The entity or placeholder entity that the command applies to
+  Archetype*      archetype_; // CREATE
+  i32             size_;      // SET_COMPONENT (size of component data)
+  i32             reserved_;
+};
+
+// Commands recorded by a single thread. Each stream is only ever touched by one thread at a time.
+struct alignas(MEM_CACHE_LINE_SIZE) EntityCommandStream {
+  i32          index_;         // The index of this stream in the command buffer
+  i32          created_count_; // Number of placeholder entities handed out
+  List<u64>    buffer_;        // Recorded commands (in words so that commands are 8 byte aligned)
+  List<Entity> created_;       // Placeholder entity to entity map, filled in during playback
+
+  void Create(i32 index);
+
+  void Destroy();
+
+  // ---
+
+  // Records the creation of an entity. The returned placeholder entity can be used with the other commands in this
+  // command buffer, from any stream. It is replaced with the real entity during playback.
+  Entity CreateEntity(Archetype* archetype);
+
+  void DestroyEntity(Entity entity);
+
+  void AddComponent(Entity entity, ComponentTypeId type_id);
+
+  template <typename T> void AddComponent(Entity entity) { AddComponent(entity, GetComponentTypeId<T>()); }
+
+  void RemoveComponent(Entity entity, ComponentTypeId type_id);
+
+  template <typename T> void RemoveComponent(Entity entity) { RemoveComponent(entity, GetComponentTypeId<T>()); }
+
+  // The component data is copied into the command buffer
+  void _SetComponentData(Entity entity, ComponentTypeId type_id, const void* data, i32 size);
+
+  template <typename T> void SetComponentData(Entity entity, const T& data) {
+    _SetComponentData(entity, GetComponentTypeId<T>(), &data, i32(sizeof(T)));
+  }
+
+  // ---
+
+  EntityCommand* _Append(EntityCommand::Kind kind, Entity entity, i32 size);
+};
+
+// Records structural changes from jobs that run in parallel so that they can be applied later at a sync point.
+//
+// Each thread records into its own stream (Stream(thread_index)) so recording doesn't need any synchronization.
+// Playback must not run concurrently with anything else. It applies the commands in three phases:
+//
+// 1. Entities are created, grouped by archetype with one CreateEntities call per archetype.
+// 2. Add, remove and set commands are applied in the order they were recorded (stream by stream). Consecutive adds
+//    (or removes) of the same component type are applied as one batch (see EntityManager::AddComponent for entities).
+// 3. Entities are destroyed with a single DestroyEntities call.
+//
+// This means that destroying an entity always wins over anything else that was recorded for the entity.
+struct EntityCommandBuffer {
+  static const i32 STREAM_MAX = 64;
+
+  EntityCommandStream* streams_;
+  i32                  stream_count_;
+
+  void Create(i32 stream_count);
+
+  void Destroy();
+
+  // ---
+
+  EntityCommandStream& Stream(i32 thread_index) {
+    assert(thread_index < stream_count_);
+    return streams_[thread_index];
+  }
+
+  // Apply all the recorded commands and clear the command buffer
+  void Playback(EntityManager* entity_manager);
+
+  // Find the entity that a placeholder entity was replaced with during playback. This works until the command buffer is
+  // played back again. Entities that aren't placeholders are returned as is.
+  Entity Resolve(Entity entity);
+
+  // Placeholder entities have an index less than -1 and the index of the stream that created them as version
+  static bool IsPlaceholder(Entity entity) { return entity.index_ < -1; }
+};
+} // namespace game
@@ -0,0 +1,178 @@
+#include "../test/test.h"
+
+#include "entity-command-buffer.hh"
+
+#include "entity-manager.hh"
+#include "world.hh"
+
+#include <thread>
+
+using namespace game;
+
+namespace {
+struct Position {
+  enum { COMPONENT_TYPE = 1 };
+
+  float v_[3];
+};
+
+struct Rotation {
+  enum { COMPONENT_TYPE = 2 };
+
+  float axis_[3];
+  float angle_;
+};
+
+template <typename T> T* GetComponentData(EntityManager& entity_manager, Entity entity) {
+  _EntityRecord chunk_index = entity_manager._Record(entity.index_);
+  Archetype&    archetype   = chunk_index.chunk_->Archetype();
+  for (int i = 0; i < archetype.types_len_; i++) {
+    if (archetype.types_[i] == GetComponentTypeId<T>()) {
+      return (T*)((byte*)chunk_index.chunk_->Buffer() + archetype.offsets_[i]) + chunk_index.index_;
+    }
+  }
+  return nullptr;
+}
+
+bool IsAlive(EntityManager& entity_manager, Entity entity) {
+  return entity_manager._Record(entity.index_).version_ == entity.version_;
+}
+
+const int THREAD_COUNT = 4;
+
+// Record what a job kernel running on one thread might record
+void Record(EntityCommandStream* stream, Archetype* archetype, int count, Entity* placeholders) {
+  for (int i = 0; i < count; i++) {
+    Position position = { { float(stream->index_), float(i), 0 } };
+
+    placeholders[i] = stream->CreateEntity(archetype);
+    stream->SetComponentData(placeholders[i], position);
+  }
+}
+} // namespace
+
+int main(int argc, char* argv[]) {
+  test_init(argc, argv);
+
+  const TypeInfo components[] = {
+    GAME_COMPONENT(Entity),
+    GAME_COMPONENT(Position),
+    GAME_COMPONENT(Rotation),
+  };
+
+  TEST_CASE("EntityCommandBufferTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    auto position = m.CreateArchetype({ GetComponentTypeId<Position>() });
+    auto rotation = m.CreateArchetype({ GetComponentTypeId<Rotation>() });
+
+    Entity existing[2];
+    m.CreateEntities(position, existing, ArrayLength(existing));
+
+    EntityCommandBuffer ecb;
+    ecb.Create(2);
+
+    EntityCommandStream& s0 = ecb.Stream(0);
+    EntityCommandStream& s1 = ecb.Stream(1);
+
+    Entity a = s0.CreateEntity(position);
+    Entity b = s1.CreateEntity(rotation);
+    Entity c = s0.CreateEntity(position);
+
+    ASSERT_TRUE(EntityCommandBuffer::IsPlaceholder(a));
+    ASSERT_TRUE(EntityCommandBuffer::IsPlaceholder(b));
+    ASSERT_FALSE(EntityCommandBuffer::IsPlaceholder(existing[0]));
+
+    s0.SetComponentData(a, Position{ { 1, 2, 3 } });
+
+    // placeholders can be used from other streams, commands apply in the order they were recorded
+    s1.AddComponent<Rotation>(a);
+    s1.SetComponentData(a, Rotation{ { 0, 1, 0 }, 4 });
+    s1.AddComponent<Position>(b);
+
+    s0.AddComponent<Rotation>(existing[0]);
+    s0.DestroyEntity(existing[1]);
+
+    // destroying wins over anything else
+    s1.DestroyEntity(c);
+    s1.AddComponent<Rotation>(c);
+
+    ASSERT_EQUAL_I32(2, position->entity_count_); // nothing happens until playback
+
+    ecb.Playback(&m);
+
+    Entity real_a = ecb.Resolve(a);
+    Entity real_b = ecb.Resolve(b);
+    Entity real_c = ecb.Resolve(c);
+
+    ASSERT_TRUE(IsAlive(m, real_a));
+    ASSERT_TRUE(IsAlive(m, real_b));
+    ASSERT_FALSE(IsAlive(m, real_c));
+    ASSERT_TRUE(IsAlive(m, existing[0]));
+    ASSERT_FALSE(IsAlive(m, existing[1]));
+
+    ASSERT_TRUE(GetComponentData<Position>(m, real_a)->v_[2] == 3.0f);
+    ASSERT_TRUE(GetComponentData<Rotation>(m, real_a)->angle_ == 4.0f);
+    ASSERT_TRUE(GetComponentData<Position>(m, real_b) != nullptr);
+    ASSERT_TRUE(GetComponentData<Rotation>(m, existing[0]) != nullptr);
+
+    ASSERT_EQUAL_I32(0, position->entity_count_);
+    ASSERT_EQUAL_I32(0, rotation->entity_count_);
+
+    // the streams are empty again
+    ASSERT_EQUAL_I32(0, s0.buffer_.Len());
+    ASSERT_EQUAL_I32(0, s1.buffer_.Len());
+
+    ecb.Playback(&m);
+
+    ecb.Destroy();
+
+    world.Destroy();
+  }
+
+  TEST_CASE("EntityCommandBufferThreadTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    auto archetype = m.CreateArchetype({ GetComponentTypeId<Position>() });
+
+    EntityCommandBuffer ecb;
+    ecb.Create(THREAD_COUNT);
+
+    const int count = 1000;
+
+    auto placeholders = MemAllocArray<Entity>(MEM_ALLOC_HEAP, THREAD_COUNT * count);
+
+    std::thread threads[THREAD_COUNT];
+    for (int i = 0; i < THREAD_COUNT; i++) {
+      threads[i] = std::thread(Record, &ecb.Stream(i), archetype, count, placeholders + i * count);
+    }
+    for (int i = 0; i < THREAD_COUNT; i++) {
+      threads[i].join();
+    }
+
+    ecb.Playback(&m);
+
+    ASSERT_EQUAL_I32(THREAD_COUNT * count, archetype->entity_count_);
+
+    for (int i = 0; i < THREAD_COUNT; i++) {
+      for (int j = 0; j < count; j++) {
+        Position* position = GetComponentData<Position>(m, ecb.Resolve(placeholders[i * count + j]));
+        ASSERT_TRUE((position->v_[0] == float(i)) & (position->v_[1] == float(j)));
+      }
+    }
+
+    MemFree(MEM_ALLOC_HEAP, placeholders);
+
+    ecb.Destroy();
+
+    world.Destroy();
+  }
+}
@@ -6,404 +6,1724 @@
 #include "system.hh" // SystemChunk...
 #include "world.hh"
 
+#include "../common/intrin.hh"
 #include "../common/mem.hh"
 
+#include <cstdlib> // qsort
+
 using namespace game;
 
+// Resolve entity. If the entity is valid the return value is the entity index otherwise invalid index value (-1)
+i32 ResolveEntity(EntityManager* m, Entity entity) {
+  return m->_Record(entity.index_).version_ == entity.version_ ? entity.index_ : -1;
+}
+
+namespace {
+// Write count entities with ascending indices starting at first_index. Entity indices that have never been used have
+// version 1. Two entities per store.
+void FillFreshEntities(Entity* entities, i32 first_index, i32 count) {
+  __m128i       v    = _mm_setr_epi32(first_index, 1, first_index + 1, 1);
+  const __m128i step = _mm_setr_epi32(2, 0, 2, 0);
+
+  i32 i = 0;
+  for (; i + 2 <= count; i += 2) {
+    _mm_storeu_si128((__m128i*)(entities + i), v);
+    v = _mm_add_epi32(v, step);
+  }
+  for (; i < count; i++) {
+    entities[i] = { first_index + i, 1 };
+  }
+}
+
+bool GetBit(const u64* bits, i32 index) {
+  return ((bits[index / 64] >> (index & 63)) & 1) != 0;
+}
+
+void SetBit(u64* bits, i32 index, bool value) {
+  const u64 mask = 1ULL << (index & 63);
+  bits[index / 64] = value ? (bits[index / 64] | mask) : (bits[index / 64] & ~mask);
+}
+
+// Copy the enabled bits of count entities of a chunk to another chunk (or to another place in the same chunk).
+// Enableable component types that the source archetype doesn't have are enabled.
+void CopyEnabledBits(const Archetype* dst,
+                     i32              dst_chunk_index,
+                     i32              dst_index,
+                     const Archetype* src,
+                     i32              src_chunk_index,
+                     i32              src_index,
+                     i32              count) {
+  for (i32 k = 0; k < dst->enableable_types_len_; k++) {
+    u64*       dst_bits = dst->chunk_data_.EnabledBits(k, dst_chunk_index);
+    const i32  src_k    = src->_EnableableComponentIndex(dst->enableable_types_[k]);
+    const u64* src_bits = src_k != -1 ? src->chunk_data_.EnabledBits(src_k, src_chunk_index) : nullptr;
+    for (i32 i = 0; i < count; i++) {
+      SetBit(dst_bits, dst_index + i, (src_bits == nullptr) || GetBit(src_bits, src_index + i));
+    }
+  }
+}
+
+// Set or clear the bits in [begin, end), a word at a time
+void FillBits(u64* bits, i32 begin, i32 end, bool value) {
+  for (i32 i = begin; i < end;) {
+    const i32 n    = Min(64 - (i & 63), end - i);
+    const u64 mask = (n == 64 ? ~0ULL : ((1ULL << n) - 1)) << (i & 63);
+    bits[i / 64]   = value ? (bits[i / 64] | mask) : (bits[i / 64] & ~mask);
+    i += n;
+  }
+}
+
+// Set or clear the enabled bits of the entities in [begin, end) of a chunk for every enableable component type
+void SetEnabledBits(const Archetype* archetype, i32 chunk_index, i32 begin, i32 end, bool value) {
+  for (i32 k = 0; k < archetype->enableable_types_len_; k++) {
+    FillBits(archetype->chunk_data_.EnabledBits(k, chunk_index), begin, end, value);
+  }
+}
+} // namespace
+
 void EntityManager::Create(World* world, i32 initial_capacity) {
   MemZeroInit(this);
 
-  world_ = world;
+  world_ = world;
+
+  archetypes_.Create(64);
+
+  for (i32 i = 0; i < CHUNK_SIZE_CLASS_COUNT; i++) {
+    chunk_magazines_[i].Create(&world_->chunk_allocator_->pools_[i]);
+  }
+
+  archetype_allocator_.Create();
+
+  _SetCapacity(initial_capacity);
+
+  query_map_.Create(MEM_ALLOC_HEAP, 0);
+  query_list_.Create(MEM_ALLOC_HEAP, 0);
+
+  queries_by_type_len_ = world_->type_registry_->components_.Len();
+  queries_by_type_     = MemAllocArray<List<EntityQuery*>>(MEM_ALLOC_HEAP, queries_by_type_len_);
+  for (i32 i = 0; i < queries_by_type_len_; i++) {
+    queries_by_type_[i] = List<EntityQuery*>::WithAllocator(MEM_ALLOC_HEAP);
+  }
+  unindexed_queries_ = List<EntityQuery*>::WithAllocator(MEM_ALLOC_HEAP);
+
+  selected_chunks_ = List<_SelectedChunk>::WithAllocator(MEM_ALLOC_HEAP);
+  selected_bits_   = List<u64>::WithAllocator(MEM_ALLOC_HEAP);
+
+  defragment_candidates_ = List<_DefragmentCandidate>::WithAllocator(MEM_ALLOC_HEAP);
+
+  shared_components_.Create();
+
+  buffer_allocator_.Create();
+
+  global_system_version_ = 1;
+
+  structural_change_version_ = 1; // Queries start out with version zero, an empty cache that is out of date
+
+  // Setup built-in entity only archetype
+
+  entity_archetype_         = CreateArchetype({ nullptr, 0, 0 });
+  entity_archetype_->label_ = "Entity";
+}
+
+void EntityManager::Destroy() {
+  for (auto query : query_list_) {
+    query->Destroy();
+  }
+
+  query_map_.Destroy();
+  query_list_.Destroy();
+
+  for (i32 i = 0; i < queries_by_type_len_; i++) {
+    queries_by_type_[i].Destroy();
+  }
+  MemFree(MEM_ALLOC_HEAP, queries_by_type_);
+  queries_by_type_ = nullptr;
+
+  unindexed_queries_.Destroy();
+
+  selected_chunks_.Destroy();
+  selected_bits_.Destroy();
+
+  defragment_candidates_.Destroy();
+
+  FlushChunkMagazines();
+
+  shared_components_.Destroy();
+
+  // Overflow blocks of buffers that are still alive must go back to the allocator before it is destroyed
+  for (auto archetype : archetypes_.list_) {
+    for (i32 i = 0; 0 < archetype->buffer_types_len_ && i < archetype->chunk_data_.Len(); i++) {
+      Chunk* chunk = archetype->chunk_data_.ChunkPtrArray()[i];
+      _ReleaseBuffers(chunk, 0, chunk->EntityCount(), nullptr);
+    }
+  }
+
+  buffer_allocator_.Destroy();
+
+  // This is just the reverse of what the _SetCapacity function does
+
+  if (entity_pages_ != nullptr) {
+    for (i32 i = 0; i < entity_capacity_ / ENTITY_PAGE_SIZE; i++) {
+      MemFree(MEM_ALLOC_HEAP, entity_pages_[i]);
+    }
+    MemFree(MEM_ALLOC_HEAP, entity_pages_);
+    entity_pages_ = nullptr;
+  }
+
+  // Destroy all archetypes before we destroy the archetype allocator
+
+  for (auto archetype : archetypes_.list_) {
+    archetype->Destroy();
+  }
+
+  archetypes_.Destroy();
+
+  archetype_allocator_.Destroy();
+
+  world_ = nullptr;
+}
+
+Archetype* EntityManager::CreateArchetype(Slice<const ComponentTypeId> unsorted_types, i32 expected_entity_count) {
+  auto sorted_types = MemStackalloc(ComponentTypeId, 0, unsorted_types.Len() + 1);
+  sorted_types      = Append(sorted_types, GetComponentTypeId<Entity>());
+  for (auto type : unsorted_types) {
+    sorted_types = Insert(sorted_types, type);
+  }
+
+#if _DEBUG
+  for (int i = 1; i < sorted_types.len_; i++) {
+    assert(sorted_types[i - 1] < sorted_types[i]);
+  }
+#endif
+
+  auto existing_archetype = archetypes_.TryGet(sorted_types.Const());
+  if (existing_archetype != nullptr) {
+    return existing_archetype;
+  }
+
+  Archetype* new_archetype = archetype_allocator_.Allocate<Archetype>();
+
+  MemZeroInit(new_archetype);
+
+  auto types   = archetype_allocator_.AllocateArray<ComponentTypeId>(sorted_types.Len());
+  auto sizes   = archetype_allocator_.AllocateArray<u16>(sorted_types.Len());
+  auto offsets = archetype_allocator_.AllocateArray<i32>(sorted_types.Len());
+
+  new_archetype->types_     = MemCopyArray(types, sorted_types.ptr_, sorted_types.Len());
+  new_archetype->types_len_ = sorted_types.Len();
+
+  auto type_infos       = MemStackalloc(const TypeInfo*, sorted_types.Len(), sorted_types.Len());
+  auto shared_types     = MemStackalloc(ComponentTypeId, 0, sorted_types.Len());
+  auto buffer_types     = MemStackalloc(i32, 0, sorted_types.Len());
+  auto enableable_types = MemStackalloc(ComponentTypeId, 0, sorted_types.Len());
+
+  auto shared_index     = archetype_allocator_.AllocateArray<i16>(sorted_types.Len());
+  auto enableable_index = archetype_allocator_.AllocateArray<i16>(sorted_types.Len());
+
+  for (int i = 0; i < sorted_types.len_; i++) {
+    const TypeInfo* type_info = world_->type_registry_->GetComponentTypeInfo(sorted_types[i]);
+
+    type_infos[i]       = type_info;
+    sizes[i]            = u16(type_info->ChunkArraySize());
+    shared_index[i]     = -1;
+    enableable_index[i] = -1;
+
+    if (type_info->flags_ & COMPONENT_FLAG_SHARED) {
+      shared_index[i] = i16(shared_types.Len());
+      shared_types    = Append(shared_types, sorted_types[i]);
+    }
+    if (type_info->flags_ & COMPONENT_FLAG_BUFFER) {
+      buffer_types = Append(buffer_types, i);
+    }
+    if (type_info->flags_ & COMPONENT_FLAG_ENABLEABLE) {
+      enableable_index[i] = i16(enableable_types.Len());
+      enableable_types    = Append(enableable_types, sorted_types[i]);
+    }
+  }
+
+  new_archetype->shared_index_     = shared_index;
+  new_archetype->enableable_index_ = enableable_index;
+
+  new_archetype->sizes_ = sizes;
+
+  assert(shared_types.Len() <= Archetype::SHARED_COMPONENT_MAX);
+
+  new_archetype->shared_types_ = MemCopyArray(
+      archetype_allocator_.AllocateArray<ComponentTypeId>(shared_types.Len()), shared_types.ptr_, shared_types.Len());
+  new_archetype->shared_types_len_ = shared_types.Len();
+
+  new_archetype->buffer_type_indices_ = MemCopyArray(
+      archetype_allocator_.AllocateArray<i32>(buffer_types.Len()), buffer_types.ptr_, buffer_types.Len());
+  new_archetype->buffer_types_len_ = buffer_types.Len();
+
+  new_archetype->enableable_types_ = MemCopyArray(archetype_allocator_.AllocateArray<ComponentTypeId>(
+                                                      enableable_types.Len()),
+                                                  enableable_types.ptr_,
+                                                  enableable_types.Len());
+  new_archetype->enableable_types_len_ = enableable_types.Len();
+
+  const i32 registry_len = world_->type_registry_->components_.Len();
+
+  new_archetype->index_by_type_ = archetype_allocator_.AllocateArray<i16>(registry_len);
+  for (i32 i = 0; i < registry_len; i++) {
+    new_archetype->index_by_type_[i] = -1;
+  }
+  for (i32 i = 0; i < sorted_types.Len(); i++) {
+    new_archetype->index_by_type_[sorted_types[i].Index()] = i16(i);
+  }
+  new_archetype->index_by_type_len_ = registry_len;
+
+  new_archetype->type_mask_       = archetype_allocator_.AllocateArray<u64>(world_->type_registry_->TypeMaskWords());
+  new_archetype->type_mask_words_ = world_->type_registry_->TypeMaskWords();
+  memset(new_archetype->type_mask_, 0, sizeof(u64) * size_t(new_archetype->type_mask_words_));
+  for (auto type : sorted_types) {
+    SetTypeMaskBit(new_archetype->type_mask_, type);
+  }
+
+  // ---
+
+  // Pick a chunk size class. Without an estimate we use the default size class. When we expect a lot of entities we
+  // want big chunks so that systems move between chunks less often but there's no point in having chunks that can hold
+  // a lot more entities than we expect, that memory would just go to waste.
+
+  ChunkSizeClass size_class = CHUNK_SIZE_CLASS_DEFAULT;
+
+  if (0 < expected_entity_count) {
+    i32 wanted_capacity = Min(expected_entity_count, CHUNK_TARGET_ENTITY_COUNT);
+    for (size_class = ChunkSizeClass(0); size_class < CHUNK_SIZE_CLASS_COUNT - 1;
+         size_class = ChunkSizeClass(size_class + 1)) {
+      i32 capacity =
+          ArchetypeChunkLayout(archetype_layout_, type_infos.ptr_, type_infos.Len(), ChunkBufferSize(size_class), nullptr);
+      if (wanted_capacity <= capacity) {
+        break;
+      }
+    }
+  }
+
+  new_archetype->layout_           = archetype_layout_;
+  new_archetype->chunk_size_class_ = size_class;
+
+  new_archetype->chunk_entity_capacity_ =
+      ArchetypeChunkLayout(archetype_layout_, type_infos.ptr_, type_infos.Len(), ChunkBufferSize(size_class), offsets);
+
+  assert(
+      (0 < new_archetype->chunk_entity_capacity_)
+      & (new_archetype->chunk_entity_capacity_ <= ChunkBufferSize(size_class) / i32(sizeof(Entity))));
+
+  new_archetype->offsets_ = offsets;
+
+  new_archetype->chunk_components_size_   = ChunkComponentsSize(type_infos.ptr_, type_infos.Len());
+  new_archetype->chunk_components_offset_ = ChunkBufferSize(size_class) - new_archetype->chunk_components_size_;
+
+  new_archetype->chunk_data_.Create(new_archetype->types_len_,
+                                    new_archetype->shared_types_len_,
+                                    new_archetype->enableable_types_len_,
+                                    new_archetype->chunk_entity_capacity_);
+
+  new_archetype->chunk_with_empty_slots_ = List<Chunk*>::WithAllocator(MEM_ALLOC_HEAP);
+
+  new_archetype->matching_queries_ = List<EntityQuery*>::WithAllocator(MEM_ALLOC_HEAP);
+
+  new_archetype->edges_ = List<ArchetypeEdge>::WithAllocator(MEM_ALLOC_HEAP);
+
+  // ---
+
+  // Only the queries that mention one of the component types of the archetype are candidates. A query can be found
+  // under more than one of them, once it has been added the archetype is the last one it matched.
+  for (auto type : new_archetype->TypeId()) {
+    for (auto query : queries_by_type_[type.Index()]) {
+      const i32 len = query->matching_archetypes_.Len();
+      if ((0 < len) && (query->matching_archetypes_[len - 1] == new_archetype)) {
+        continue;
+      }
+      if (query->IsMatch(new_archetype)) {
+        query->_AddMatchingArchetype(new_archetype);
+      }
+    }
+  }
+  for (auto query : unindexed_queries_) {
+    if (query->IsMatch(new_archetype)) {
+      query->_AddMatchingArchetype(new_archetype);
+    }
+  }
+
+  archetypes_.Add(new_archetype);
+
+  structural_change_version_++;
+
+  return new_archetype;
+}
+
+Chunk* EntityManager::_ChunkWithEmptySlots(Archetype* archetype, const i32* shared_values) {
+  if (archetype->shared_types_len_ == 0) {
+    if (0 < archetype->chunk_with_empty_slots_.Len()) {
+      return archetype->chunk_with_empty_slots_[0];
+    }
+  } else {
+    // Chunks with other shared values are not an option. We don't expect many chunks with space per archetype, a
+    // linear search will do.
+    for (auto chunk : archetype->chunk_with_empty_slots_) {
+      if (archetype->chunk_data_.HasSharedValues(chunk->ListIndex(), shared_values)) {
+        return chunk;
+      }
+    }
+  }
+
+  // todo: All assignments/initialization of chunk header should stay in scope here and not be spread out over multiple functions
+
+  Chunk* chunk                = chunk_magazines_[archetype->chunk_size_class_].Allocate();
+  chunk->header_.archetype_   = archetype;
+  chunk->header_.len_         = 0;
+  chunk->header_.cap_         = archetype->chunk_entity_capacity_;
+  chunk->header_.select_slot_ = -1;
+  archetype->chunk_data_.Add(chunk, global_system_version_, shared_values);
+
+  archetype->_AddChunkWithEmptySlots(chunk);
+
+  structural_change_version_++;
+
+  return chunk;
+}
+
+void EntityManager::_CreateEntities(Archetype* archetype, const i32* shared_values, Entity* entities, i32 count) {
+  _ReserveEntities(count);
+
+  for (; 0 < count;) {
+    Chunk*    chunk = _ChunkWithEmptySlots(archetype, shared_values);
+    const i32 n     = Min(count, chunk->EntityCapacity() - chunk->EntityCount());
+
+    _CreateEntitiesInChunk(chunk, entities, n);
+
+    // optional
+    if (entities != nullptr) {
+      entities += n;
+    }
+
+    count -= n;
+  }
+}
+
+void EntityManager::_ReserveEntities(i32 count) {
+  // The entity table grows at most once per call, the free list never runs into the cork below
+  if (entity_capacity_ - entity_count_ <= count) {
+    _SetCapacity(Max(2 * entity_capacity_, entity_count_ + count + 1));
+  }
+
+  entity_count_ += count;
+  entity_create_destroy_version_++;
+}
+
+void EntityManager::_CreateEntitiesInChunk(Chunk* chunk, Entity* entities, i32 n) {
+  Archetype* archetype = chunk->header_.archetype_;
+
+  assert(0 < n && chunk->EntityCount() + n <= chunk->EntityCapacity());
+
+  Entity* chunk_entities_end = chunk->EntityArray() + chunk->EntityCount();
+
+  for (i32 i = 0; i < n;) {
+    // Initially entities are created as an ascending sequence of indexes
+    // but when entities are destroyed it will create holes and instead of
+    // "compacting" the array we move the last index into the hole to be
+    // reused
+
+    // the purpose of this is two fold, we don't create more indexes than we need
+    // and we try to fill holes as soon as possible
+
+    const i32 entity_index = next_free_entity_index_;
+
+    if (entity_index == fresh_entity_index_) {
+      // The holes have been filled, what is left of the free list is the ascending run of indices that have never
+      // been used. The rest of the chunk gets a run of them without reading the entity table.
+      const i32 run = n - i;
+
+      FillFreshEntities(chunk_entities_end + i, entity_index, run);
+
+      for (i32 j = 0; j < run;) {
+        _EntityRecord* records = &_Record(entity_index + j);
+
+        const i32 page_end = Min(run, j + ENTITY_PAGE_SIZE - ((entity_index + j) & (ENTITY_PAGE_SIZE - 1)));
+        for (i32 k = 0; k < page_end - j; k++) {
+          records[k].chunk_ = chunk;
+          records[k].index_ = chunk->EntityCount() + i + j + k;
+        }
+        j = page_end;
+      }
+
+      next_free_entity_index_ = entity_index + run;
+      fresh_entity_index_     = entity_index + run;
+      break;
+    }
+
+    _EntityRecord* record = &_Record(entity_index);
+
+    assert(record->index_ != -1); // there is always room, see above
+    next_free_entity_index_ = record->index_;
+
+    Entity* entity   = chunk_entities_end + i;
+    entity->index_   = entity_index;
+    entity->version_ = record->version_;
+
+    record->chunk_ = chunk;
+    record->index_ = chunk->EntityCount() + i;
+
+    i++;
+  }
+
+  // optional
+  if (entities != nullptr) {
+    MemCopyArray(entities, chunk_entities_end, n);
+  }
+
+  // New entities have all their components enabled
+  SetEnabledBits(archetype, chunk->ListIndex(), chunk->EntityCount(), chunk->EntityCount() + n, true);
+
+  chunk->AddEntityCount(n);
+
+  archetype->chunk_data_.EntityCountArray()[chunk->ListIndex()] = chunk->EntityCount();
+
+  _SetChunkChanged(chunk);
+
+  if (chunk->EntityCount() == chunk->EntityCapacity()) {
+    // This chunk has now been filled up. We must therefore remove it from the "chunks with space" list
+
+    archetype->_RemoveChunkWithEmptySlots(chunk);
+  }
+
+  archetype->entity_count_ += n;
+}
+
+namespace {
+// Fill count elements of size bytes at dst with copies of the element at src. The copied range doubles each time so
+// that most of the work is done by a few large copies.
+void ReplicateElement(byte* dst, const byte* src, i32 size, i32 count) {
+  memcpy(dst, src, size_t(size));
+  for (i32 filled = 1; filled < count;) {
+    const i32 n = Min(filled, count - filled);
+    memcpy(dst + filled * size, dst, size_t(n * size));
+    filled += n;
+  }
+}
+} // namespace
+
+void EntityManager::Instantiate(Entity prefab, Entity* out, i32 count) {
+  i32 entity_index = ResolveEntity(this, prefab);
+  if (entity_index == -1) {
+    for (i32 i = 0; i < count; i++) {
+      out[i] = { -1, 0 };
+    }
+    return;
+  }
+
+  _EntityRecord prefab_index = _Record(entity_index);
+
+  Archetype* archetype    = prefab_index.chunk_->header_.archetype_;
+  byte*      prefab_chunk = (byte*)prefab_index.chunk_->Buffer();
+
+  i32 shared_values[Archetype::SHARED_COMPONENT_MAX];
+  archetype->chunk_data_.GetSharedValues(prefab_index.chunk_->ListIndex(), shared_values);
+
+  _ReserveEntities(count);
+
+  for (; 0 < count;) {
+    Chunk*    chunk = _ChunkWithEmptySlots(archetype, shared_values);
+    const i32 start = chunk->EntityCount();
+    const i32 n     = Min(count, chunk->EntityCapacity() - start);
+
+    _CreateEntitiesInChunk(chunk, out, n);
+
+    // The prefab doesn't move, new entities are appended to the end of the chunk
+    for (i32 i = 1; i < archetype->types_len_; i++) {
+      const i32 size   = archetype->sizes_[i];
+      const i32 offset = archetype->offsets_[i];
+      ReplicateElement((byte*)chunk->Buffer() + offset + start * size,
+                       prefab_chunk + offset + prefab_index.index_ * size,
+                       size,
+                       n);
+    }
+
+    // The copies have the components enabled that the prefab has enabled (new entities start with all enabled)
+    for (i32 k = 0; k < archetype->enableable_types_len_; k++) {
+      if (!GetBit(archetype->chunk_data_.EnabledBits(k, prefab_index.chunk_->ListIndex()), prefab_index.index_)) {
+        FillBits(archetype->chunk_data_.EnabledBits(k, chunk->ListIndex()), start, start + n, false);
+      }
+    }
+
+    // The copies share the overflow blocks of the prefab buffers, each copy needs its own
+    for (i32 k = 0; k < archetype->buffer_types_len_; k++) {
+      const i32 i            = archetype->buffer_type_indices_[k];
+      const i32 size         = archetype->sizes_[i];
+      const i32 element_size = world_->type_registry_->components_[archetype->types_[i].Index()].element_size_;
+      byte*     array        = (byte*)chunk->Buffer() + archetype->offsets_[i];
+      for (i32 j = start; j < start + n; j++) {
+        BufferCloneOverflow((BufferHeader*)(array + j * size), &buffer_allocator_, element_size);
+      }
+    }
+
+    out += n;
+    count -= n;
+  }
+}
+
+namespace {
+// Call f(dst, src) for each live entity in the range [new_len, len) that must be moved into a hole left by a destroyed
+// entity in the range [0, new_len). The destroyed bitmask must be clear beyond len.
+template <typename F> void ForEachTailMove(const u64* destroyed, i32 len, i32 new_len, F f) {
+  i32 src_word = new_len / 64;
+  u64 src_bits = ~destroyed[src_word] & (~0ULL << (new_len & 63));
+  for (i32 w = 0; w * 64 < new_len; w++) {
+    u64 holes = destroyed[w];
+    if (new_len < (w + 1) * 64) {
+      holes &= (1ULL << (new_len & 63)) - 1;
+    }
+    for (; holes != 0; holes &= holes - 1) {
+      while (src_bits == 0) {
+        src_bits = ~destroyed[++src_word];
+      }
+      f(w * 64 + i32(tzcnt_u64(holes)), src_word * 64 + i32(tzcnt_u64(src_bits)));
+      src_bits &= src_bits - 1;
+    }
+  }
+}
+} // namespace
+
+void EntityManager::_CompactChunk(Chunk* chunk, const u64* destroyed, i32 destroyed_count) {
+  Archetype* archetype = chunk->header_.archetype_;
+
+  const i32 len     = chunk->EntityCount();
+  const i32 new_len = len - destroyed_count;
+
+  assert(0 < new_len);
+
+  // Move the tail one component array at a time, then clear what's left behind so that new entities start out zeroed
+  for (i32 i = 0; i < archetype->types_len_; i++) {
+    const i32 size  = archetype->sizes_[i];
+    byte*     array = (byte*)chunk->Buffer() + archetype->offsets_[i];
+
+    ForEachTailMove(destroyed, len, new_len, [array, size](i32 dst, i32 src) {
+      memcpy(array + dst * size, array + src * size, size_t(size));
+    });
+
+    memset(array + new_len * size, 0, size_t(destroyed_count * size));
+  }
+
+  // The entity array has been moved as well, patch the location of the entities that moved. The enabled bits go along.
+  Entity*   chunk_entities = chunk->EntityArray();
+  const i32 chunk_index    = chunk->ListIndex();
+  ForEachTailMove(destroyed, len, new_len, [this, chunk_entities, archetype, chunk_index](i32 dst, i32 src) {
+    _Record(chunk_entities[dst].index_).index_ = dst;
+    CopyEnabledBits(archetype, chunk_index, dst, archetype, chunk_index, src, 1);
+  });
+  SetEnabledBits(archetype, chunk_index, new_len, len, false);
+
+  _SetChunkChanged(chunk);
+}
+
+void EntityManager::_SetChunkChanged(Chunk* chunk) {
+  ArchetypeChunkData& chunk_data = chunk->header_.archetype_->chunk_data_;
+  for (i32 i = 0; i < chunk_data.component_count_; i++) {
+    chunk_data.ChangeVersionArray(i)[chunk->ListIndex()] = global_system_version_;
+  }
+
+  structural_change_version_++;
+}
+
+void EntityManager::_ReleaseBuffers(Chunk* chunk, i32 begin, i32 end, const Archetype* keep) {
+  Archetype* archetype = chunk->header_.archetype_;
+  for (i32 k = 0; k < archetype->buffer_types_len_; k++) {
+    const i32 i = archetype->buffer_type_indices_[k];
+    if (keep != nullptr && keep->_HasComponentType(archetype->types_[i])) {
+      continue;
+    }
+
+    const i32 size         = archetype->sizes_[i];
+    const i32 element_size = world_->type_registry_->components_[archetype->types_[i].Index()].element_size_;
+    byte*     array        = (byte*)chunk->Buffer() + archetype->offsets_[i];
+    for (i32 j = begin; j < end; j++) {
+      BufferRelease((BufferHeader*)(array + j * size), &buffer_allocator_, element_size);
+    }
+  }
+}
+
+void EntityManager::_FreeChunk(Chunk* chunk) {
+  Archetype* archetype = chunk->header_.archetype_;
+
+  assert(chunk->EntityCount() == 0);
+
+  if (chunk->FreeListIndex() != -1) {
+    archetype->_RemoveChunkWithEmptySlots(chunk);
+  }
+  archetype->chunk_data_.RemoveAtSwapBack(chunk->ListIndex());
+
+  chunk_magazines_[archetype->chunk_size_class_].Free(chunk);
+
+  structural_change_version_++;
+}
+
+void EntityManager::FlushChunkMagazines() {
+  for (i32 i = 0; i < CHUNK_SIZE_CLASS_COUNT; i++) {
+    chunk_magazines_[i].Destroy();
+  }
+}
+
+bool EntityManager::_SelectEntity(Chunk* chunk, i32 index) {
+  if (chunk->header_.select_slot_ == -1) {
+    const i32 bits  = selected_bits_.Len();
+    const i32 words = chunk->EntityCount() / 64 + 1;
+    if (selected_bits_.Cap() < bits + words) {
+      selected_bits_.SetCapacity(Max(2 * selected_bits_.Cap(), bits + words));
+    }
+    selected_bits_.Resize(bits + words);
+    memset(selected_bits_.ptr_ + bits, 0, sizeof(u64) * size_t(words));
+
+    chunk->header_.select_slot_ = selected_chunks_.Len();
+    selected_chunks_.Add({ chunk, bits, 0 });
+  }
+
+  _SelectedChunk& selected = selected_chunks_[chunk->header_.select_slot_];
+
+  u64&      word = selected_bits_[selected.bits_ + index / 64];
+  const u64 mask = 1ULL << (index & 63);
+  if (word & mask) {
+    return false;
+  }
+
+  word |= mask;
+  selected.count_++;
+  return true;
+}
+
+void EntityManager::DestroyEntities(Entity* entities, i32 count) {
+  // The entity handles are bucketed by chunk first. Every chunk that is hit gets a bitmask of the entities that are
+  // destroyed, then each chunk is compacted once.
+  selected_chunks_.Resize(0);
+  selected_bits_.Resize(0);
+
+  i32 free_index = next_free_entity_index_;
+
+  for (i32 i = 0; i < count; i++) {
+    const i32 entity_index = entities[i].index_;
+
+    _EntityRecord* record = &_Record(entity_index);
+
+    if (!(record->version_ == entities[i].version_)) {
+      continue; // the entity has already been destroyed
+    }
+
+    _SelectEntity(record->chunk_, record->index_);
+
+    record->version_++;
+
+    record->chunk_ = nullptr;
+    record->index_ = free_index;
+
+    free_index = entity_index;
+  }
+
+  if (selected_chunks_.Len() == 0) {
+    return; // nothing to destroy
+  }
+
+  next_free_entity_index_ = free_index;
+  entity_create_destroy_version_++;
+
+  for (const _SelectedChunk& d : selected_chunks_) {
+    Chunk*     chunk     = d.chunk_;
+    Archetype* archetype = chunk->header_.archetype_;
+    const u64* destroyed = selected_bits_.ptr_ + d.bits_;
+
+    chunk->header_.select_slot_ = -1;
+
+    const i32 len     = chunk->EntityCount();
+    const i32 new_len = len - d.count_;
+
+    if (0 < archetype->buffer_types_len_) {
+      for (i32 w = 0; w * 64 < len; w++) {
+        for (u64 bits = destroyed[w]; bits != 0; bits &= bits - 1) {
+          const i32 index = w * 64 + i32(tzcnt_u64(bits));
+          _ReleaseBuffers(chunk, index, index + 1, nullptr);
+        }
+      }
+    }
+
+    if (new_len == 0) {
+      chunk->header_.len_ = 0;
+      _FreeChunk(chunk);
+    } else {
+      _CompactChunk(chunk, destroyed, d.count_);
+
+      chunk->header_.len_ = new_len;
+
+      archetype->chunk_data_.EntityCountArray()[chunk->ListIndex()] = new_len;
+
+      if (len == chunk->EntityCapacity()) {
+        archetype->_AddChunkWithEmptySlots(chunk); // This chunk was full but now it has space
+      }
+    }
+
+    archetype->entity_count_ -= d.count_;
+    entity_count_ -= d.count_;
+  }
+}
+
+// ---
+
+void EntityManager::_MoveChunkTail(Chunk* dst, Chunk* src, i32 count) {
+  Archetype* dst_archetype = dst->header_.archetype_;
+  Archetype* src_archetype = src->header_.archetype_;
+
+  assert(count <= src->EntityCount());
+  assert(dst->EntityCount() + count <= dst->EntityCapacity());
+
+  const i32 dst_len = dst->EntityCount();
+  const i32 src_len = src->EntityCount() - count;
+
+  _ReleaseBuffers(src, src_len, src_len + count, dst_archetype);
+
+  // The tail is a contiguous range in every component array so this is one copy per component type. Both type lists
+  // are sorted, component types that only the destination has are left zeroed.
+  for (i32 i = 0, j = 0; i < src_archetype->types_len_; i++) {
+    const i32 size      = src_archetype->sizes_[i];
+    byte*     src_array = (byte*)src->Buffer() + src_archetype->offsets_[i];
+
+    while (j < dst_archetype->types_len_ && dst_archetype->types_[j] < src_archetype->types_[i]) {
+      j++;
+    }
+
+    if (j < dst_archetype->types_len_ && dst_archetype->types_[j] == src_archetype->types_[i]) {
+      byte* dst_array = (byte*)dst->Buffer() + dst_archetype->offsets_[j];
+      memcpy(dst_array + dst_len * size, src_array + src_len * size, size_t(count * size));
+    }
+
+    memset(src_array + src_len * size, 0, size_t(count * size));
+  }
+
+  CopyEnabledBits(dst_archetype, dst->ListIndex(), dst_len, src_archetype, src->ListIndex(), src_len, count);
+  SetEnabledBits(src_archetype, src->ListIndex(), src_len, src_len + count, false);
+
+  Entity* dst_entities = dst->EntityArray();
+  for (i32 i = dst_len; i < dst_len + count; i++) {
+    _EntityRecord* chunk_index = &_Record(dst_entities[i].index_);
+    chunk_index->chunk_        = dst;
+    chunk_index->index_        = i;
+  }
+
+  dst->header_.len_ = dst_len + count;
+  src->header_.len_ = src_len;
+
+  dst_archetype->chunk_data_.EntityCountArray()[dst->ListIndex()] = dst_len + count;
+  src_archetype->chunk_data_.EntityCountArray()[src->ListIndex()] = src_len;
+
+  _SetChunkChanged(dst);
+  _SetChunkChanged(src);
+
+  dst_archetype->entity_count_ += count;
+  src_archetype->entity_count_ -= count;
+}
+
+namespace {
+bool HasSameSharedValues(const _DefragmentCandidate& a, const _DefragmentCandidate& b) {
+  return memcmp(a.shared_values_, b.shared_values_, sizeof(a.shared_values_)) == 0;
+}
+
+int CompareDefragmentCandidates(const void* a, const void* b) {
+  const _DefragmentCandidate* x = (const _DefragmentCandidate*)a;
+  const _DefragmentCandidate* y = (const _DefragmentCandidate*)b;
+  for (i32 i = 0; i < Archetype::SHARED_COMPONENT_MAX; i++) {
+    if (x->shared_values_[i] != y->shared_values_[i]) {
+      return x->shared_values_[i] < y->shared_values_[i] ? -1 : 1;
+    }
+  }
+  return x->entity_count_ - y->entity_count_;
+}
+} // namespace
+
+DefragmentResult EntityManager::DefragmentArchetype(Archetype* archetype, i32 max_chunks) {
+  DefragmentResult result;
+  MemZeroInit(&result);
+
+  result.before_ = archetype->Occupancy();
+  result.after_  = result.before_;
+
+  // Only the chunks that have space are candidates, full chunks can neither give nor take entities
+  List<Chunk*>& chunks          = archetype->chunk_with_empty_slots_;
+  const i32     candidate_count = chunks.Len();
+
+  if (candidate_count < 2 || max_chunks <= 0) {
+    return result;
+  }
+
+  defragment_candidates_.Resize(candidate_count);
+
+  _DefragmentCandidate* candidates = defragment_candidates_.ptr_;
+  for (i32 i = 0; i < candidate_count; i++) {
+    _DefragmentCandidate& candidate = candidates[i];
+    memset(candidate.shared_values_, 0, sizeof(candidate.shared_values_));
+    archetype->chunk_data_.GetSharedValues(chunks[i]->ListIndex(), candidate.shared_values_);
+    candidate.entity_count_ = chunks[i]->EntityCount();
+    candidate.chunk_        = chunks[i];
+  }
+
+  qsort(candidates, size_t(candidate_count), sizeof(_DefragmentCandidate), CompareDefragmentCandidates);
+
+  // Entities can only move between chunks with the same shared values. Moving entities around is only worth it if we
+  // get to free the chunk. All chunks of the archetype have the same capacity, so a group of chunks can give up a chunk
+  // as long as it has a chunk worth of free slots. The emptiest chunk of the group is moved into the fullest chunks.
+  const i32 capacity = archetype->chunk_entity_capacity_;
+
+  for (i32 begin = 0; begin < candidate_count && result.chunks_freed_ < max_chunks;) {
+    i32 end        = begin;
+    i32 free_slots = 0;
+    for (; end < candidate_count && HasSameSharedValues(candidates[begin], candidates[end]); end++) {
+      free_slots += capacity - candidates[end].entity_count_;
+    }
+
+    i32 dst_index = end - 1;
+    for (i32 src_index = begin; src_index < dst_index && capacity <= free_slots && result.chunks_freed_ < max_chunks;
+         src_index++) {
+      Chunk* src = candidates[src_index].chunk_;
+
+      while (0 < src->EntityCount()) {
+        assert(src_index < dst_index);
+
+        Chunk*    dst = candidates[dst_index].chunk_;
+        const i32 n   = Min(src->EntityCount(), dst->EntityCapacity() - dst->EntityCount());
+
+        _MoveChunkTail(dst, src, n);
+
+        if (dst->EntityCount() == dst->EntityCapacity()) {
+          archetype->_RemoveChunkWithEmptySlots(dst);
+          dst_index--;
+        }
+
+        result.entities_moved_ += n;
+      }
+
+      _FreeChunk(src);
+
+      free_slots -= capacity;
+      result.chunks_freed_++;
+    }
+
+    begin = end;
+  }
+
+  result.after_ = archetype->Occupancy();
+
+  return result;
+}
+
+DefragmentResult EntityManager::Defragment(i32 chunk_budget) {
+  DefragmentResult result;
+  MemZeroInit(&result);
+
+  result.before_ = Occupancy();
+
+  const i32 archetype_count = archetypes_.list_.Len();
+
+  for (i32 i = 0; i < archetype_count && result.chunks_freed_ < chunk_budget; i++) {
+    if (archetype_count <= defragment_cursor_) {
+      defragment_cursor_ = 0;
+    }
+
+    const i32        budget           = chunk_budget - result.chunks_freed_;
+    DefragmentResult archetype_result = DefragmentArchetype(archetypes_.list_[defragment_cursor_], budget);
+
+    result.chunks_freed_ += archetype_result.chunks_freed_;
+    result.entities_moved_ += archetype_result.entities_moved_;
+
+    // If we ran out of budget the archetype might not be done yet, we pick up where we left off next time
+    if (archetype_result.chunks_freed_ < budget) {
+      defragment_cursor_++;
+    }
+  }
+
+  result.after_ = Occupancy();
+
+  return result;
+}
+
+ChunkOccupancy EntityManager::Occupancy() const {
+  ChunkOccupancy occupancy;
+  MemZeroInit(&occupancy);
+  for (auto archetype : archetypes_.list_) {
+    occupancy.Add(archetype->Occupancy());
+  }
+  return occupancy;
+}
+
+// ---
+
+void EntityManager::_SetComponentData(Entity entity, ComponentTypeId type_id, const void* data) {
+  i32 entity_index = ResolveEntity(this, entity);
+  if (entity_index == -1) {
+    return; // this is not an error but we might want to log this in debug?
+  }
+
+  const TypeInfo& type_info = world_->type_registry_->components_[type_id.Index()];
+  if (type_info.flags_ & COMPONENT_FLAG_SHARED) {
+    _SetSharedComponentData(entity, type_id, data); // This is a structural change
+    return;
+  }
+  if (type_info.flags_ & COMPONENT_FLAG_BUFFER) {
+    assert(false && "buffer components are changed through GetBuffer");
+    return;
+  }
+
+  _EntityRecord chunk_index = _Record(entity_index);
+
+  Archetype& archetype = chunk_index.chunk_->Archetype();
+
+  const i32 i = archetype._TypeIndex(type_id);
+  if (i == -1) {
+    assert(
+        false
+        && "archetype doesn't have component type"); // crash or structural change? (need to use something else than assert here)
+    return;
+  }
+
+  void* dst = (byte*)chunk_index.chunk_->Buffer() + archetype.offsets_[i] + archetype.sizes_[i] * chunk_index.index_;
+
+  memcpy(dst, data, type_info.size_);
+
+  archetype.chunk_data_.ChangeVersionArray(i)[chunk_index.chunk_->ListIndex()] = global_system_version_;
+}
+
+BufferHeader* EntityManager::_GetBuffer(Entity entity, ComponentTypeId type_id) {
+  i32 entity_index = ResolveEntity(this, entity);
+  if (entity_index == -1) {
+    return nullptr;
+  }
+
+  _EntityRecord chunk_index = _Record(entity_index);
+
+  Archetype& archetype = chunk_index.chunk_->Archetype();
+
+  const i32 i = archetype._TypeIndex(type_id);
+  if (i == -1) {
+    assert(false && "archetype doesn't have buffer component type");
+    return nullptr;
+  }
+
+  assert(world_->type_registry_->components_[type_id.Index()].flags_ & COMPONENT_FLAG_BUFFER);
+  archetype.chunk_data_.ChangeVersionArray(i)[chunk_index.chunk_->ListIndex()] = global_system_version_;
+  return (BufferHeader*)((byte*)chunk_index.chunk_->Buffer() + archetype.offsets_[i]
+                         + archetype.sizes_[i] * chunk_index.index_);
+}
 
-  archetypes_.Create(64);
+// ---
 
-  archetype_allocator_.Create();
+void EntityManager::_SetComponentEnabled(Entity entity, ComponentTypeId type_id, bool enabled) {
+  i32 entity_index = ResolveEntity(this, entity);
+  if (entity_index == -1) {
+    return;
+  }
 
-  _SetCapacity(initial_capacity);
+  _EntityRecord chunk_index = _Record(entity_index);
 
-  query_map_.Create(MEM_ALLOC_HEAP, 0);
-  query_list_.Create(MEM_ALLOC_HEAP, 0);
+  Archetype& archetype = chunk_index.chunk_->Archetype();
 
-  // Setup built-in entity only archetype
+  const i32 i = archetype._TypeIndex(type_id);
+  const i32 k = i != -1 ? archetype.enableable_index_[i] : -1;
+  if (k == -1) {
+    assert(false && "archetype doesn't have enableable component type");
+    return;
+  }
 
-  entity_archetype_         = CreateArchetype({ nullptr, 0, 0 });
-  entity_archetype_->label_ = "Entity";
+  SetBit(archetype.chunk_data_.EnabledBits(k, chunk_index.chunk_->ListIndex()), chunk_index.index_, enabled);
+
+  archetype.chunk_data_.ChangeVersionArray(i)[chunk_index.chunk_->ListIndex()] = global_system_version_;
 }
 
-void EntityManager::Destroy() {
-  for (auto query : query_list_) {
-    query->Destroy();
+bool EntityManager::_IsComponentEnabled(Entity entity, ComponentTypeId type_id) {
+  i32 entity_index = ResolveEntity(this, entity);
+  if (entity_index == -1) {
+    return false;
   }
 
-  query_map_.Destroy();
-  query_list_.Destroy();
+  _EntityRecord chunk_index = _Record(entity_index);
 
-  // This is just the reverse of what the _SetCapacity function does
+  Archetype& archetype = chunk_index.chunk_->Archetype();
+
+  const i32 k = archetype._EnableableComponentIndex(type_id);
+  if (k == -1) {
+    return archetype._HasComponentType(type_id); // components that can't be turned off are always enabled
+  }
+
+  return GetBit(archetype.chunk_data_.EnabledBits(k, chunk_index.chunk_->ListIndex()), chunk_index.index_);
+}
+
+// ---
 
-  if (entity_chunk_index_by_entity_ != nullptr) {
-    MemFree(MEM_ALLOC_HEAP, entity_chunk_index_by_entity_);
-    entity_chunk_index_by_entity_ = nullptr;
+i32 EntityManager::_GetSharedComponentIndex(ComponentTypeId type_id, const void* data) {
+  const TypeInfo& type_info = world_->type_registry_->components_[type_id.Index()];
+  assert((type_info.flags_ & COMPONENT_FLAG_SHARED) && "not a shared component type");
+  return shared_components_.Intern(type_id, data, type_info.size_);
+}
+
+void EntityManager::_GetSharedComponentData(Entity entity, ComponentTypeId type_id, void* data) {
+  const i32 size = world_->type_registry_->components_[type_id.Index()].size_;
+
+  i32 entity_index = ResolveEntity(this, entity);
+  if (entity_index == -1) {
+    memset(data, 0, size_t(size));
+    return;
   }
 
-  if (archetype_by_entity_ != nullptr) {
-    MemFree(MEM_ALLOC_HEAP, archetype_by_entity_);
-    archetype_by_entity_ = nullptr;
+  _EntityRecord chunk_index = _Record(entity_index);
+
+  Archetype* archetype = chunk_index.chunk_->header_.archetype_;
+
+  const i32 k = archetype->_SharedComponentIndex(type_id);
+  if (k == -1) {
+    assert(false && "archetype doesn't have shared component type");
+    memset(data, 0, size_t(size));
+    return;
   }
 
-  if (version_by_entity_ != nullptr) {
-    MemFree(MEM_ALLOC_HEAP, version_by_entity_);
-    version_by_entity_ = nullptr;
+  const i32 value_index = archetype->chunk_data_.SharedValueArray(k)[chunk_index.chunk_->ListIndex()];
+
+  shared_components_.Get(type_id, value_index, data, size);
+}
+
+void EntityManager::_SetSharedComponentData(Entity entity, ComponentTypeId type_id, const void* data) {
+  i32 entity_index = ResolveEntity(this, entity);
+  if (entity_index == -1) {
+    return;
   }
 
-  // Destroy all archetypes before we destroy the archetype allocator
+  _EntityRecord chunk_index = _Record(entity_index);
 
-  for (auto archetype : archetypes_.list_) {
-    archetype->Destroy();
+  Archetype* archetype = chunk_index.chunk_->header_.archetype_;
+
+  const i32 k = archetype->_SharedComponentIndex(type_id);
+  if (k == -1) {
+    assert(false && "archetype doesn't have shared component type");
+    return;
   }
 
-  archetypes_.Destroy();
+  i32 shared_values[Archetype::SHARED_COMPONENT_MAX];
+  archetype->chunk_data_.GetSharedValues(chunk_index.chunk_->ListIndex(), shared_values);
 
-  archetype_allocator_.Destroy();
+  const i32 value_index = _GetSharedComponentIndex(type_id, data);
+  if (shared_values[k] == value_index) {
+    return;
+  }
 
-  world_ = nullptr;
+  shared_values[k] = value_index;
+
+  _MoveEntity(entity_index, archetype, shared_values);
 }
 
-Archetype* EntityManager::CreateArchetype(Slice<const ComponentTypeId> unsorted_types) {
-  auto sorted_types = MemStackalloc(ComponentTypeId, 0, unsorted_types.Len() + 1);
-  sorted_types      = Append(sorted_types, GetComponentTypeId<Entity>());
-  for (auto type : unsorted_types) {
-    sorted_types = Insert(sorted_types, type);
+void EntityManager::_SetSharedComponentData(EntityQuery* query, ComponentTypeId type_id, const void* data) {
+  const i32 value_index = _GetSharedComponentIndex(type_id, data);
+
+  for (auto archetype : query->matching_archetypes_) {
+    const i32 k = archetype->_SharedComponentIndex(type_id);
+    if (k == -1) {
+      continue;
+    }
+
+    // Relabeling a chunk is a write to the shared component and it changes which chunks the chunk caches filter in
+    i32* shared_values = archetype->chunk_data_.SharedValueArray(k);
+    for (i32 i = 0; i < archetype->chunk_data_.Len(); i++) {
+      if (query->_IsChunkMatch(archetype, i) && shared_values[i] != value_index) {
+        shared_values[i] = value_index;
+        _SetChunkChanged(archetype->chunk_data_.ChunkPtrArray()[i]);
+      }
+    }
   }
+}
 
-#if _DEBUG
-  for (int i = 1; i < sorted_types.len_; i++) {
-    assert(sorted_types[i - 1] < sorted_types[i]);
+// ---
+
+Archetype* EntityManager::_ArchetypeWithComponent(Archetype* archetype, ComponentTypeId type_id) {
+  ArchetypeEdge* edge = archetype->_GetEdge(type_id);
+  if (edge->add_ != nullptr) {
+    return edge->add_;
   }
-#endif
 
-  auto existing_archetype = archetypes_.TryGet(sorted_types.Const());
-  if (existing_archetype != nullptr) {
-    return existing_archetype;
+  Archetype* other = archetype;
+
+  if (!archetype->_HasComponentType(type_id)) {
+    // The entity type is implied, we don't pass it to CreateArchetype
+    auto types = MemStackalloc(ComponentTypeId, 0, archetype->types_len_);
+    for (i32 i = 1; i < archetype->types_len_; i++) {
+      types = Append(types, archetype->types_[i]);
+    }
+    types = Append(types, type_id);
+
+    other = CreateArchetype(types.Const());
+
+    other->_GetEdge(type_id)->remove_ = archetype;
   }
 
-  Archetype* new_archetype = archetype_allocator_.Allocate<Archetype>();
+  edge->add_ = other;
 
-  MemZeroInit(new_archetype);
+  return other;
+}
 
-  auto types   = archetype_allocator_.AllocateArray<ComponentTypeId>(sorted_types.Len());
-  auto sizes   = archetype_allocator_.AllocateArray<u16>(sorted_types.Len());
-  auto offsets = archetype_allocator_.AllocateArray<i32>(sorted_types.Len());
+Archetype* EntityManager::_ArchetypeWithoutComponent(Archetype* archetype, ComponentTypeId type_id) {
+  assert(!(type_id == GetComponentTypeId<Entity>()) && "the entity component type cannot be removed");
 
-  new_archetype->types_     = MemCopyArray(types, sorted_types.ptr_, sorted_types.ByteLen());
-  new_archetype->types_len_ = sorted_types.Len();
+  ArchetypeEdge* edge = archetype->_GetEdge(type_id);
+  if (edge->remove_ != nullptr) {
+    return edge->remove_;
+  }
 
-  for (int i = 0; i < sorted_types.len_; i++) {
-    const TypeInfo* type_info = world_->type_registry_->GetComponentTypeInfo(sorted_types[i]);
+  Archetype* other = archetype;
+
+  if (archetype->_HasComponentType(type_id)) {
+    auto types = MemStackalloc(ComponentTypeId, 0, archetype->types_len_);
+    for (i32 i = 1; i < archetype->types_len_; i++) {
+      if (!(archetype->types_[i] == type_id)) {
+        types = Append(types, archetype->types_[i]);
+      }
+    }
+
+    other = CreateArchetype(types.Const());
 
-    sizes[i] = type_info->size_;
+    other->_GetEdge(type_id)->add_ = archetype;
   }
 
-  new_archetype->sizes_ = sizes;
+  edge->remove_ = other;
 
-  // ---
+  return other;
+}
 
-  i32 max_chunk_entity_capacity = CHUNK_BUFFER_SIZE / i32(sizeof(Entity));
+void EntityManager::_RemoveChunkEntity(Chunk* chunk, i32 index) {
+  Archetype* archetype = chunk->header_.archetype_;
 
-  auto GetComponentArraySize = [](i32 component_size, i32 entity_count) -> i32 {
-    return MemAlign(component_size * entity_count, MEM_CACHE_LINE_SIZE);
-  };
+  const i32 len  = chunk->EntityCount();
+  const i32 last = len - 1;
 
-  auto CalculateSpaceRequirement =
-      [GetComponentArraySize](uint16_t* component_sizes, i32 component_count, i32 entity_count) -> i32 {
-    i32 size = 0;
-    for (i32 i = 0; i < component_count; i++) {
-      size += GetComponentArraySize(component_sizes[i], entity_count);
-    }
-    return size;
-  };
+  // Move the last entity into the hole, then clear what's left behind
+  for (i32 i = 0; i < archetype->types_len_; i++) {
+    const i32 size  = archetype->sizes_[i];
+    byte*     array = (byte*)chunk->Buffer() + archetype->offsets_[i];
 
-  auto CalculateChunkCapacity = [CalculateSpaceRequirement](uint16_t* component_sizes, i32 count) -> i32 {
-    i32 total_size = 0;
-    for (i32 i = 0; i < count; i++) {
-      total_size += component_sizes[i];
-    }
-    // guess
-    i32 capacity = CHUNK_BUFFER_SIZE / total_size;
-    // adjust
-    while (!(CalculateSpaceRequirement(component_sizes, count, capacity) < CHUNK_BUFFER_SIZE)) {
-      capacity--;
+    if (index < last) {
+      memcpy(array + index * size, array + last * size, size_t(size));
     }
-    return capacity;
-  };
+    memset(array + last * size, 0, size_t(size));
+  }
 
-  new_archetype->chunk_entity_capacity_ =
-      Min(CalculateChunkCapacity(sizes, sorted_types.Len()), max_chunk_entity_capacity);
+  if (index < last) {
+    _Record(chunk->EntityArray()[index].index_).index_ = index;
+    CopyEnabledBits(archetype, chunk->ListIndex(), index, archetype, chunk->ListIndex(), last, 1);
+  }
+  SetEnabledBits(archetype, chunk->ListIndex(), last, len, false);
 
-  assert(
-      (0 < new_archetype->chunk_entity_capacity_)
-      & (new_archetype->chunk_entity_capacity_ <= max_chunk_entity_capacity));
+  chunk->header_.len_ = last;
 
-  int used_bytes = 0; // relative chunk buffer
+  archetype->entity_count_--;
 
-  for (int i = 0; i < sorted_types.Len(); i++) {
-    const TypeInfo* type_info = world_->type_registry_->GetComponentTypeInfo(sorted_types[i]);
+  if (last == 0) {
+    _FreeChunk(chunk);
+    return;
+  }
+
+  archetype->chunk_data_.EntityCountArray()[chunk->ListIndex()] = last;
 
-    offsets[i] = used_bytes;
+  _SetChunkChanged(chunk);
 
-    used_bytes += MemAlign(type_info->size_ * new_archetype->chunk_entity_capacity_, MEM_CACHE_LINE_SIZE);
+  if (len == chunk->EntityCapacity()) {
+    archetype->_AddChunkWithEmptySlots(chunk); // This chunk was full but now it has space
   }
+}
 
-  new_archetype->offsets_ = offsets;
+void EntityManager::_MoveEntity(i32 entity_index, Archetype* archetype, const i32* shared_values) {
+  _EntityRecord* chunk_index = &_Record(entity_index);
+
+  Chunk*     src_chunk     = chunk_index->chunk_;
+  const i32  src_index     = chunk_index->index_;
+  Archetype* src_archetype = src_chunk->header_.archetype_;
+
+  Chunk*    dst_chunk = _ChunkWithEmptySlots(archetype, shared_values);
+  const i32 dst_index = dst_chunk->EntityCount();
+
+  // Both type lists are sorted, copy the component data that the archetypes have in common. The rest of the
+  // destination row is already zero.
+  for (i32 i = 0, j = 0; i < src_archetype->types_len_ && j < archetype->types_len_;) {
+    if (src_archetype->types_[i] == archetype->types_[j]) {
+      const i32 size = archetype->sizes_[j];
+      memcpy((byte*)dst_chunk->Buffer() + archetype->offsets_[j] + dst_index * size,
+             (byte*)src_chunk->Buffer() + src_archetype->offsets_[i] + src_index * size,
+             size_t(size));
+      i++;
+      j++;
+    } else if (src_archetype->types_[i] < archetype->types_[j]) {
+      i++;
+    } else {
+      j++;
+    }
+  }
 
-  new_archetype->chunk_with_empty_slots_ = List<Chunk*>::WithAllocator(MEM_ALLOC_HEAP);
+  CopyEnabledBits(archetype, dst_chunk->ListIndex(), dst_index, src_archetype, src_chunk->ListIndex(), src_index, 1);
 
-  new_archetype->matching_queries_ = List<EntityQuery*>::WithAllocator(MEM_ALLOC_HEAP);
+  dst_chunk->AddEntityCount(1);
 
-  // ---
+  archetype->chunk_data_.EntityCountArray()[dst_chunk->ListIndex()] = dst_chunk->EntityCount();
 
-  archetypes_.Add(new_archetype);
+  _SetChunkChanged(dst_chunk);
 
-  return new_archetype;
+  if (dst_chunk->EntityCount() == dst_chunk->EntityCapacity()) {
+    archetype->_RemoveChunkWithEmptySlots(dst_chunk);
+  }
+
+  archetype->entity_count_++;
+
+  _ReleaseBuffers(src_chunk, src_index, src_index + 1, archetype);
+
+  _RemoveChunkEntity(src_chunk, src_index);
+
+  chunk_index->chunk_ = dst_chunk;
+  chunk_index->index_ = dst_index;
 }
 
-void EntityManager::CreateEntities(Archetype* archetype, Entity* entities, i32 count) {
-  // ...
+namespace {
+// Map the shared values of a chunk to the shared component types of another archetype. Shared component types that the
+// chunk doesn't have get the zero value.
+void MapSharedValues(Chunk* chunk, const Archetype* archetype, i32* shared_values) {
+  const Archetype* src = chunk->header_.archetype_;
+  for (i32 i = 0; i < archetype->shared_types_len_; i++) {
+    const i32 k      = src->_SharedComponentIndex(archetype->shared_types_[i]);
+    shared_values[i] = k != -1 ? src->chunk_data_.SharedValueArray(k)[chunk->ListIndex()] : 0;
+  }
+}
+} // namespace
 
-  for (; 0 < count;) {
-    // make entities
-    Chunk* chunk;
+void EntityManager::AddComponent(Entity entity, ComponentTypeId type_id) {
+  i32 entity_index = ResolveEntity(this, entity);
+  if (entity_index == -1) {
+    return;
+  }
 
-    if (0 < archetype->chunk_with_empty_slots_.Len()) {
-      chunk = archetype->chunk_with_empty_slots_[0];
+  Chunk*     chunk     = _Record(entity_index).chunk_;
+  Archetype* archetype = chunk->header_.archetype_;
+  Archetype* other     = _ArchetypeWithComponent(archetype, type_id);
+  if (other != archetype) {
+    i32 shared_values[Archetype::SHARED_COMPONENT_MAX];
+    MapSharedValues(chunk, other, shared_values);
+    _MoveEntity(entity_index, other, shared_values);
+  }
+}
+
+void EntityManager::RemoveComponent(Entity entity, ComponentTypeId type_id) {
+  i32 entity_index = ResolveEntity(this, entity);
+  if (entity_index == -1) {
+    return;
+  }
+
+  Chunk*     chunk     = _Record(entity_index).chunk_;
+  Archetype* archetype = chunk->header_.archetype_;
+  Archetype* other     = _ArchetypeWithoutComponent(archetype, type_id);
+  if (other != archetype) {
+    i32 shared_values[Archetype::SHARED_COMPONENT_MAX];
+    MapSharedValues(chunk, other, shared_values);
+    _MoveEntity(entity_index, other, shared_values);
+  }
+}
+
+namespace {
+// A component array that is relocated when a chunk changes archetype
+struct ColumnMove {
+  i32 src_offset_;
+  i32 dst_offset_;
+  i32 size_;
+};
+
+// Find the component arrays that both archetypes have and sort them by their offset in the source archetype. Returns
+// false if the arrays don't have the same order in both archetypes, i.e. the arrays cannot be moved in place.
+bool FindColumnMoves(const Archetype* src, const Archetype* dst, Slice<ColumnMove>* moves) {
+  for (i32 i = 0, j = 0; i < src->types_len_ && j < dst->types_len_;) {
+    if (src->types_[i] == dst->types_[j] && src->sizes_[i] == 0) {
+      i++; // tag components have nothing to move
+      j++;
+    } else if (src->types_[i] == dst->types_[j]) {
+      ColumnMove move = { src->offsets_[i], dst->offsets_[j], src->sizes_[i] };
+
+      i32 k = moves->len_++;
+      for (; 0 < k && move.src_offset_ < (*moves)[k - 1].src_offset_; k--) {
+        (*moves)[k] = (*moves)[k - 1];
+      }
+      (*moves)[k] = move;
+
+      i++;
+      j++;
+    } else if (src->types_[i] < dst->types_[j]) {
+      i++;
     } else {
-      chunk = nullptr;
+      j++;
+    }
+  }
+
+  for (i32 i = 1; i < moves->Len(); i++) {
+    if (!((*moves)[i - 1].dst_offset_ < (*moves)[i].dst_offset_)) {
+      return false;
     }
+  }
+  return true;
+}
+
+// Change the archetype of a chunk without moving its entities to another chunk. The component arrays are moved within
+// the chunk.
+void RetagChunk(
+    Chunk* chunk, Archetype* archetype, Slice<const ColumnMove> moves, const i32* shared_values, u32 change_version) {
+  Archetype* src_archetype = chunk->header_.archetype_;
 
-    if (chunk == nullptr) {
-      // todo: All assignments/initialization of chunk header should stay in scope here and not be spread out over multiple functions
+  const i32 len = chunk->EntityCount();
 
-      chunk                     = world_->chunk_allocator_->Allocate();
-      chunk->header_.archetype_ = archetype;
-      chunk->header_.len_       = 0;
-      chunk->header_.cap_       = archetype->chunk_entity_capacity_;
-      archetype->chunk_data_.Add(chunk, 42); // todo: change version
+  assert(chunk->header_.archetype_->chunk_size_class_ == archetype->chunk_size_class_);
+  assert(len <= archetype->chunk_entity_capacity_);
 
-      chunk->header_.free_list_index_ = archetype->chunk_with_empty_slots_.Len();
-      archetype->chunk_with_empty_slots_.Add(chunk);
+  // The arrays have the same order in both layouts. Arrays that move towards the beginning of the chunk are moved
+  // first, front to back, then arrays that move towards the end, back to front. This way no array is overwritten before
+  // it has been moved.
+  byte* buffer = (byte*)chunk->Buffer();
+  for (i32 i = 0; i < moves.Len(); i++) {
+    if (moves[i].dst_offset_ < moves[i].src_offset_) {
+      memmove(buffer + moves[i].dst_offset_, buffer + moves[i].src_offset_, size_t(len * moves[i].size_));
     }
+  }
+  for (i32 i = moves.Len() - 1; 0 <= i; i--) {
+    if (moves[i].src_offset_ < moves[i].dst_offset_) {
+      memmove(buffer + moves[i].dst_offset_, buffer + moves[i].src_offset_, size_t(len * moves[i].size_));
+    }
+  }
 
-    assert(chunk->EntityCount() < chunk->EntityCapacity());
+  // Whatever is left of the old arrays must not show up as component data
+  for (i32 i = 0; i < archetype->types_len_; i++) {
+    const i32 size  = archetype->sizes_[i];
+    byte*     array = buffer + archetype->offsets_[i];
+    if (src_archetype->_HasComponentType(archetype->types_[i])) {
+      memset(array + len * size, 0, size_t((archetype->chunk_entity_capacity_ - len) * size));
+    } else {
+      memset(array, 0, size_t(archetype->chunk_entity_capacity_ * size));
+    }
+  }
 
-    Entity* chunk_entities_end = chunk->EntityArray() + chunk->EntityCount();
+  // Chunk components start over, the chunk is marked as changed so that whatever keeps them up to date will run
+  memset(buffer + archetype->chunk_components_offset_, 0, size_t(archetype->chunk_components_size_));
 
-    const i32 n = Min(count, chunk->EntityCapacity() - chunk->EntityCount());
+  if (chunk->FreeListIndex() != -1) {
+    src_archetype->_RemoveChunkWithEmptySlots(chunk);
+  }
+  src_archetype->entity_count_ -= len;
 
-    for (i32 i = 0; i < n; i++) {
-      Entity* entity = chunk_entities_end + i;
+  // The chunk is added to the archetype before it is removed from the source archetype so that the enabled bits can be
+  // copied over
+  const i32 src_chunk_index = chunk->ListIndex();
 
-      // Initially entities are created as an ascending sequence of indexes
-      // but when entities are destroyed it will create holes and instead of
-      // "compacting" the array we move the last index into the hole to be
-      // reused
+  chunk->header_.archetype_ = archetype;
+  chunk->header_.cap_       = archetype->chunk_entity_capacity_;
+  archetype->chunk_data_.Add(chunk, change_version, shared_values);
 
-      // the purpose of this is two fold, we don't create more indexes than we need
-      // and we try to fill holes as soon as possible
+  CopyEnabledBits(archetype, chunk->ListIndex(), 0, src_archetype, src_chunk_index, 0, len);
 
-      const i32 entity_index = next_free_entity_index_;
+  src_archetype->chunk_data_.RemoveAtSwapBack(src_chunk_index);
 
-      i32 next_free_entity_index = entity_chunk_index_by_entity_[entity_index].index_;
-      if (next_free_entity_index == -1) {
-        _SetCapacity(2 * entity_capacity_);
-        next_free_entity_index = entity_chunk_index_by_entity_[entity_index].index_;
-      }
-      next_free_entity_index_ = next_free_entity_index;
+  if (len < chunk->EntityCapacity()) {
+    archetype->_AddChunkWithEmptySlots(chunk);
+  }
+  archetype->entity_count_ += len;
+}
+} // namespace
 
-      // ---
+void EntityManager::_MoveChunk(Chunk* chunk, Archetype* dst) {
+  Archetype* src = chunk->header_.archetype_;
 
-      u32 version = version_by_entity_[entity_index];
+  auto moves = MemStackalloc(ColumnMove, 0, src->types_len_);
+  bool retag = FindColumnMoves(src, dst, &moves) && src->chunk_size_class_ == dst->chunk_size_class_;
 
-      entity->index_   = entity_index;
-      entity->version_ = version;
+  i32 shared_values[Archetype::SHARED_COMPONENT_MAX];
+  MapSharedValues(chunk, dst, shared_values);
 
-      _ChunkEntityIndex* entity_chunk_index = entity_chunk_index_by_entity_ + entity_index;
-      entity_chunk_index->chunk_            = chunk;
-      entity_chunk_index->index_            = chunk->EntityCount() + i;
+  // Entities that won't fit in the chunk once it has been re-tagged are moved to other chunks
+  const i32 keep = retag ? Min(chunk->EntityCount(), dst->chunk_entity_capacity_) : 0;
 
-      entity_create_destroy_version_++;
+  while (keep < chunk->EntityCount()) {
+    Chunk*    dst_chunk = _ChunkWithEmptySlots(dst, shared_values);
+    const i32 n         = Min(chunk->EntityCount() - keep, dst_chunk->EntityCapacity() - dst_chunk->EntityCount());
 
-      // optional
-      if (entities != nullptr) {
-        entities->index_   = entity_index;
-        entities->version_ = version;
-        entities++;
-      }
+    _MoveChunkTail(dst_chunk, chunk, n);
+
+    if (dst_chunk->EntityCount() == dst_chunk->EntityCapacity()) {
+      dst->_RemoveChunkWithEmptySlots(dst_chunk);
     }
+  }
 
-    chunk->AddEntityCount(n);
+  if (0 < keep) {
+    _ReleaseBuffers(chunk, 0, keep, dst);
+    RetagChunk(chunk, dst, moves.Const(), shared_values, global_system_version_);
+    structural_change_version_++;
+  } else {
+    _FreeChunk(chunk);
+  }
+}
 
-    if (chunk->EntityCount() == chunk->EntityCapacity()) {
-      // This chunk has now been filled up. We must therefore remove it from the "chunks with space" list
+void EntityManager::_MoveChunks(Archetype* src, Archetype* dst, const EntityQuery* filter) {
+  if (src == dst) {
+    return;
+  }
 
-      archetype->chunk_with_empty_slots_.RemoveAtSwapBack(chunk->header_.free_list_index_);
+  // Chunks are removed from the source archetype by moving the last chunk into their place, going back to front we
+  // only ever move chunks that we have already seen
+  for (i32 i = src->chunk_data_.Len() - 1; 0 <= i; i--) {
+    if ((filter != nullptr) && !filter->_IsChunkMatch(src, i)) {
+      continue;
     }
 
-    archetype->entity_count_ += n;
+    _MoveChunk(src->chunk_data_.ChunkPtrArray()[i], dst);
+  }
+}
 
-    count -= n;
+namespace {
+// Call f(index) for the next count bits that are set, starting at index begin. Returns the index after the last one.
+template <typename F> i32 ForEachSetBit(const u64* bits, i32 begin, i32 count, F f) {
+  i32 w    = begin / 64;
+  u64 word = bits[w] & (~0ULL << (begin & 63));
+  i32 end  = begin;
+  for (; 0 < count; count--) {
+    while (word == 0) {
+      word = bits[++w];
+    }
+    end = w * 64 + i32(tzcnt_u64(word));
+    f(end++);
+    word &= word - 1;
   }
+  return end;
 }
+} // namespace
 
-_ChunkEntitySlice EntityManager::_FindFirstEntityRange(Entity* entities, i32 count) {
-  assert(0 < count);
+void EntityManager::_MoveSelectedEntities(Chunk* chunk, const u64* selected, i32 count, Archetype* dst) {
+  Archetype* src = chunk->header_.archetype_;
 
-  // Look for continuous ranges of entities from the same chunk (this operation is order dependant)
+  const i32 len = chunk->EntityCount();
 
-  const u32*         versions       = version_by_entity_;
-  _ChunkEntityIndex* chunk_indicies = entity_chunk_index_by_entity_;
+  assert(0 < count && count < len);
 
-  // ---
+  i32 shared_values[Archetype::SHARED_COMPONENT_MAX];
+  MapSharedValues(chunk, dst, shared_values);
 
-  i32                base_entity_index = entities[0].index_;
-  _ChunkEntityIndex* base_chunk_index  = chunk_indicies + base_entity_index;
-  Chunk* const base_chunk = versions[base_entity_index] == entities[0].version_ ? base_chunk_index->chunk_ : nullptr;
-  i32 const    base_chunk_entity_index = base_chunk_index->index_;
+  if (0 < src->buffer_types_len_) {
+    ForEachSetBit(selected, 0, count, [this, chunk, dst](i32 index) { _ReleaseBuffers(chunk, index, index + 1, dst); });
+  }
 
-  i32 chunk_entity_count = 0;
-  for (; chunk_entity_count < count; chunk_entity_count++) {
-    const Entity* entity         = entities + chunk_entity_count; // handle to destroy
-    const i32     entity_index   = entity->index_;
-    const u32     entity_version = entity->version_;
+  // The selected entities are appended to chunks of the destination archetype, one component array at a time. Both
+  // type lists are sorted, component types that only the destination has are left zeroed.
+  i32 begin = 0;
+  for (i32 moved = 0; moved < count;) {
+    Chunk*    dst_chunk = _ChunkWithEmptySlots(dst, shared_values);
+    const i32 dst_len   = dst_chunk->EntityCount();
+    const i32 n         = Min(count - moved, dst_chunk->EntityCapacity() - dst_len);
+
+    i32 end = begin;
+    for (i32 i = 0, j = 0; i < src->types_len_; i++) {
+      while (j < dst->types_len_ && dst->types_[j] < src->types_[i]) {
+        j++;
+      }
+      if (!(j < dst->types_len_ && dst->types_[j] == src->types_[i])) {
+        continue;
+      }
 
-    _ChunkEntityIndex* chunk_index        = chunk_indicies + entity_index;
-    Chunk* const       chunk              = chunk_index->chunk_;
-    i32                chunk_entity_index = chunk_index->index_; // index of entity in chunk
+      const i32 size      = src->sizes_[i];
+      byte*     src_array = (byte*)chunk->Buffer() + src->offsets_[i];
+      byte*     dst_array = (byte*)dst_chunk->Buffer() + dst->offsets_[j] + dst_len * size;
 
-    if (versions[entity_index] == entity_version) {
-      // Entity handle is still valid
-      if (!(base_chunk == chunk)) {
-        break;
-      }
-      // why would the indicies not match here? and if they don't why is that not an error?
-    } else {
-      // Version mismatch!
+      end = ForEachSetBit(selected, begin, n, [&dst_array, src_array, size](i32 index) {
+        memcpy(dst_array, src_array + index * size, size_t(size));
+        dst_array += size;
+      });
+    }
 
-      // This part is confusing; if we're in the process of destroying this entity the chunk should be non-null
-      // If we already destroyed the entity then the chunk will be null and then we continue?
+    // The entity array was one of the arrays, the moved entities are found at their new location
+    Entity* dst_entities = dst_chunk->EntityArray();
+    for (i32 index = begin, dst_index = dst_len; index < end; index++) {
+      if (GetBit(selected, index)) {
+        CopyEnabledBits(dst, dst_chunk->ListIndex(), dst_index, src, chunk->ListIndex(), index, 1);
 
-      // If the chunk is non-null then the entity has been reused; or something like that? moved to a different chunk?
+        _EntityRecord* record = &_Record(dst_entities[dst_index].index_);
+        record->chunk_        = dst_chunk;
+        record->index_        = dst_index;
 
-      if (chunk == nullptr) {
-        continue; // if the chunk is null; it means that we've already destroyed this entity
-      } else {
-        break;
+        dst_index++;
       }
     }
+
+    dst_chunk->header_.len_ = dst_len + n;
+
+    dst->chunk_data_.EntityCountArray()[dst_chunk->ListIndex()] = dst_len + n;
+
+    _SetChunkChanged(dst_chunk);
+
+    if (dst_chunk->EntityCount() == dst_chunk->EntityCapacity()) {
+      dst->_RemoveChunkWithEmptySlots(dst_chunk);
+    }
+
+    dst->entity_count_ += n;
+
+    begin = end;
+    moved += n;
+  }
+
+  // The entities that moved out left holes, the chunk is compacted once
+  const i32 new_len = len - count;
+
+  _CompactChunk(chunk, selected, count);
+
+  chunk->header_.len_ = new_len;
+
+  src->chunk_data_.EntityCountArray()[chunk->ListIndex()] = new_len;
+
+  if (len == chunk->EntityCapacity()) {
+    src->_AddChunkWithEmptySlots(chunk); // This chunk was full but now it has space
   }
 
-  return { base_chunk, base_chunk_entity_index, chunk_entity_count };
+  src->entity_count_ -= count;
 }
 
-void EntityManager::DestroyEntities(Entity* entities, i32 count) {
-  u32*               versions       = version_by_entity_;
-  _ChunkEntityIndex* chunk_indicies = entity_chunk_index_by_entity_;
+void EntityManager::_MoveEntities(const Entity* entities, i32 count, ComponentTypeId type_id, bool add) {
+  selected_chunks_.Resize(0);
+  selected_bits_.Resize(0);
 
-  i32 i = 0;
-  for (; i < count;) {
-    _ChunkEntitySlice s = _FindFirstEntityRange(entities + i, count - i);
+  for (i32 i = 0; i < count; i++) {
+    const i32 entity_index = ResolveEntity(this, entities[i]);
+    if (entity_index != -1) {
+      _EntityRecord* record = &_Record(entity_index);
+      _SelectEntity(record->chunk_, record->index_);
+    }
+  }
 
+  // A chunk can only take entities from chunks of another archetype. Moving entities into a selected chunk doesn't
+  // affect its selection, the archetype of the chunk already is what the selected entities would be moved to.
+  for (const _SelectedChunk& s : selected_chunks_) {
     Chunk*     chunk     = s.chunk_;
     Archetype* archetype = chunk->header_.archetype_;
 
-    i32     free_index     = next_free_entity_index_;
-    Entity* chunk_entities = chunk->EntityArray() + s.index_;
+    chunk->header_.select_slot_ = -1;
 
-    // Why are we going backwards through the range?
-    for (i32 j = s.count_ - 1; j >= 0; j--) {
-      i32 entity_index = chunk_entities[j].index_;
+    Archetype* other =
+        add ? _ArchetypeWithComponent(archetype, type_id) : _ArchetypeWithoutComponent(archetype, type_id);
+    if (other == archetype) {
+      continue;
+    }
 
-      versions[entity_index]++;
+    if (s.count_ == chunk->EntityCount()) {
+      _MoveChunk(chunk, other);
+    } else {
+      _MoveSelectedEntities(chunk, selected_bits_.ptr_ + s.bits_, s.count_, other);
+    }
+  }
+}
 
-      _ChunkEntityIndex* chunk_index = chunk_indicies + entity_index;
-      chunk_index->chunk_            = nullptr;
-      chunk_index->index_            = free_index;
+void EntityManager::AddComponent(const Entity* entities, i32 count, ComponentTypeId type_id) {
+  _MoveEntities(entities, count, type_id, true);
+}
 
-      free_index = entity_index;
-    }
+void EntityManager::RemoveComponent(const Entity* entities, i32 count, ComponentTypeId type_id) {
+  _MoveEntities(entities, count, type_id, false);
+}
 
-    next_free_entity_index_ = free_index;
-    entity_create_destroy_version_++;
+void EntityManager::AddComponent(EntityQuery* query, ComponentTypeId type_id) {
+  // Archetypes that we create here can end up in the list, they already have the component type
+  const i32 archetype_count = query->matching_archetypes_.Len();
+  for (i32 i = 0; i < archetype_count; i++) {
+    Archetype* archetype = query->matching_archetypes_[i];
+    _MoveChunks(archetype, _ArchetypeWithComponent(archetype, type_id), query);
+  }
+}
 
-    archetype->entity_count_ -= s.count_;
-    i += s.count_;
+void EntityManager::RemoveComponent(EntityQuery* query, ComponentTypeId type_id) {
+  const i32 archetype_count = query->matching_archetypes_.Len();
+  for (i32 i = 0; i < archetype_count; i++) {
+    Archetype* archetype = query->matching_archetypes_[i];
+    _MoveChunks(archetype, _ArchetypeWithoutComponent(archetype, type_id), query);
   }
 }
 
-// ---
+void EntityManager::DestroyEntities(EntityQuery* query) {
+  for (auto archetype : query->matching_archetypes_) {
+    // Back to front, see _MoveChunks
+    for (i32 c = archetype->chunk_data_.Len() - 1; 0 <= c; c--) {
+      if (!query->_IsChunkMatch(archetype, c)) {
+        continue;
+      }
 
-// Resolve entity. If the entity is valid the return value is the entity index otherwise invalid index value (-1)
-i32 ResolveEntity(EntityManager* m, Entity entity) {
-  return m->version_by_entity_[entity.index_] == entity.version_ ? entity.index_ : -1;
-}
+      Chunk* chunk = archetype->chunk_data_.ChunkPtrArray()[c];
 
-void EntityManager::_SetComponentData(Entity entity, ComponentTypeId type_id, const void* data) {
-  i32 entity_index = ResolveEntity(this, entity);
-  if (entity_index == -1) {
-    return; // this is not an error but we might want to log this in debug?
-  }
+      // Every entity in the chunk goes, there is nothing to compact
+      Entity*   chunk_entities = chunk->EntityArray();
+      const i32 len            = chunk->EntityCount();
+      i32       free_index     = next_free_entity_index_;
+      for (i32 i = 0; i < len; i++) {
+        const i32 entity_index = chunk_entities[i].index_;
 
-  _ChunkEntityIndex chunk_index = entity_chunk_index_by_entity_[entity_index];
+        _EntityRecord& record = _Record(entity_index);
 
-  Archetype& archetype = chunk_index.chunk_->Archetype();
+        record.version_++;
+        record.chunk_ = nullptr;
+        record.index_ = free_index;
+
+        free_index = entity_index;
+      }
+      next_free_entity_index_ = free_index;
 
-  SystemChunk system_chunk = { chunk_index.chunk_,
-                               chunk_index.index_,
-                               chunk_index.chunk_->EntityCount() - chunk_index.index_ };
+      _ReleaseBuffers(chunk, 0, len, nullptr);
 
-  void* dst = system_chunk._GetArray(type_id);
-  if (dst == nullptr) {
-    assert(
-        false
-        && "archetype doesn't have component type"); // crash or structural change? (need to use something else than assert here)
+      chunk->header_.len_ = 0;
+      _FreeChunk(chunk);
+
+      archetype->entity_count_ -= len;
+      entity_count_ -= len;
+    }
   }
 
-  memcpy(dst, data, world_->type_registry_->components_[type_id.Index()].size_);
+  entity_create_destroy_version_++;
 }
 
 // ---
 
 void EntityManager::_SetCapacity(i32 new_capacity) {
   auto old_capacity = entity_capacity_;
-  if (new_capacity < old_capacity) {
+  if (new_capacity <= old_capacity) {
     return; // We can never shrink since entity lookups can fail if we do
   }
 
   // Just the overhead from bookkeeping this many entities require gigabytes of memory
-  assert(new_capacity < 128 * 1024 * 1024);
+  assert(new_capacity <= ENTITY_PAGE_MAX * ENTITY_PAGE_SIZE);
 
-  version_by_entity_   = MemResizeArray(MEM_ALLOC_HEAP, version_by_entity_, old_capacity, new_capacity);
-  archetype_by_entity_ = MemResizeArray(MEM_ALLOC_HEAP, archetype_by_entity_, old_capacity, new_capacity);
-  entity_chunk_index_by_entity_ =
-      MemResizeArray(MEM_ALLOC_HEAP, entity_chunk_index_by_entity_, old_capacity, new_capacity);
+  if (entity_pages_ == nullptr) {
+    entity_pages_ = MemAllocArray<_EntityRecord*>(MEM_ALLOC_HEAP, ENTITY_PAGE_MAX);
+  }
 
-  // Initialize additional capacity
+  new_capacity = i32(MemAlign(size_t(Max(new_capacity, 1)), ENTITY_PAGE_SIZE));
 
-  for (i32 i = 0 < old_capacity ? old_capacity - 1 : 0; i < new_capacity; i++) {
-    version_by_entity_[i] = 1;
+  // Records that exist don't move, the new records go in new pages. While the chunk is null the record stores the index
+  // of the next entity to allocate. We do this because we're going to create holes later and when we do that the next
+  // entity to allocate doesn't have to be continuous.
 
-    // While the chunk is null, store the index of the next entity to allocate
-    // We do this because we're going to create holes later and when we do that
-    // the next entity to allocate doesn't have to be continuous
+  for (i32 p = old_capacity / ENTITY_PAGE_SIZE; p < new_capacity / ENTITY_PAGE_SIZE; p++) {
+    _EntityRecord* page = MemAllocArray<_EntityRecord>(MEM_ALLOC_HEAP, ENTITY_PAGE_SIZE);
+    for (i32 i = 0; i < ENTITY_PAGE_SIZE; i++) {
+      page[i] = { nullptr, p * ENTITY_PAGE_SIZE + i + 1, 1 };
+    }
+    entity_pages_[p] = page;
+  }
 
-    auto entity_in_chunk    = entity_chunk_index_by_entity_ + i;
-    entity_in_chunk->chunk_ = nullptr;
-    entity_in_chunk->index_ = i + 1;
+  // The old cork now points at the first new record
+  if (0 < old_capacity) {
+    _Record(old_capacity - 1).index_ = old_capacity;
   }
 
-  auto last_entity_in_chunk    = &entity_chunk_index_by_entity_[new_capacity - 1];
-  last_entity_in_chunk->index_ = -1; // Cork
+  _Record(new_capacity - 1).index_ = -1; // Cork
+
+  entity_capacity_ = new_capacity;
 }
 
-EntityQuery* EntityManager::CreateQuery(const ComponentDataAccess* query_desc, i32 query_desc_len) {
+EntityQuery* EntityManager::_CreateQuery(const ComponentDataAccess* query_desc,
+                                         i32                        query_desc_len,
+                                         ComponentTypeId            shared_filter_type,
+                                         i32                        shared_filter_value) {
   // Queries are pooled. We don't expect to find a lot of unique queries
 
   auto sorted = MemStackalloc(ComponentDataAccess, 0, query_desc_len);
@@ -448,6 +1768,9 @@ EntityQuery* EntityManager::CreateQuery(const ComponentDataAccess* query_desc, i
   tmp_query.none_access_mode_ = none_access_mode.ptr_;
   tmp_query.none_len_         = none.Len();
 
+  tmp_query.shared_filter_type_  = shared_filter_type;
+  tmp_query.shared_filter_value_ = shared_filter_value;
+
   u32 query_hash = tmp_query.HashCode();
 
   for (auto m : query_map_.Scan(query_hash)) {
@@ -486,21 +1809,115 @@ EntityQuery* EntityManager::CreateQuery(const ComponentDataAccess* query_desc, i
   MemCopyArray(new_query->none_, tmp_query.none_, tmp_query.none_len_);
   MemCopyArray(new_query->none_access_mode_, tmp_query.none_access_mode_, tmp_query.none_len_);
 
+  for (auto component : sorted) {
+    if (component.ChangeFilter()) {
+      new_query->_AddChangeFilter(component.type_id_);
+    }
+  }
+
+  new_query->shared_filter_type_  = shared_filter_type;
+  new_query->shared_filter_value_ = shared_filter_value;
+
+  new_query->all_enableable_ = archetype_allocator_.AllocateArray<ComponentTypeId>(tmp_query.all_len_);
+  for (i32 i = 0; i < tmp_query.all_len_; i++) {
+    if (world_->type_registry_->components_[tmp_query.all_[i].Index()].flags_ & COMPONENT_FLAG_ENABLEABLE) {
+      new_query->all_enableable_[new_query->all_enableable_len_++] = tmp_query.all_[i];
+    }
+  }
+
   assert(query_mask_count_ < EntityQueryMask::MAX_CAPACITY);
   new_query->mask_ = { uint8_t(query_mask_count_ / 8), uint8_t(query_mask_count_ % 8), this };
   query_mask_count_++;
 
-  new_query->matching_archetypes_ = List<Archetype*>::WithAllocator(MEM_ALLOC_HEAP);
+  new_query->entity_manager_ = this;
+
+  // The column of each component type, all_ first so that a type that is in both all_ and any_ is found in all_
+  const i32 registry_len = world_->type_registry_->components_.Len();
+
+  new_query->column_by_type_ = archetype_allocator_.AllocateArray<i16>(registry_len);
+  for (i32 i = 0; i < registry_len; i++) {
+    new_query->column_by_type_[i] = -1;
+  }
+  for (i32 c = new_query->_ColumnCount() - 1; 0 <= c; c--) {
+    new_query->column_by_type_[new_query->_ColumnType(c).Index()] = i16(c);
+  }
+  new_query->column_by_type_len_ = registry_len;
+
+  const i32 mask_words = world_->type_registry_->TypeMaskWords();
+
+  new_query->all_type_mask_   = archetype_allocator_.AllocateArray<u64>(mask_words);
+  new_query->any_type_mask_   = archetype_allocator_.AllocateArray<u64>(mask_words);
+  new_query->none_type_mask_  = archetype_allocator_.AllocateArray<u64>(mask_words);
+  new_query->type_mask_words_ = mask_words;
+  memset(new_query->all_type_mask_, 0, sizeof(u64) * size_t(mask_words));
+  memset(new_query->any_type_mask_, 0, sizeof(u64) * size_t(mask_words));
+  memset(new_query->none_type_mask_, 0, sizeof(u64) * size_t(mask_words));
+  for (auto type : new_query->All()) {
+    SetTypeMaskBit(new_query->all_type_mask_, type);
+  }
+  for (auto type : new_query->Any()) {
+    SetTypeMaskBit(new_query->any_type_mask_, type);
+  }
+  for (auto type : new_query->None()) {
+    SetTypeMaskBit(new_query->none_type_mask_, type);
+  }
+
+  new_query->matching_archetypes_        = List<Archetype*>::WithAllocator(MEM_ALLOC_HEAP);
+  new_query->matching_archetype_columns_ = List<EntityQueryColumn>::WithAllocator(MEM_ALLOC_HEAP);
+  new_query->matching_chunks_            = List<EntityQueryChunk>::WithAllocator(MEM_ALLOC_HEAP);
 
   for (auto archetype : archetypes_.list_) {
     if (new_query->IsMatch(archetype)) {
-      new_query->matching_archetypes_.Add(archetype);
-      archetype->matching_queries_.Add(new_query);
+      new_query->_AddMatchingArchetype(archetype);
     }
   }
 
   query_map_.Add(query_hash, query_list_.Len());
   query_list_.Add(new_query);
 
+  _IndexQuery(new_query);
+
   return new_query;
+}
+
+EntityQuery* EntityManager::_WithSharedComponentFilter(EntityQuery* query, ComponentTypeId type_id, i32 value_index) {
+  assert((world_->type_registry_->components_[type_id.Index()].flags_ & COMPONENT_FLAG_SHARED)
+         && "not a shared component type");
+
+  // The query descriptor is put back together from the query, the access modes tell all, any and none apart
+  auto query_desc = MemStackalloc(ComponentDataAccess, 0, query->all_len_ + query->any_len_ + query->none_len_);
+  for (i32 i = 0; i < query->all_len_; i++) {
+    query_desc = Append(query_desc, ComponentDataAccess{ query->all_[i], query->all_access_mode_[i] });
+  }
+  for (i32 i = 0; i < query->any_len_; i++) {
+    query_desc = Append(query_desc, ComponentDataAccess{ query->any_[i], query->any_access_mode_[i] });
+  }
+  for (i32 i = 0; i < query->none_len_; i++) {
+    query_desc = Append(query_desc, ComponentDataAccess{ query->none_[i], query->none_access_mode_[i] });
+  }
+
+  return _CreateQuery(query_desc.ptr_, query_desc.Len(), type_id, value_index);
+}
+
+void EntityManager::_IndexQuery(EntityQuery* query) {
+  // One all_ type is enough, the one with the fewest queries keeps the lists short
+  if (0 < query->all_len_) {
+    ComponentTypeId key = query->all_[0];
+    for (auto type : query->All()) {
+      if (queries_by_type_[type.Index()].Len() < queries_by_type_[key.Index()].Len()) {
+        key = type;
+      }
+    }
+    queries_by_type_[key.Index()].Add(query);
+    return;
+  }
+
+  if (0 < query->any_len_) {
+    for (auto type : query->Any()) {
+      queries_by_type_[type.Index()].Add(query);
+    }
+    return;
+  }
+
+  unindexed_queries_.Add(query);
 }
\ No newline at end of file
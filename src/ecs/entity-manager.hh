@@ -4,26 +4,46 @@
 
 #include "archetype.hh"
 #include "component-registry.hh" // aka ecs/types.hh
+#include "dynamic-buffer.hh"
 #include "entity-query.hh"
+#include "shared-component-store.hh"
 
 namespace game {
 struct World;
 struct ChunkAllocator;
 struct EntityManager;
 
-// Note that the meaning of this will depend on the value of chunk
-// When chunk is null the index is absolute (entity index)
+// Everything the entity manager knows about an entity index, one record per index in the entity table.
+// Note that the meaning of index depends on the value of chunk
+// When chunk is null the index is absolute (the next free entity index)
 // When chunk is not null the index is relative (index of entity in chunk)
-struct _ChunkEntityIndex {
+struct _EntityRecord {
   Chunk* chunk_;
-  i32    index_; // absolute (entity index) or relative (index of entity in chunk)
+  i32    index_;   // absolute (entity index) or relative (index of entity in chunk)
+  u32    version_; // The version of the entity that has (or had) this index
 };
 
-// A slice of the entities from a chunk
-struct _ChunkEntitySlice {
+// A chunk that a batch of entities (DestroyEntities, AddComponent or RemoveComponent) has entities in
+struct _SelectedChunk {
   Chunk* chunk_;
-  i32    index_; // Index of first entity in chunk
-  i32    count_; // Number of entities in this range
+  i32    bits_;  // The offset of the bitmask of selected entities of the chunk in EntityManager::selected_bits_
+  i32    count_; // The number of bits set
+};
+
+// A chunk that has space. Sorted by shared values and then by entity count, the chunks that entities can move between
+// are next to each other with the emptiest chunk first.
+struct _DefragmentCandidate {
+  i32    shared_values_[Archetype::SHARED_COMPONENT_MAX]; // Zero beyond the shared component types of the archetype
+  i32    entity_count_;
+  Chunk* chunk_;
+};
+
+// The outcome of a defragment step
+struct DefragmentResult {
+  ChunkOccupancy before_;
+  ChunkOccupancy after_;
+  i32            chunks_freed_;
+  i32            entities_moved_;
 };
 
 struct EntityManager {
@@ -32,25 +52,55 @@ struct EntityManager {
   MemBlockAllocator archetype_allocator_; // allocator used to allocate archetypes and entity queries
   i32               entity_capacity_;     // max number of entities that can currently be allocated
 
-  i32                next_free_entity_index_;
-  u32                entity_create_destroy_version_; // Updated each time an entity is created or destroyed
-  u32*               version_by_entity_;
-  _ChunkEntityIndex* entity_chunk_index_by_entity_;
-  Archetype**        archetype_by_entity_; // how is this important?
+  // The entity table is made of pages of records that never move, growing the table adds pages. The page directory is
+  // allocated up front for the most entities we can ever have.
+  enum {
+    ENTITY_PAGE_BITS = 12,                    // 4096 records (64 KiB) per page
+    ENTITY_PAGE_SIZE = 1 << ENTITY_PAGE_BITS,
+    ENTITY_PAGE_MAX  = 1 << 15,               // 128M entities
+  };
+
+  i32             next_free_entity_index_;
+  i32             fresh_entity_index_; // Entity indices from here to the end of the table have never been used
+  i32             entity_count_;       // The number of live entities
+  u32             entity_create_destroy_version_; // Updated each time an entity is created or destroyed
+  u32             structural_change_version_;     // Updated each time chunks or the entities in chunks change
+  _EntityRecord** entity_pages_;                  // The page directory (ENTITY_PAGE_MAX pages)
 
-  Archetype* entity_archetype_;
+  Archetype*      entity_archetype_;
+  ArchetypeLayout archetype_layout_; // The chunk layout of archetypes created from now on
 
-  Archetype* CreateArchetype(Slice<const ComponentTypeId> types);
-  Archetype* CreateArchetype(std::initializer_list<ComponentTypeId> types) {
-    return CreateArchetype(slice::FromInitializer(types));
+  // The world advances the global system version before each system update. The change versions of a chunk are set to
+  // the global system version when component data is written to or when entities are added to or removed from the
+  // chunk. A system can tell what changed since it last ran by comparing change versions to its last system version.
+  u32 global_system_version_;
+
+  // The last system version of the system that is being updated, zero outside of system updates. This is what change
+  // filters compare change versions to (see ComponentDataAccess::WithChangeFilter).
+  u32 last_system_version_;
+
+  // Archetypes that are expected to have more entities than this don't get bigger chunks
+  static const i32 CHUNK_TARGET_ENTITY_COUNT = 512;
+
+  // The expected entity count is a hint for picking the chunk size class of the archetype (zero means no estimate).
+  // The first call for a set of component types decides the size class.
+  Archetype* CreateArchetype(Slice<const ComponentTypeId> types, i32 expected_entity_count = 0);
+  Archetype* CreateArchetype(std::initializer_list<ComponentTypeId> types, i32 expected_entity_count = 0) {
+    return CreateArchetype(slice::FromInitializer(types), expected_entity_count);
   }
 
   // ---
   // Entity API
   // ---
 
-  // Creates a new entity.
-  void CreateEntities(Archetype* archetype, Entity* entities, i32 count);
+  // Creates a new entity. Shared components get their zero value.
+  void CreateEntities(Archetype* archetype, Entity* entities, i32 count) {
+    _CreateEntities(archetype, nullptr, entities, count);
+  }
+
+  // Creates entities in chunks with these shared values (one index per shared component type of the archetype, null
+  // means the zero values)
+  void _CreateEntities(Archetype* archetype, const i32* shared_values, Entity* entities, i32 count);
 
   // Creates a new entity without any components.
   Entity CreateEntity() {
@@ -66,10 +116,56 @@ struct EntityManager {
     return entity;
   }
 
+  // Destroys entities. Chunks are kept densely packed, the last entities of a chunk are moved into the holes left
+  // behind by destroyed entities and chunks that become empty are freed. The entities can be in any order, each chunk
+  // is compacted once.
   void DestroyEntities(Entity* entities, i32 count);
 
+  // Chunks are created and freed through a magazine per size class, most chunk allocations are a pop from the
+  // magazine instead of a claim on the shared chunk pool. World::Update flushes the magazines once per frame so that
+  // the pools see the chunks that are no longer in use (see ChunkRetentionPolicy).
+  ChunkMagazine chunk_magazines_[CHUNK_SIZE_CLASS_COUNT];
+
+  // Give the chunks cached in the magazines back to the chunk pools
+  void FlushChunkMagazines();
+
+  // Scratch space of DestroyEntities and the batched AddComponent/RemoveComponent, kept between calls
+  List<_SelectedChunk> selected_chunks_;
+  List<u64>            selected_bits_;
+
   void DestroyEntity(Entity entity) { DestroyEntities(&entity, 1); }
 
+  // Creates count copies of the prefab entity. The copies are created a chunk at a time and each component array is
+  // filled by replicating the prefab component data. The copies have the same shared component values as the prefab.
+  // If the prefab is not valid, out is filled with invalid entities.
+  void Instantiate(Entity prefab, Entity* out, i32 count);
+
+  Entity Instantiate(Entity prefab) {
+    Entity entity;
+    Instantiate(prefab, &entity, 1);
+    return entity;
+  }
+
+  // ---
+  // Defragmentation
+  // ---
+
+  // Move entities out of the emptiest chunks of the archetype and into the fullest chunks that still have space, then
+  // free the chunks that were drained. A chunk is only drained if the other chunks have room for all of its entities.
+  // At most max_chunks chunks are freed. Entities that are moved keep their handles but not their location.
+  DefragmentResult DefragmentArchetype(Archetype* archetype, i32 max_chunks);
+
+  // Defragment archetypes in a round-robin fashion until chunk_budget chunks have been freed or there is nothing left
+  // to do. The occupancy that is reported is for all archetypes. This is meant to be run once per frame.
+  DefragmentResult Defragment(i32 chunk_budget);
+
+  ChunkOccupancy Occupancy() const;
+
+  i32 defragment_cursor_; // Index of the archetype to defragment next
+
+  // Scratch space of DefragmentArchetype, kept between calls
+  List<_DefragmentCandidate> defragment_candidates_;
+
   // ---
 
   void _SetComponentData(Entity entity, ComponentTypeId type_id, const void* data);
@@ -78,16 +174,122 @@ struct EntityManager {
     _SetComponentData(entity, GetComponentTypeId<T>(), &data);
   }
 
+  // ---
+  // Shared components
+  // ---
+
+  SharedComponentStore shared_components_;
+
+  // The index of a shared component value in the shared component store, chunks with the same value have the same index
+  i32 _GetSharedComponentIndex(ComponentTypeId type_id, const void* data);
+
+  template <typename T> i32 GetSharedComponentIndex(const T& data) {
+    return _GetSharedComponentIndex(GetComponentTypeId<T>(), &data);
+  }
+
+  void _GetSharedComponentData(Entity entity, ComponentTypeId type_id, void* data);
+
+  template <typename T> T GetSharedComponentData(Entity entity) {
+    T data;
+    _GetSharedComponentData(entity, GetComponentTypeId<T>(), &data);
+    return data;
+  }
+
+  // Sets the shared component value of an entity. The entity is moved to a chunk of the same archetype that has the
+  // new value, a chunk is allocated if there is none with space.
+  void _SetSharedComponentData(Entity entity, ComponentTypeId type_id, const void* data);
+
+  template <typename T> void SetSharedComponentData(Entity entity, const T& data) {
+    _SetSharedComponentData(entity, GetComponentTypeId<T>(), &data);
+  }
+
+  // Sets the shared component value of all entities that match the query (and its filter). No entities are moved, the
+  // chunks are relabeled. This can leave chunks with the same value partially filled until they are defragmented.
+  void _SetSharedComponentData(EntityQuery* query, ComponentTypeId type_id, const void* data);
+
+  template <typename T> void SetSharedComponentData(EntityQuery* query, const T& data) {
+    _SetSharedComponentData(query, GetComponentTypeId<T>(), &data);
+  }
+
+  // The query that only matches the chunks of query with this shared component value. The filter is part of the query,
+  // queries are pooled per filter value and the query that was passed in is left as is.
+  EntityQuery* _WithSharedComponentFilter(EntityQuery* query, ComponentTypeId type_id, i32 value_index);
+
+  template <typename T> EntityQuery* WithSharedComponentFilter(EntityQuery* query, const T& data) {
+    return _WithSharedComponentFilter(query, GetComponentTypeId<T>(), GetSharedComponentIndex(data));
+  }
+
+  // ---
+  // Dynamic buffers
+  // ---
+
+  BufferAllocator buffer_allocator_; // Overflow storage of dynamic buffers
+
+  // The buffer of an entity, null if the entity isn't valid. This counts as a write to the buffer.
+  BufferHeader* _GetBuffer(Entity entity, ComponentTypeId type_id);
+
+  template <typename T> DynamicBuffer<T> GetBuffer(Entity entity) {
+    return { _GetBuffer(entity, GetComponentTypeId<T>()), &buffer_allocator_ };
+  }
+
+  // ---
+  // Enableable components
+  // ---
+
+  // Turn an enableable component of an entity on or off. This is not a structural change, the entity stays where it is
+  // and one bit is flipped. It counts as a write to the component data of the chunk.
+  void _SetComponentEnabled(Entity entity, ComponentTypeId type_id, bool enabled);
+
+  template <typename T> void SetComponentEnabled(Entity entity, bool enabled) {
+    _SetComponentEnabled(entity, GetComponentTypeId<T>(), enabled);
+  }
+
+  bool _IsComponentEnabled(Entity entity, ComponentTypeId type_id);
+
+  template <typename T> bool IsComponentEnabled(Entity entity) {
+    return _IsComponentEnabled(entity, GetComponentTypeId<T>());
+  }
+
+  // ---
+
+  // Adds a component to an existing entity. The entity is moved to the archetype that has the component type, the
+  // component data of the entity is copied and the new component is zero initialized. Nothing happens if the entity
+  // already has the component type.
+  void AddComponent(Entity entity, ComponentTypeId type_id);
+
+  template <typename T> void AddComponent(Entity entity) { AddComponent(entity, GetComponentTypeId<T>()); }
+
+  // Removes a component from an existing entity. Nothing happens if the entity doesn't have the component type.
+  void RemoveComponent(Entity entity, ComponentTypeId type_id);
+
+  template <typename T> void RemoveComponent(Entity entity) { RemoveComponent(entity, GetComponentTypeId<T>()); }
+
+  // Adds a component to many entities. The entity handles are bucketed by chunk like DestroyEntities does and each
+  // chunk is dealt with once: a chunk whose entities are all in the batch changes archetype as a whole (see the query
+  // version), otherwise the entities are copied out one component array at a time and the chunk is compacted once.
+  // Invalid entities and entities that already have the component type are skipped.
+  void AddComponent(const Entity* entities, i32 count, ComponentTypeId type_id);
+
+  // Removes a component from many entities (see AddComponent)
+  void RemoveComponent(const Entity* entities, i32 count, ComponentTypeId type_id);
+
+  // Adds a component to all entities that match the query (and its filter). Entities are moved a chunk at a time, when
+  // the layout of the archetypes allows it the chunk keeps its entities and only the component arrays are moved within
+  // the chunk.
+  void AddComponent(EntityQuery* query, ComponentTypeId type_id);
+
+  template <typename T> void AddComponent(EntityQuery* query) { AddComponent(query, GetComponentTypeId<T>()); }
+
+  // Removes a component from all entities that match the query (see AddComponent)
+  void RemoveComponent(EntityQuery* query, ComponentTypeId type_id);
+
+  template <typename T> void RemoveComponent(EntityQuery* query) { RemoveComponent(query, GetComponentTypeId<T>()); }
+
+  // Destroys all entities that match the query (and its filter). Chunks are freed without being compacted.
+  void DestroyEntities(EntityQuery* query);
+
   // ---
 
-  // // Copies an existing entity and creates a new entity from that copy.
-  // void Instantiate();
-  // // Destroys an existing entity.
-  // void DestroyEntity();
-  // // Adds a component to an existing entity.
-  // void AddComponent();
-  // // 	Removes a component from an existing entity.
-  // void RemoveComponent();
   // // Retrieves the value of an entity's component.
   // void GetComponent();
   // // Overwrites the value of an entity's component.
@@ -99,9 +301,71 @@ struct EntityManager {
 
   void Destroy();
 
+  // Grow the entity table to at least new_capacity entities (whole pages)
   void _SetCapacity(i32 new_capacity);
 
-  _ChunkEntitySlice _FindFirstEntityRange(Entity* entities, i32 count);
+  // The record of an entity index, the reference stays valid when the table grows
+  _EntityRecord& _Record(i32 entity_index) const {
+    return entity_pages_[entity_index >> ENTITY_PAGE_BITS][entity_index & (ENTITY_PAGE_SIZE - 1)];
+  }
+
+  // Move live entities from the end of the chunk into the holes left by destroyed entities (bits set in destroyed)
+  void _CompactChunk(Chunk* chunk, const u64* destroyed, i32 destroyed_count);
+
+  // Set the bit of an entity in the bitmask of its chunk, the chunk is added to selected_chunks_ the first time.
+  // Returns false if the entity was already selected.
+  bool _SelectEntity(Chunk* chunk, i32 index);
+
+  // Make room in the entity table for count more entities
+  void _ReserveEntities(i32 count);
+
+  // Create n entities at the end of a chunk with at least n empty slots, after _ReserveEntities. The new entities are
+  // written to entities if it's not null.
+  void _CreateEntitiesInChunk(Chunk* chunk, Entity* entities, i32 n);
+
+  // Find a chunk with these shared values and space for more entities, a new chunk is allocated if there is none
+  Chunk* _ChunkWithEmptySlots(Archetype* archetype, const i32* shared_values);
+
+  // The archetype you get by adding (or removing) a component type. Transitions are cached in the archetype edges.
+  Archetype* _ArchetypeWithComponent(Archetype* archetype, ComponentTypeId type_id);
+  Archetype* _ArchetypeWithoutComponent(Archetype* archetype, ComponentTypeId type_id);
+
+  // Move an entity to a chunk of another archetype (or of the same archetype with other shared values), component data
+  // that the archetypes have in common is copied
+  void _MoveEntity(i32 entity_index, Archetype* archetype, const i32* shared_values);
+
+  // Move all entities of an archetype to another archetype a chunk at a time. Only chunks that pass the filter of the
+  // query are moved (null means all chunks).
+  void _MoveChunks(Archetype* src, Archetype* dst, const EntityQuery* filter);
+
+  // Move all entities of a chunk to another archetype. If the layouts allow it the chunk changes archetype in place.
+  void _MoveChunk(Chunk* chunk, Archetype* dst);
+
+  // Move the entities of a chunk whose bits are set in selected to chunks of another archetype, then compact the chunk.
+  // Not all entities of the chunk can be selected (see _MoveChunk).
+  void _MoveSelectedEntities(Chunk* chunk, const u64* selected, i32 count, Archetype* dst);
+
+  // Add (or remove) a component type to the entities, see AddComponent(const Entity*, ...)
+  void _MoveEntities(const Entity* entities, i32 count, ComponentTypeId type_id, bool add);
+
+  // Remove the entity at index from the chunk by moving the last entity of the chunk into its place. The entity table
+  // is not updated for the removed entity.
+  void _RemoveChunkEntity(Chunk* chunk, i32 index);
+
+  // Move the last count entities of src to the end of dst. The chunks may belong to different archetypes, component
+  // data that the archetypes have in common is copied.
+  void _MoveChunkTail(Chunk* dst, Chunk* src, i32 count);
+
+  // Give back the overflow blocks of the buffers of the entities in [begin, end) of the chunk. Buffer component types
+  // that the keep archetype has are skipped, the buffers are about to be moved there (null means release all).
+  void _ReleaseBuffers(Chunk* chunk, i32 begin, i32 end, const Archetype* keep);
+
+  // Remove an empty chunk from its archetype and give it back to the chunk allocator
+  void _FreeChunk(Chunk* chunk);
+
+  // Set every change version of the chunk to the global system version (entities were added or removed). This is a
+  // structural change, the chunk caches of queries are invalidated.
+  void _SetChunkChanged(Chunk* chunk);
 
   // ---
 
@@ -109,11 +373,29 @@ struct EntityManager {
   List<EntityQuery*> query_list_;
   i32                query_mask_count_;
 
+  // New archetypes are only tested against the queries that mention one of their component types. A query with all_
+  // types is found under one of them (an archetype without it can't match), otherwise under each of its any_ types.
+  // Queries with neither can match any archetype.
+  List<EntityQuery*>* queries_by_type_;     // One list per registered component type
+  i32                 queries_by_type_len_;
+  List<EntityQuery*>  unindexed_queries_;
+
+  // Add a query to the inverted index
+  void _IndexQuery(EntityQuery* query);
+
   // Entity queries track archetypes with matching component types
   // Entity queries are built from query descriptors that tell us what component types are to be read/written/excluded in the query
-  EntityQuery* CreateQuery(const ComponentDataAccess* query_desc, i32 query_desc_len);
+  EntityQuery* CreateQuery(const ComponentDataAccess* query_desc, i32 query_desc_len) {
+    return _CreateQuery(query_desc, query_desc_len, GetComponentTypeId<Entity>(), 0);
+  }
   EntityQuery* CreateQuery(std::initializer_list<ComponentDataAccess> query_desc) {
     return CreateQuery(query_desc.begin(), i32(query_desc.size()));
   }
+
+  // Create a query with a shared component filter (the type is Entity for no filter)
+  EntityQuery* _CreateQuery(const ComponentDataAccess* query_desc,
+                            i32                        query_desc_len,
+                            ComponentTypeId            shared_filter_type,
+                            i32                        shared_filter_value);
 };
 } // namespace game
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include "entity-manager.hh"
 
+#include "system.hh"
 #include "world.hh"
 
 using namespace game;
@@ -19,6 +20,136 @@ struct Rotation {
   float axis_[3];
   float angle_;
 };
+
+struct Material {
+  enum { COMPONENT_TYPE = 3 };
+
+  u32 id_;
+};
+
+struct Waypoint {
+  enum { COMPONENT_TYPE = 4, BUFFER_CAPACITY = 4 };
+
+  float v_[3];
+};
+
+// Add n waypoints to the buffer of every entity in the chunk
+struct AddWaypointsJob {
+  ComponentDataReaderWriter<Waypoint> waypoints_;
+  int                                 n_;
+
+  static void Kernel(AddWaypointsJob& job, const SystemChunk& chunk) {
+    auto buffers = chunk.GetBufferAccessor(job.waypoints_);
+    for (int i = 0; i < buffers.Len(); i++) {
+      auto buffer = buffers[i];
+      for (int j = 0; j < job.n_; j++) {
+        buffer.Add({ { float(buffer.Len()), 0, 0 } });
+      }
+    }
+  }
+};
+
+struct Health {
+  enum { COMPONENT_TYPE = 5 };
+
+  i32 value_;
+};
+
+// Add one to the health of every entity in the chunk and count the calls
+struct HealJob {
+  ComponentDataReaderWriter<Health> health_;
+  int                               calls_;
+
+  static void Kernel(HealJob& job, const SystemChunk& chunk) {
+    Health* health = chunk.GetArray(job.health_);
+    for (int i = 0; i < chunk.Len(); i++) {
+      health[i].value_++;
+    }
+    job.calls_++;
+  }
+};
+
+// The last component type of the wide archetypes of the GetArray benchmark, the types before it are fillers
+struct Wide {
+  enum { COMPONENT_TYPE = 32 };
+
+  float v_;
+};
+
+// Look up the component array once per entity so that the cost of the lookup stands out
+struct SumWideJob {
+  ComponentDataReader<Wide> wide_;
+  float                     sum_;
+
+  static void Kernel(SumWideJob& job, const SystemChunk& chunk) {
+    for (int i = 0; i < chunk.Len(); i++) {
+      job.sum_ += chunk.GetArray(job.wide_)[i].v_;
+    }
+  }
+};
+
+// Look up component data without going through a system
+template <typename T> T* GetComponentData(EntityManager& entity_manager, Entity entity) {
+  _EntityRecord chunk_index = entity_manager._Record(entity.index_);
+  Archetype&    archetype   = chunk_index.chunk_->Archetype();
+  for (int i = 0; i < archetype.types_len_; i++) {
+    if (archetype.types_[i] == GetComponentTypeId<T>()) {
+      return (T*)((byte*)chunk_index.chunk_->Buffer() + archetype.offsets_[i]) + chunk_index.index_;
+    }
+  }
+  return nullptr;
+}
+
+// Create chunk_count full chunks of entities then destroy entities so that chunk i is left with keep[i] entities
+Entity* CreateFragmentedChunks(EntityManager& m, Archetype* archetype, const int* keep, int chunk_count) {
+  const int capacity = archetype->chunk_entity_capacity_;
+
+  auto entities = MemAllocArray<Entity>(MEM_ALLOC_HEAP, chunk_count * capacity);
+  m.CreateEntities(archetype, entities, chunk_count * capacity);
+
+  for (int i = 0; i < chunk_count * capacity; i++) {
+    GetComponentData<Rotation>(m, entities[i])->angle_ = float(i);
+  }
+
+  for (int i = 0; i < chunk_count; i++) {
+    m.DestroyEntities(entities + i * capacity + keep[i], capacity - keep[i]);
+  }
+
+  return entities;
+}
+
+// Check that every live entity can be found where the entity manager says it is and that its data came along
+bool CheckEntities(EntityManager& m, const Entity* entities, int count) {
+  for (int i = 0; i < count; i++) {
+    Entity entity = entities[i];
+    if (m._Record(entity.index_).version_ != entity.version_) {
+      continue;
+    }
+    _EntityRecord chunk_index = m._Record(entity.index_);
+    if (!(chunk_index.index_ < chunk_index.chunk_->EntityCount())) {
+      return false;
+    }
+    if (chunk_index.chunk_->EntityArray()[chunk_index.index_].index_ != entity.index_) {
+      return false;
+    }
+    if (GetComponentData<Rotation>(m, entity)->angle_ != float(i)) {
+      return false;
+    }
+  }
+  return true;
+}
+// A deterministic shuffle (Fisher-Yates with a fixed LCG)
+template <typename T> void Shuffle(T* values, int count) {
+  u32 seed = 12345;
+  for (int i = count - 1; 0 < i; i--) {
+    seed  = seed * 1664525 + 1013904223;
+    int j = int((seed >> 8) % u32(i + 1));
+
+    T t       = values[i];
+    values[i] = values[j];
+    values[j] = t;
+  }
+}
 } // namespace
 
 int main(int argc, char* argv[]) {
@@ -28,6 +159,9 @@ int main(int argc, char* argv[]) {
     GAME_COMPONENT(Entity),
     GAME_COMPONENT(Position),
     GAME_COMPONENT(Rotation),
+    GAME_COMPONENT_FLAGS(Material, COMPONENT_FLAG_SHARED),
+    GAME_COMPONENT_BUFFER(Waypoint),
+    GAME_COMPONENT_FLAGS(Health, COMPONENT_FLAG_ENABLEABLE),
   };
 
   TEST_CASE("CreateArchetypeTest") {
@@ -49,6 +183,65 @@ int main(int argc, char* argv[]) {
     world.Destroy();
   }
 
+  TEST_CASE("CreateArchetypeSizeClassTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    // without an estimate we get the default size class
+    auto a = world.EntityManager().CreateArchetype({ GetComponentTypeId<Position>() });
+    ASSERT_EQUAL_I32(CHUNK_SIZE_CLASS_DEFAULT, a->chunk_size_class_);
+
+    // a handful of entities fit in the smallest size class
+    auto b = world.EntityManager().CreateArchetype({ GetComponentTypeId<Rotation>() }, 10);
+    ASSERT_EQUAL_I32(CHUNK_SIZE_CLASS_4K, b->chunk_size_class_);
+
+    // lots of entities get chunks that hold at least CHUNK_TARGET_ENTITY_COUNT entities
+    auto c = world.EntityManager().CreateArchetype(
+        {
+            GetComponentTypeId<Position>(),
+            GetComponentTypeId<Rotation>(),
+        },
+        100 * 1000);
+    ASSERT_EQUAL_I32(CHUNK_SIZE_CLASS_64K, c->chunk_size_class_);
+    ASSERT_TRUE(EntityManager::CHUNK_TARGET_ENTITY_COUNT <= c->chunk_entity_capacity_);
+
+    // the size class is decided the first time the archetype is created
+    ASSERT_EQUAL_PTR(b, world.EntityManager().CreateArchetype({ GetComponentTypeId<Rotation>() }, 100 * 1000));
+
+    Entity entities[400];
+    world.EntityManager().CreateEntities(b, entities, ArrayLength(entities));
+
+    ASSERT_TRUE(1 < b->chunk_data_.Len());
+    for (int i = 0; i < b->chunk_data_.Len(); i++) {
+      ASSERT_EQUAL_I32(CHUNK_SIZE_CLASS_4K, world.chunk_allocator_->SizeClass(b->chunk_data_.ChunkPtrArray()[i]));
+    }
+
+    world.Destroy();
+  }
+
+  TEST_CASE("CreateArchetypePackedTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    auto a = world.EntityManager().CreateArchetype({ GetComponentTypeId<Position>() });
+
+    world.EntityManager().archetype_layout_ = ARCHETYPE_LAYOUT_PACKED;
+
+    auto b = world.EntityManager().CreateArchetype({ GetComponentTypeId<Rotation>() });
+
+    ASSERT_EQUAL_I32(ARCHETYPE_LAYOUT_CACHE_LINE, a->layout_);
+    ASSERT_EQUAL_I32(ARCHETYPE_LAYOUT_PACKED, b->layout_);
+
+    // Entity + Rotation is 24 bytes, no padding is needed
+    ASSERT_EQUAL_I32(CHUNK_BUFFER_SIZE / 24, b->chunk_entity_capacity_);
+    ASSERT_EQUAL_I32(0, b->offsets_[0]);
+    ASSERT_EQUAL_I32(8 * b->chunk_entity_capacity_, b->offsets_[1]);
+
+    world.Destroy();
+  }
+
   TEST_CASE("CreateEntityTest") {
     World world;
 
@@ -67,7 +260,7 @@ int main(int argc, char* argv[]) {
 
     auto chunk = archetype->chunk_data_.ChunkPtrArray()[0];
 
-    auto entity_chunk_index = world.entity_manager_->entity_chunk_index_by_entity_[0];
+    auto entity_chunk_index = world.entity_manager_->_Record(0);
 
     ASSERT_EQUAL_PTR(chunk, entity_chunk_index.chunk_);
     ASSERT_EQUAL_U32(0, entity_chunk_index.index_);
@@ -114,4 +307,1171 @@ int main(int argc, char* argv[]) {
 
     world.Destroy();
   }
+
+  TEST_CASE("EntityTableGrowTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    auto archetype = m.CreateArchetype({ GetComponentTypeId<Rotation>() });
+
+    Entity first = m.CreateEntity(archetype);
+    m.DestroyEntity(m.CreateEntity(archetype)); // index 1 goes back on the free list
+
+    const _EntityRecord* record   = &m._Record(first.index_);
+    const i32            capacity = m.entity_capacity_;
+
+    // the table grows by whole pages and the records that exist don't move
+    const int count    = 3 * EntityManager::ENTITY_PAGE_SIZE;
+    auto      entities = MemAllocArray<Entity>(MEM_ALLOC_HEAP, count);
+    m.CreateEntities(archetype, entities, count);
+
+    ASSERT_TRUE(capacity < m.entity_capacity_);
+    ASSERT_EQUAL_I32(0, m.entity_capacity_ % EntityManager::ENTITY_PAGE_SIZE);
+    ASSERT_EQUAL_PTR(record, &m._Record(first.index_));
+
+    // the free index comes first, then the indices continue across the old end of the table
+    ASSERT_EQUAL_I32(1, entities[0].index_);
+    ASSERT_EQUAL_U32(2, entities[0].version_);
+    for (int i = 1; i < count; i++) {
+      ASSERT_EQUAL_I32(i + 1, entities[i].index_);
+      ASSERT_EQUAL_U32(1, entities[i].version_);
+    }
+    for (int i = 0; i < count; i++) {
+      GetComponentData<Rotation>(m, entities[i])->angle_ = float(i);
+    }
+    ASSERT_TRUE(CheckEntities(m, entities, count));
+
+    MemFree(MEM_ALLOC_HEAP, entities);
+
+    world.Destroy();
+  }
+
+  TEST_CASE("CreateEntitiesBulkTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    auto archetype = m.CreateArchetype({ GetComponentTypeId<Rotation>() });
+
+    Entity a = m.CreateEntity(archetype);
+    Entity b = m.CreateEntity(archetype);
+    Entity c = m.CreateEntity(archetype);
+
+    m.DestroyEntity(a);
+    m.DestroyEntity(c);
+
+    ASSERT_EQUAL_I32(1, m.entity_count_);
+    ASSERT_EQUAL_I32(3, m.fresh_entity_index_);
+
+    // the holes are filled first (most recently destroyed first), then the indices that have never been used follow
+    // in one run that spans chunks and pages of the entity table. The table grows once, up front.
+    const int count    = 2 * EntityManager::ENTITY_PAGE_SIZE + 10;
+    auto      entities = MemAllocArray<Entity>(MEM_ALLOC_HEAP, count);
+    m.CreateEntities(archetype, entities, count);
+
+    ASSERT_EQUAL_I32(count + 1, m.entity_count_);
+    ASSERT_EQUAL_I32(count + 1, m.fresh_entity_index_);
+    ASSERT_EQUAL_I32(count + 1, m.next_free_entity_index_);
+    ASSERT_TRUE(count + 1 < m.entity_capacity_);
+
+    ASSERT_EQUAL_I32(c.index_, entities[0].index_);
+    ASSERT_EQUAL_U32(2, entities[0].version_);
+    ASSERT_EQUAL_I32(a.index_, entities[1].index_);
+    ASSERT_EQUAL_U32(2, entities[1].version_);
+    for (int i = 2; i < count; i++) {
+      ASSERT_EQUAL_I32(i + 1, entities[i].index_);
+      ASSERT_EQUAL_U32(1, entities[i].version_);
+    }
+    for (int i = 0; i < count; i++) {
+      GetComponentData<Rotation>(m, entities[i])->angle_ = float(i);
+    }
+    ASSERT_TRUE(CheckEntities(m, entities, count));
+    ASSERT_EQUAL_I32(count + 1, archetype->entity_count_);
+
+    // the free list is only indices that have been used, the fresh run is left alone
+    m.DestroyEntities(entities, count);
+    m.DestroyEntity(b);
+
+    ASSERT_EQUAL_I32(0, m.entity_count_);
+
+    m.CreateEntities(archetype, entities, count);
+
+    ASSERT_EQUAL_I32(count + 1, m.fresh_entity_index_);
+    ASSERT_EQUAL_I32(b.index_, entities[0].index_);
+    ASSERT_EQUAL_U32(2, entities[0].version_);
+    for (int i = 0; i < count; i++) {
+      GetComponentData<Rotation>(m, entities[i])->angle_ = float(i);
+    }
+    ASSERT_TRUE(CheckEntities(m, entities, count));
+
+    MemFree(MEM_ALLOC_HEAP, entities);
+
+    world.Destroy();
+  }
+
+  TEST_CASE("DestroyEntitiesCompactTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    auto archetype = m.CreateArchetype({ GetComponentTypeId<Position>(), GetComponentTypeId<Rotation>() });
+
+    Entity entities[10];
+    m.CreateEntities(archetype, entities, ArrayLength(entities));
+
+    for (int i = 0; i < ArrayLength(entities); i++) {
+      GetComponentData<Position>(m, entities[i])->v_[0] = float(i);
+    }
+
+    // out of order and with a handle that is already invalid
+    Entity destroy[] = { entities[4], entities[1], entities[3], entities[1] };
+    m.DestroyEntities(destroy, ArrayLength(destroy));
+
+    Chunk* chunk = archetype->chunk_data_.ChunkPtrArray()[0];
+
+    ASSERT_EQUAL_I32(7, chunk->EntityCount());
+    ASSERT_EQUAL_I32(7, archetype->entity_count_);
+    ASSERT_EQUAL_I32(7, archetype->chunk_data_.EntityCountArray()[0]);
+
+    // the last entities were moved into the holes, everything else stays put
+    const int remaining[] = { 0, 7, 2, 8, 9, 5, 6 };
+    for (int i = 0; i < ArrayLength(remaining); i++) {
+      Entity entity = entities[remaining[i]];
+      ASSERT_EQUAL_I32(entity.index_, chunk->EntityArray()[i].index_);
+      ASSERT_EQUAL_PTR(chunk, m._Record(entity.index_).chunk_);
+      ASSERT_EQUAL_I32(i, m._Record(entity.index_).index_);
+      ASSERT_TRUE(GetComponentData<Position>(m, entity)->v_[0] == float(remaining[i]));
+    }
+
+    // the rows that were left behind are zero
+    ASSERT_TRUE(MemIsZero(chunk->EntityArray() + 7, 3 * sizeof(Entity)));
+
+    // destroying the remaining entities gives the chunk back
+    m.DestroyEntities(entities, ArrayLength(entities));
+
+    ASSERT_EQUAL_I32(0, archetype->entity_count_);
+    ASSERT_EQUAL_I32(0, archetype->chunk_data_.Len());
+    ASSERT_EQUAL_I32(0, archetype->chunk_with_empty_slots_.Len());
+    m.FlushChunkMagazines();
+    ASSERT_EQUAL_U64(0, world.chunk_allocator_->pools_[CHUNK_SIZE_CLASS_DEFAULT].chunk_use_[0]);
+
+    world.Destroy();
+  }
+
+  TEST_CASE("DestroyEntitiesChunkTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    auto archetype = m.CreateArchetype({ GetComponentTypeId<Rotation>() }, 10); // 4 KiB chunks
+    auto capacity  = archetype->chunk_entity_capacity_;
+
+    auto entities = MemAllocArray<Entity>(MEM_ALLOC_HEAP, 3 * capacity);
+    m.CreateEntities(archetype, entities, 3 * capacity);
+
+    ASSERT_EQUAL_I32(3, archetype->chunk_data_.Len());
+    ASSERT_EQUAL_I32(0, archetype->chunk_with_empty_slots_.Len());
+
+    // a full chunk with a hole has space again
+    m.DestroyEntity(entities[capacity]);
+    ASSERT_EQUAL_I32(1, archetype->chunk_with_empty_slots_.Len());
+    ASSERT_EQUAL_PTR(archetype->chunk_data_.ChunkPtrArray()[1], archetype->chunk_with_empty_slots_[0]);
+
+    // empty the first chunk, the last chunk takes its place
+    Chunk* last_chunk = archetype->chunk_data_.ChunkPtrArray()[2];
+    m.DestroyEntities(entities, capacity);
+    ASSERT_EQUAL_I32(2, archetype->chunk_data_.Len());
+    ASSERT_EQUAL_PTR(last_chunk, archetype->chunk_data_.ChunkPtrArray()[0]);
+    ASSERT_EQUAL_I32(0, last_chunk->ListIndex());
+    ASSERT_EQUAL_I32(capacity, archetype->chunk_data_.EntityCountArray()[0]);
+    ASSERT_EQUAL_I32(capacity - 1, archetype->chunk_data_.EntityCountArray()[1]);
+
+    ASSERT_EQUAL_I32(2 * capacity - 1, archetype->entity_count_);
+
+    // the hole is filled again
+    m.CreateEntity(archetype);
+    ASSERT_EQUAL_I32(0, archetype->chunk_with_empty_slots_.Len());
+
+    MemFree(MEM_ALLOC_HEAP, entities);
+
+    world.Destroy();
+  }
+
+  TEST_CASE("DestroyEntitiesShuffledTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    auto archetype = m.CreateArchetype({ GetComponentTypeId<Rotation>() }, 10); // 4 KiB chunks
+    auto capacity  = archetype->chunk_entity_capacity_;
+
+    const int count    = 4 * capacity;
+    auto      entities = MemAllocArray<Entity>(MEM_ALLOC_HEAP, count);
+    m.CreateEntities(archetype, entities, count);
+
+    for (int i = 0; i < count; i++) {
+      GetComponentData<Rotation>(m, entities[i])->angle_ = float(i);
+    }
+
+    // every other entity of the first three chunks in shuffled order, the handles hop between chunks. The last chunk is
+    // left alone.
+    auto destroy = MemAllocArray<Entity>(MEM_ALLOC_HEAP, 3 * capacity);
+    int  n       = 0;
+    for (int i = 0; i < 3 * capacity; i += 2) {
+      destroy[n++] = entities[i];
+    }
+    Shuffle(destroy, n);
+    destroy[n] = destroy[0]; // destroyed twice
+
+    m.DestroyEntities(destroy, n + 1);
+
+    ASSERT_EQUAL_I32(count - n, archetype->entity_count_);
+    ASSERT_EQUAL_I32(count - n, m.entity_count_);
+    ASSERT_EQUAL_I32(4, archetype->chunk_data_.Len());
+    ASSERT_EQUAL_I32(3, archetype->chunk_with_empty_slots_.Len());
+    ASSERT_EQUAL_I32(capacity, archetype->chunk_data_.ChunkPtrArray()[3]->EntityCount());
+    for (int c = 0; c < 4; c++) {
+      Chunk* chunk = archetype->chunk_data_.ChunkPtrArray()[c];
+      ASSERT_EQUAL_I32(chunk->EntityCount(), archetype->chunk_data_.EntityCountArray()[c]);
+      ASSERT_EQUAL_I32(-1, chunk->header_.select_slot_);
+    }
+    for (int i = 0; i < 3 * capacity; i += 2) {
+      ASSERT_EQUAL_U32(2, m._Record(entities[i].index_).version_);
+    }
+    ASSERT_TRUE(CheckEntities(m, entities, count));
+
+    // what's left of the first three chunks, shuffled, frees them
+    n = 0;
+    for (int i = 1; i < 3 * capacity; i += 2) {
+      destroy[n++] = entities[i];
+    }
+    Shuffle(destroy, n);
+
+    m.DestroyEntities(destroy, n);
+
+    ASSERT_EQUAL_I32(1, archetype->chunk_data_.Len());
+    ASSERT_EQUAL_I32(capacity, archetype->entity_count_);
+    ASSERT_TRUE(CheckEntities(m, entities, count));
+
+    MemFree(MEM_ALLOC_HEAP, destroy);
+    MemFree(MEM_ALLOC_HEAP, entities);
+
+    world.Destroy();
+  }
+
+  TEST_CASE("DefragmentArchetypeTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    auto archetype = m.CreateArchetype({ GetComponentTypeId<Rotation>() }, 10); // 4 KiB chunks
+    auto capacity  = archetype->chunk_entity_capacity_;
+
+    const int keep[] = { capacity / 2, capacity / 8, capacity, capacity / 4, 1 };
+
+    Entity* entities = CreateFragmentedChunks(m, archetype, keep, ArrayLength(keep));
+
+    const int entity_count = capacity / 2 + capacity / 8 + capacity + capacity / 4 + 1;
+
+    ASSERT_EQUAL_I32(5, archetype->chunk_data_.Len());
+    ASSERT_EQUAL_I32(4, archetype->chunk_with_empty_slots_.Len());
+    ASSERT_EQUAL_I32(entity_count, archetype->entity_count_);
+
+    // the budget is respected, the emptiest chunks go first
+    DefragmentResult result = m.DefragmentArchetype(archetype, 2);
+
+    ASSERT_EQUAL_I32(2, result.chunks_freed_);
+    ASSERT_EQUAL_I32(1 + capacity / 8, result.entities_moved_);
+    ASSERT_EQUAL_I32(5, result.before_.chunk_count_);
+    ASSERT_EQUAL_I32(3, result.after_.chunk_count_);
+    ASSERT_EQUAL_I32(entity_count, result.before_.entity_count_);
+    ASSERT_EQUAL_I32(entity_count, result.after_.entity_count_);
+    ASSERT_TRUE(result.before_.Ratio() < result.after_.Ratio());
+    ASSERT_TRUE(CheckEntities(m, entities, ArrayLength(keep) * capacity));
+
+    // what's left fits in one chunk besides the full one
+    result = m.DefragmentArchetype(archetype, 100);
+
+    ASSERT_EQUAL_I32(1, result.chunks_freed_);
+    ASSERT_EQUAL_I32(2, archetype->chunk_data_.Len());
+    ASSERT_EQUAL_I32(1, archetype->chunk_with_empty_slots_.Len());
+    ASSERT_EQUAL_I32(entity_count, archetype->entity_count_);
+    ASSERT_TRUE(CheckEntities(m, entities, ArrayLength(keep) * capacity));
+
+    int chunk_entity_count = 0;
+    for (int i = 0; i < archetype->chunk_data_.Len(); i++) {
+      Chunk* chunk = archetype->chunk_data_.ChunkPtrArray()[i];
+      ASSERT_EQUAL_I32(chunk->EntityCount(), archetype->chunk_data_.EntityCountArray()[i]);
+      ASSERT_TRUE(MemIsZero(chunk->EntityArray() + chunk->EntityCount(),
+                            i32(sizeof(Entity)) * (chunk->EntityCapacity() - chunk->EntityCount())));
+      chunk_entity_count += chunk->EntityCount();
+    }
+    ASSERT_EQUAL_I32(entity_count, chunk_entity_count);
+
+    // nothing left to do
+    result = m.DefragmentArchetype(archetype, 100);
+
+    ASSERT_EQUAL_I32(0, result.chunks_freed_);
+    ASSERT_EQUAL_I32(0, result.entities_moved_);
+
+    MemFree(MEM_ALLOC_HEAP, entities);
+
+    world.Destroy();
+  }
+
+  TEST_CASE("DefragmentTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    auto a = m.CreateArchetype({ GetComponentTypeId<Rotation>() }, 10);
+    auto b = m.CreateArchetype({ GetComponentTypeId<Position>(), GetComponentTypeId<Rotation>() }, 10);
+
+    const int keep[] = { 1, 1, 1, 1 };
+
+    Entity* a_entities = CreateFragmentedChunks(m, a, keep, ArrayLength(keep));
+    Entity* b_entities = CreateFragmentedChunks(m, b, keep, ArrayLength(keep));
+
+    // 3 chunks can be freed from each archetype, the budget is spread over multiple steps
+    DefragmentResult result = m.Defragment(2);
+
+    ASSERT_EQUAL_I32(2, result.chunks_freed_);
+    ASSERT_EQUAL_I32(8, result.before_.chunk_count_);
+    ASSERT_EQUAL_I32(6, result.after_.chunk_count_);
+
+    result = m.Defragment(2);
+    ASSERT_EQUAL_I32(2, result.chunks_freed_);
+
+    // the world runs the last step as part of its update
+    world.defragment_chunk_budget_ = 2;
+    world.Update();
+
+    ASSERT_EQUAL_I32(1, a->chunk_data_.Len());
+    ASSERT_EQUAL_I32(1, b->chunk_data_.Len());
+
+    ChunkOccupancy occupancy = m.Occupancy();
+    ASSERT_EQUAL_I32(2, occupancy.chunk_count_);
+    ASSERT_EQUAL_I32(8, occupancy.entity_count_);
+
+    ASSERT_TRUE(CheckEntities(m, a_entities, ArrayLength(keep) * a->chunk_entity_capacity_));
+    ASSERT_TRUE(CheckEntities(m, b_entities, ArrayLength(keep) * b->chunk_entity_capacity_));
+
+    result = m.Defragment(2);
+    ASSERT_EQUAL_I32(0, result.chunks_freed_);
+
+    MemFree(MEM_ALLOC_HEAP, a_entities);
+    MemFree(MEM_ALLOC_HEAP, b_entities);
+
+    world.Destroy();
+  }
+
+  TEST_CASE("AddRemoveComponentTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    auto position          = m.CreateArchetype({ GetComponentTypeId<Position>() });
+    auto position_rotation = m.CreateArchetype({ GetComponentTypeId<Position>(), GetComponentTypeId<Rotation>() });
+
+    Entity entities[3];
+    m.CreateEntities(position, entities, ArrayLength(entities));
+
+    for (int i = 0; i < ArrayLength(entities); i++) {
+      GetComponentData<Position>(m, entities[i])->v_[0] = float(i);
+    }
+
+    const i32 archetype_count = m.archetypes_.list_.Len();
+
+    m.AddComponent<Rotation>(entities[0]);
+
+    // the last entity took the place of the entity that was moved
+    ASSERT_EQUAL_I32(2, position->entity_count_);
+    ASSERT_EQUAL_I32(1, position_rotation->entity_count_);
+    ASSERT_EQUAL_I32(entities[2].index_, position->chunk_data_.ChunkPtrArray()[0]->EntityArray()[0].index_);
+    ASSERT_EQUAL_I32(0, m._Record(entities[2].index_).index_);
+
+    ASSERT_EQUAL_PTR(position_rotation, &m._Record(entities[0].index_).chunk_->Archetype());
+    ASSERT_TRUE(GetComponentData<Position>(m, entities[0])->v_[0] == 0.0f);
+    ASSERT_TRUE(MemIsZero(GetComponentData<Rotation>(m, entities[0]), sizeof(Rotation)));
+
+    // the transition is cached in both directions
+    ASSERT_EQUAL_I32(1, position->edges_.Len());
+    ASSERT_EQUAL_PTR(position_rotation, position->edges_[0].add_);
+    ASSERT_EQUAL_PTR(position, position_rotation->edges_[0].remove_);
+
+    // adding a component type that the entity already has does nothing
+    m.AddComponent<Rotation>(entities[0]);
+    ASSERT_EQUAL_I32(1, position_rotation->entity_count_);
+
+    GetComponentData<Rotation>(m, entities[0])->angle_ = 1.0f;
+
+    m.RemoveComponent<Position>(entities[0]);
+
+    auto rotation = &m._Record(entities[0].index_).chunk_->Archetype();
+    ASSERT_EQUAL_I32(archetype_count + 1, m.archetypes_.list_.Len());
+    ASSERT_TRUE(rotation->_HasComponentType(GetComponentTypeId<Rotation>()));
+    ASSERT_FALSE(rotation->_HasComponentType(GetComponentTypeId<Position>()));
+    ASSERT_TRUE(GetComponentData<Rotation>(m, entities[0])->angle_ == 1.0f);
+
+    // the chunk that was left empty was freed
+    ASSERT_EQUAL_I32(0, position_rotation->entity_count_);
+    ASSERT_EQUAL_I32(0, position_rotation->chunk_data_.Len());
+
+    for (int i = 1; i < ArrayLength(entities); i++) {
+      m.AddComponent<Rotation>(entities[i]);
+      m.RemoveComponent<Position>(entities[i]);
+      ASSERT_TRUE(GetComponentData<Position>(m, entities[i]) == nullptr);
+    }
+
+    ASSERT_EQUAL_I32(3, rotation->entity_count_);
+    ASSERT_EQUAL_I32(0, position->entity_count_);
+    ASSERT_EQUAL_I32(archetype_count + 1, m.archetypes_.list_.Len());
+
+    // destroyed entities are ignored
+    m.DestroyEntity(entities[1]);
+    m.AddComponent<Position>(entities[1]);
+    ASSERT_EQUAL_I32(2, rotation->entity_count_);
+
+    world.Destroy();
+  }
+
+  TEST_CASE("AddRemoveComponentBatchTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    auto rotation          = m.CreateArchetype({ GetComponentTypeId<Rotation>() });
+    auto position_rotation = m.CreateArchetype({ GetComponentTypeId<Position>(), GetComponentTypeId<Rotation>() });
+
+    const int keep[]   = { rotation->chunk_entity_capacity_, rotation->chunk_entity_capacity_ };
+    const int capacity = rotation->chunk_entity_capacity_;
+    const int count    = ArrayLength(keep) * capacity;
+
+    Entity* entities = CreateFragmentedChunks(m, rotation, keep, ArrayLength(keep));
+
+    // every other entity of the first chunk and all of the second chunk, with a duplicate and a destroyed entity
+    auto batch = MemAllocArray<Entity>(MEM_ALLOC_HEAP, count + 2);
+    int  n     = 0;
+    for (int i = 0; i < capacity; i += 2) {
+      batch[n++] = entities[i];
+    }
+    for (int i = capacity; i < count; i++) {
+      batch[n++] = entities[i];
+    }
+    batch[n++] = entities[0];
+    batch[n++] = entities[1];
+    m.DestroyEntity(entities[1]);
+
+    const int moved = (capacity + 1) / 2 + capacity;
+
+    m.AddComponent(batch, n, GetComponentTypeId<Position>());
+
+    ASSERT_EQUAL_I32(count - 1 - moved, rotation->entity_count_);
+    ASSERT_EQUAL_I32(moved, position_rotation->entity_count_);
+    ASSERT_EQUAL_I32(1, rotation->chunk_data_.Len());
+    ASSERT_TRUE(CheckEntities(m, entities, count));
+    ASSERT_TRUE(MemIsZero(GetComponentData<Position>(m, entities[0]), sizeof(Position)));
+    ASSERT_TRUE(MemIsZero(GetComponentData<Position>(m, entities[count - 1]), sizeof(Position)));
+    ASSERT_TRUE(GetComponentData<Position>(m, entities[3]) == nullptr);
+
+    // entities that already have the component type are skipped
+    m.AddComponent(entities, count, GetComponentTypeId<Position>());
+    ASSERT_EQUAL_I32(0, rotation->entity_count_);
+    ASSERT_EQUAL_I32(count - 1, position_rotation->entity_count_);
+    ASSERT_TRUE(CheckEntities(m, entities, count));
+
+    m.RemoveComponent(batch, n, GetComponentTypeId<Position>());
+
+    ASSERT_EQUAL_I32(moved, rotation->entity_count_);
+    ASSERT_EQUAL_I32(count - 1 - moved, position_rotation->entity_count_);
+    ASSERT_TRUE(CheckEntities(m, entities, count));
+    ASSERT_TRUE(GetComponentData<Position>(m, entities[0]) == nullptr);
+    ASSERT_TRUE(GetComponentData<Position>(m, entities[3]) != nullptr);
+
+    MemFree(MEM_ALLOC_HEAP, batch);
+    MemFree(MEM_ALLOC_HEAP, entities);
+
+    world.Destroy();
+  }
+
+  TEST_CASE("AddRemoveComponentQueryTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    auto position = m.CreateArchetype({ GetComponentTypeId<Position>() });
+
+    const int count = 2 * position->chunk_entity_capacity_ + 10;
+
+    auto entities = MemAllocArray<Entity>(MEM_ALLOC_HEAP, count);
+    m.CreateEntities(position, entities, count);
+
+    for (int i = 0; i < count; i++) {
+      GetComponentData<Position>(m, entities[i])->v_[0] = float(i);
+    }
+
+    Chunk* chunks[3];
+    MemCopyArray(chunks, position->chunk_data_.ChunkPtrArray(), 3);
+
+    EntityQuery* position_query = m.CreateQuery({ ComponentDataAccess::Read<Position>() });
+    EntityQuery* rotation_query = m.CreateQuery({ ComponentDataAccess::Read<Rotation>() });
+
+    m.AddComponent<Rotation>(position_query);
+
+    Archetype* position_rotation =
+        m.CreateArchetype({ GetComponentTypeId<Position>(), GetComponentTypeId<Rotation>() });
+
+    ASSERT_EQUAL_I32(0, position->entity_count_);
+    ASSERT_EQUAL_I32(0, position->chunk_data_.Len());
+    ASSERT_EQUAL_I32(count, position_rotation->entity_count_);
+    ASSERT_EQUAL_I32(count, rotation_query->Count());
+
+    // the chunks were re-tagged, the entities that didn't fit went to other chunks
+    for (int i = 0; i < ArrayLength(chunks); i++) {
+      ASSERT_EQUAL_PTR(position_rotation, chunks[i]->header_.archetype_);
+    }
+    const int capacity = position_rotation->chunk_entity_capacity_;
+    ASSERT_EQUAL_I32((count + capacity - 1) / capacity, position_rotation->chunk_data_.Len());
+
+    for (int i = 0; i < count; i++) {
+      _EntityRecord chunk_index = m._Record(entities[i].index_);
+      ASSERT_EQUAL_I32(entities[i].index_, chunk_index.chunk_->EntityArray()[chunk_index.index_].index_);
+      ASSERT_TRUE(GetComponentData<Position>(m, entities[i])->v_[0] == float(i));
+      ASSERT_TRUE(MemIsZero(GetComponentData<Rotation>(m, entities[i]), sizeof(Rotation)));
+    }
+
+    int chunk_entity_count = 0;
+    for (int i = 0; i < position_rotation->chunk_data_.Len(); i++) {
+      Chunk* chunk = position_rotation->chunk_data_.ChunkPtrArray()[i];
+      ASSERT_EQUAL_I32(position_rotation->chunk_entity_capacity_, chunk->EntityCapacity());
+      ASSERT_EQUAL_I32(chunk->EntityCount(), position_rotation->chunk_data_.EntityCountArray()[i]);
+      ASSERT_EQUAL_I32(chunk->EntityCount() < chunk->EntityCapacity(), chunk->FreeListIndex() != -1);
+      chunk_entity_count += chunk->EntityCount();
+    }
+    ASSERT_EQUAL_I32(count, chunk_entity_count);
+
+    // removing the component type again gives more room per chunk so every chunk is re-tagged
+    const i32 chunk_count = position_rotation->chunk_data_.Len();
+
+    m.RemoveComponent<Rotation>(position_query);
+
+    ASSERT_EQUAL_I32(0, position_rotation->chunk_data_.Len());
+    ASSERT_EQUAL_I32(chunk_count, position->chunk_data_.Len());
+    ASSERT_EQUAL_I32(count, position->entity_count_);
+    ASSERT_EQUAL_I32(0, rotation_query->Count());
+
+    for (int i = 0; i < count; i++) {
+      ASSERT_TRUE(GetComponentData<Position>(m, entities[i])->v_[0] == float(i));
+    }
+
+    m.DestroyEntities(position_query);
+
+    ASSERT_EQUAL_I32(0, position_query->Count());
+    ASSERT_EQUAL_I32(0, position->chunk_data_.Len());
+    for (int i = 0; i < count; i++) {
+      ASSERT_TRUE(m._Record(entities[i].index_).version_ != entities[i].version_);
+    }
+
+    // the entity indices are reused
+    m.CreateEntities(position, entities, count);
+    ASSERT_EQUAL_I32(count, position_query->Count());
+    for (int i = 0; i < count; i++) {
+      ASSERT_TRUE(entities[i].index_ < count + 1);
+    }
+
+    MemFree(MEM_ALLOC_HEAP, entities);
+
+    world.Destroy();
+  }
+
+  TEST_CASE("InstantiateTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    auto archetype = m.CreateArchetype({ GetComponentTypeId<Position>(), GetComponentTypeId<Rotation>() });
+
+    Entity prefab = m.CreateEntity(archetype);
+
+    m.SetComponentData(prefab, Position{ { 1, 2, 3 } });
+    m.SetComponentData(prefab, Rotation{ { 0, 0, 1 }, 4 });
+
+    // the prefab chunk is filled up, then more chunks are allocated
+    const int count = 2 * archetype->chunk_entity_capacity_ + 10;
+
+    auto entities = MemAllocArray<Entity>(MEM_ALLOC_HEAP, count);
+    m.Instantiate(prefab, entities, count);
+
+    ASSERT_EQUAL_I32(count + 1, archetype->entity_count_);
+    ASSERT_EQUAL_I32(3, archetype->chunk_data_.Len());
+
+    for (int i = 0; i < count; i++) {
+      ASSERT_TRUE(m._Record(entities[i].index_).version_ == entities[i].version_);
+      ASSERT_TRUE(memcmp(GetComponentData<Position>(m, prefab), GetComponentData<Position>(m, entities[i]), 12) == 0);
+      ASSERT_TRUE(memcmp(GetComponentData<Rotation>(m, prefab), GetComponentData<Rotation>(m, entities[i]), 16) == 0);
+    }
+
+    // the copies are independent
+    m.SetComponentData(entities[0], Position{ { 5, 6, 7 } });
+    ASSERT_TRUE(GetComponentData<Position>(m, prefab)->v_[0] == 1.0f);
+    ASSERT_TRUE(GetComponentData<Position>(m, entities[1])->v_[0] == 1.0f);
+
+    // an invalid prefab gives invalid entities
+    m.DestroyEntity(prefab);
+    m.Instantiate(prefab, entities, 2);
+    ASSERT_EQUAL_I32(-1, entities[0].index_);
+    ASSERT_EQUAL_I32(-1, entities[1].index_);
+    ASSERT_EQUAL_I32(count, archetype->entity_count_);
+
+    MemFree(MEM_ALLOC_HEAP, entities);
+
+    world.Destroy();
+  }
+
+  TEST_CASE("SharedComponentTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    auto archetype = m.CreateArchetype({ GetComponentTypeId<Position>(), GetComponentTypeId<Material>() });
+
+    // the value is not stored with the entities
+    ASSERT_EQUAL_I32(1, archetype->shared_types_len_);
+    ASSERT_EQUAL_I32(0, archetype->sizes_[2]);
+
+    Entity entities[10];
+    m.CreateEntities(archetype, entities, 10);
+
+    for (int i = 0; i < 10; i++) {
+      m.SetComponentData(entities[i], Position{ { float(i), 0, 0 } });
+    }
+
+    ASSERT_EQUAL_U32(0, m.GetSharedComponentData<Material>(entities[0]).id_);
+    ASSERT_EQUAL_I32(1, archetype->chunk_data_.Len());
+
+    // entities with another value end up in another chunk
+    for (int i = 0; i < 4; i++) {
+      m.SetSharedComponentData(entities[i], Material{ 1 });
+    }
+
+    ASSERT_EQUAL_I32(2, archetype->chunk_data_.Len());
+    ASSERT_EQUAL_I32(10, archetype->entity_count_);
+    ASSERT_EQUAL_U32(1, m.GetSharedComponentData<Material>(entities[3]).id_);
+    ASSERT_EQUAL_U32(0, m.GetSharedComponentData<Material>(entities[4]).id_);
+
+    for (int i = 0; i < 10; i++) {
+      ASSERT_TRUE(GetComponentData<Position>(m, entities[i])->v_[0] == float(i));
+    }
+
+    // the same value is interned once, setting the value through SetComponentData works too
+    ASSERT_EQUAL_I32(m.GetSharedComponentIndex(Material{ 1 }), m.GetSharedComponentIndex(Material{ 1 }));
+    m.SetComponentData(entities[4], Material{ 1 });
+    ASSERT_EQUAL_U32(1, m.GetSharedComponentData<Material>(entities[4]).id_);
+    ASSERT_EQUAL_I32(2, archetype->chunk_data_.Len());
+
+    // filtered queries only see the chunks with the value
+    auto query = m.CreateQuery({ ComponentDataAccess::Read<Position>() });
+
+    ASSERT_EQUAL_I32(10, query->Count());
+
+    auto material_1 = m.WithSharedComponentFilter(query, Material{ 1 });
+
+    ASSERT_EQUAL_I32(5, material_1->Count());
+
+    // the filter is part of the query, the unfiltered query is left alone
+    ASSERT_TRUE(material_1 != query);
+    ASSERT_EQUAL_PTR(material_1, m.WithSharedComponentFilter(query, Material{ 1 }));
+    ASSERT_EQUAL_I32(10, query->Count());
+
+    struct JobData {
+      i32 material_;
+      i32 count_;
+    } job_data = { m.GetSharedComponentIndex(Material{ 1 }), 0 };
+
+    System::ExecuteJob<JobData>(material_1, job_data, [](JobData& data, const SystemChunk& chunk) {
+      if (chunk.GetSharedComponentIndex<Material>() == data.material_) {
+        data.count_ += chunk.Len();
+      }
+    });
+
+    ASSERT_EQUAL_I32(5, job_data.count_);
+
+    // copies of a prefab share its value
+    Entity copy = m.Instantiate(entities[0]);
+    ASSERT_EQUAL_U32(1, m.GetSharedComponentData<Material>(copy).id_);
+    ASSERT_EQUAL_I32(6, material_1->Count());
+
+    // a component is added to the chunks with the value, the value comes along
+    m.AddComponent<Rotation>(material_1);
+
+    auto rotation = m.CreateArchetype(
+        { GetComponentTypeId<Position>(), GetComponentTypeId<Rotation>(), GetComponentTypeId<Material>() });
+
+    ASSERT_EQUAL_I32(5, archetype->entity_count_);
+    ASSERT_EQUAL_I32(6, rotation->entity_count_);
+    ASSERT_EQUAL_U32(1, m.GetSharedComponentData<Material>(entities[0]).id_);
+    ASSERT_TRUE(GetComponentData<Position>(m, entities[2])->v_[0] == 2.0f);
+
+    // relabel the chunks, the chunks count as changed
+    const u32 structural_change_version = m.structural_change_version_;
+    m.global_system_version_++;
+    m.SetSharedComponentData(material_1, Material{ 2 });
+
+    ASSERT_TRUE(structural_change_version != m.structural_change_version_);
+    ASSERT_EQUAL_U32(m.global_system_version_, rotation->chunk_data_.ChangeVersionArray(0)[0]);
+    ASSERT_EQUAL_I32(0, material_1->Count());
+    ASSERT_EQUAL_U32(2, m.GetSharedComponentData<Material>(copy).id_);
+
+    m.DestroyEntities(m.WithSharedComponentFilter(query, Material{ 2 }));
+
+    ASSERT_EQUAL_I32(5, query->Count());
+    ASSERT_EQUAL_I32(0, rotation->entity_count_);
+
+    world.Destroy();
+  }
+
+  TEST_CASE("SharedComponentDefragmentTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    auto archetype = m.CreateArchetype({ GetComponentTypeId<Position>(), GetComponentTypeId<Material>() });
+
+    const int capacity = archetype->chunk_entity_capacity_;
+
+    auto entities = MemAllocArray<Entity>(MEM_ALLOC_HEAP, 3 * capacity);
+    m.CreateEntities(archetype, entities, 3 * capacity);
+
+    // a chunk with one entity for each value and a chunk with room for one more entity
+    m.SetSharedComponentData(entities[0], Material{ 1 });
+    m.DestroyEntities(entities + 1, capacity - 1);
+    m.DestroyEntities(entities + capacity, capacity - 1);
+    m.DestroyEntities(entities + 2 * capacity, 1);
+
+    ASSERT_EQUAL_I32(3, archetype->chunk_data_.Len());
+
+    DefragmentResult result = m.DefragmentArchetype(archetype, 4);
+
+    // only the entity with the zero value can move
+    ASSERT_EQUAL_I32(1, result.chunks_freed_);
+    ASSERT_EQUAL_I32(1, result.entities_moved_);
+    ASSERT_EQUAL_I32(2, archetype->chunk_data_.Len());
+    ASSERT_EQUAL_U32(1, m.GetSharedComponentData<Material>(entities[0]).id_);
+    ASSERT_EQUAL_U32(0, m.GetSharedComponentData<Material>(entities[2 * capacity - 1]).id_);
+
+    MemFree(MEM_ALLOC_HEAP, entities);
+
+    world.Destroy();
+  }
+
+  TEST_CASE("DynamicBufferTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    auto archetype = m.CreateArchetype({ GetComponentTypeId<Position>(), GetComponentTypeId<Waypoint>() });
+
+    ASSERT_EQUAL_I32(1, archetype->buffer_types_len_);
+    ASSERT_EQUAL_I32(16 + 4 * 12, archetype->sizes_[archetype->buffer_type_indices_[0]]);
+
+    Entity entities[3];
+    m.CreateEntities(archetype, entities, 3);
+
+    // the first elements are stored in the chunk
+    auto buffer = m.GetBuffer<Waypoint>(entities[0]);
+    ASSERT_EQUAL_I32(0, buffer.Len());
+    for (int i = 0; i < 4; i++) {
+      buffer.Add({ { float(i), 0, 0 } });
+    }
+    ASSERT_TRUE(buffer.header_->overflow_ == nullptr);
+    ASSERT_TRUE(m.buffer_allocator_.allocated_bytes_ == 0);
+
+    // then they spill
+    buffer.Add({ { 4, 0, 0 } });
+    ASSERT_TRUE(buffer.header_->overflow_ != nullptr);
+    ASSERT_TRUE(5 <= buffer.Cap());
+    for (int i = 0; i < 5; i++) {
+      ASSERT_TRUE(buffer[i].v_[0] == float(i));
+    }
+
+    // moving the entity moves the buffer, the overflow block goes with it
+    byte* overflow = buffer.header_->overflow_;
+    m.AddComponent<Rotation>(entities[0]);
+    buffer = m.GetBuffer<Waypoint>(entities[0]);
+    ASSERT_EQUAL_I32(5, buffer.Len());
+    ASSERT_EQUAL_PTR(overflow, buffer.header_->overflow_);
+    ASSERT_TRUE(buffer[4].v_[0] == 4.0f);
+
+    m.RemoveComponent<Rotation>(entities[0]);
+    ASSERT_EQUAL_PTR(overflow, m.GetBuffer<Waypoint>(entities[0]).header_->overflow_);
+
+    // copies get their own overflow blocks
+    Entity copies[2];
+    m.Instantiate(entities[0], copies, 2);
+    auto copy = m.GetBuffer<Waypoint>(copies[1]);
+    ASSERT_EQUAL_I32(5, copy.Len());
+    ASSERT_TRUE(copy.header_->overflow_ != overflow);
+    ASSERT_TRUE(copy[3].v_[0] == 3.0f);
+
+    // adding an element of the buffer to itself while the buffer grows (the old block is reused by the allocator)
+    auto self = m.GetBuffer<Waypoint>(entities[2]);
+    self.Add({ { 7, 8, 9 } });
+    while (self.header_->overflow_ == nullptr || self.Len() < self.Cap()) {
+      self.Add({ { 0, 0, 0 } });
+    }
+    self.Add(self[0]);
+    ASSERT_TRUE(self[self.Len() - 1].v_[0] == 7.0f);
+    ASSERT_TRUE(self[self.Len() - 1].v_[1] == 8.0f);
+    m.DestroyEntity(entities[2]);
+
+    // systems see one buffer per entity
+    EntityQuery*    query = m.CreateQuery({ ComponentDataAccess::Write<Waypoint>() });
+    AddWaypointsJob job   = { {}, 2 };
+    System::ExecuteJob(query, job, AddWaypointsJob::Kernel);
+
+    ASSERT_EQUAL_I32(7, m.GetBuffer<Waypoint>(entities[0]).Len());
+    ASSERT_EQUAL_I32(2, m.GetBuffer<Waypoint>(entities[1]).Len());
+    ASSERT_TRUE(m.GetBuffer<Waypoint>(entities[1])[1].v_[0] == 1.0f);
+    ASSERT_EQUAL_I32(7, m.GetBuffer<Waypoint>(copies[0]).Len());
+
+    // removing the buffer or destroying the entity gives the overflow block back
+    m.RemoveComponent<Waypoint>(copies[0]);
+    m.DestroyEntities(copies + 1, 1);
+    m.DestroyEntity(entities[0]);
+    ASSERT_TRUE(m.buffer_allocator_.allocated_bytes_ == 0);
+    ASSERT_TRUE(m.buffer_allocator_.free_lists_[BufferAllocator::_SizeClass(7 * 12)] != nullptr);
+
+    // blocks that are too big to be pooled still grow geometrically
+    BufferHeader big;
+    MemZeroInit(&big);
+    BufferReserve(&big, &m.buffer_allocator_, 200 * 1024, 1);
+    ASSERT_EQUAL_I32(200 * 1024, big.cap_);
+    BufferReserve(&big, &m.buffer_allocator_, 200 * 1024 + 1, 1);
+    ASSERT_EQUAL_I32(400 * 1024, big.cap_);
+    BufferRelease(&big, &m.buffer_allocator_, 1);
+    ASSERT_TRUE(m.buffer_allocator_.allocated_bytes_ == 0);
+
+    world.Destroy();
+  }
+
+  TEST_CASE("EnableableComponentTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    auto archetype = m.CreateArchetype({ GetComponentTypeId<Position>(), GetComponentTypeId<Health>() });
+
+    ASSERT_EQUAL_I32(1, archetype->enableable_types_len_);
+
+    Entity entities[200];
+    m.CreateEntities(archetype, entities, 200);
+    for (int i = 0; i < 200; i++) {
+      GetComponentData<Health>(m, entities[i])->value_ = i;
+    }
+
+    // new entities have their components enabled
+    ASSERT_TRUE(m.IsComponentEnabled<Health>(entities[0]));
+    ASSERT_TRUE(m.IsComponentEnabled<Position>(entities[0]));
+
+    for (int i = 10; i < 20; i++) {
+      m.SetComponentEnabled<Health>(entities[i], false);
+    }
+    m.SetComponentEnabled<Health>(entities[150], false);
+    ASSERT_FALSE(m.IsComponentEnabled<Health>(entities[10]));
+    ASSERT_TRUE(m.IsComponentEnabled<Health>(entities[20]));
+
+    // turning a component off is not a structural change
+    ASSERT_EQUAL_PTR(archetype, &m._Record(entities[10].index_).chunk_->Archetype());
+
+    EntityQuery* query = m.CreateQuery({ ComponentDataAccess::Write<Health>() });
+    ASSERT_EQUAL_I32(189, query->Count());
+
+    // the kernel is called once per run of enabled entities
+    HealJob job = { {}, 0 };
+    System::ExecuteJob(query, job, HealJob::Kernel);
+    ASSERT_EQUAL_I32(3, job.calls_);
+    ASSERT_EQUAL_I32(1, GetComponentData<Health>(m, entities[0])->value_);
+    ASSERT_EQUAL_I32(10, GetComponentData<Health>(m, entities[10])->value_);
+    ASSERT_EQUAL_I32(150, GetComponentData<Health>(m, entities[150])->value_);
+    ASSERT_EQUAL_I32(200, GetComponentData<Health>(m, entities[199])->value_);
+
+    // the enabled bits move with the entities
+    m.DestroyEntity(entities[11]); // entities[199] takes its place
+    ASSERT_TRUE(m.IsComponentEnabled<Health>(entities[199]));
+    m.DestroyEntity(entities[0]); // entities[198] takes its place
+    ASSERT_TRUE(m.IsComponentEnabled<Health>(entities[198]));
+
+    m.AddComponent<Rotation>(entities[12]);
+    ASSERT_FALSE(m.IsComponentEnabled<Health>(entities[12]));
+    m.RemoveComponent<Rotation>(entities[12]);
+    ASSERT_FALSE(m.IsComponentEnabled<Health>(entities[12]));
+
+    Entity copies[2];
+    m.Instantiate(entities[13], copies, 2);
+    ASSERT_FALSE(m.IsComponentEnabled<Health>(copies[0]));
+    ASSERT_FALSE(m.IsComponentEnabled<Health>(copies[1]));
+
+    // 200 entities, 12 of them (10 + 2 copies) turned off
+    ASSERT_EQUAL_I32(188, query->Count());
+
+    m.SetComponentEnabled<Health>(copies[0], true);
+    ASSERT_EQUAL_I32(189, query->Count());
+
+    world.Destroy();
+  }
+
+  // Toggle a component on and off, all transitions after the first one hit the archetype edge cache
+
+  World world;
+
+  world.Create(slice::FromArray(components));
+
+  auto   archetype = world.EntityManager().CreateArchetype({ GetComponentTypeId<Position>() });
+  Entity entity    = world.EntityManager().CreateEntity(archetype);
+
+  test_benchmark_set_chunk_iter(1000);
+
+  TEST_BENCHMARK("AddComponent/RemoveComponent") {
+    world.EntityManager().AddComponent<Rotation>(entity);
+    world.EntityManager().RemoveComponent<Rotation>(entity);
+  }
+
+  world.Destroy();
+
+  // The same structural change for 10k entities, one entity at a time and a chunk at a time
+
+  world.Create(slice::FromArray(components));
+
+  archetype = world.EntityManager().CreateArchetype({ GetComponentTypeId<Position>() });
+
+  const int bench_count    = 10 * 1000;
+  auto      bench_entities = MemAllocArray<Entity>(MEM_ALLOC_HEAP, bench_count);
+  world.EntityManager().CreateEntities(archetype, bench_entities, bench_count);
+
+  EntityQuery* query = world.EntityManager().CreateQuery({ ComponentDataAccess::Read<Position>() });
+
+  test_benchmark_set_chunk_iter(10);
+
+  TEST_BENCHMARK("AddComponent/RemoveComponent (10k entities)") {
+    for (int i = 0; i < bench_count; i++) {
+      world.EntityManager().AddComponent<Rotation>(bench_entities[i]);
+    }
+    for (int i = 0; i < bench_count; i++) {
+      world.EntityManager().RemoveComponent<Rotation>(bench_entities[i]);
+    }
+  }
+
+  TEST_BENCHMARK("AddComponent/RemoveComponent (batch, 10k entities)") {
+    world.EntityManager().AddComponent(bench_entities, bench_count, GetComponentTypeId<Rotation>());
+    world.EntityManager().RemoveComponent(bench_entities, bench_count, GetComponentTypeId<Rotation>());
+  }
+
+  TEST_BENCHMARK("AddComponent/RemoveComponent (query, 10k entities)") {
+    world.EntityManager().AddComponent<Rotation>(query);
+    world.EntityManager().RemoveComponent<Rotation>(query);
+  }
+
+  MemFree(MEM_ALLOC_HEAP, bench_entities);
+
+  world.Destroy();
+
+  // Spawn 100k copies of an entity and get rid of them again
+
+  world.Create(slice::FromArray(components));
+
+  archetype = world.EntityManager().CreateArchetype({ GetComponentTypeId<Position>(), GetComponentTypeId<Rotation>() });
+  query     = world.EntityManager().CreateQuery({ ComponentDataAccess::Read<Position>() });
+
+  Entity prefab = world.EntityManager().CreateEntity(archetype);
+
+  world.EntityManager().SetComponentData(prefab, Position{ { 1, 2, 3 } });
+  world.EntityManager().SetComponentData(prefab, Rotation{ { 0, 0, 1 }, 4 });
+
+  const int spawn_count    = 100 * 1000;
+  auto      spawn_entities = MemAllocArray<Entity>(MEM_ALLOC_HEAP, spawn_count);
+
+  TEST_BENCHMARK("CreateEntities + SetComponentData (100k entities)") {
+    world.EntityManager().CreateEntities(archetype, spawn_entities, spawn_count);
+    for (int i = 0; i < spawn_count; i++) {
+      world.EntityManager().SetComponentData(spawn_entities[i], Position{ { 1, 2, 3 } });
+      world.EntityManager().SetComponentData(spawn_entities[i], Rotation{ { 0, 0, 1 }, 4 });
+    }
+    world.EntityManager().DestroyEntities(spawn_entities, spawn_count);
+  }
+
+  TEST_BENCHMARK("Instantiate (100k entities)") {
+    world.EntityManager().Instantiate(prefab, spawn_entities, spawn_count);
+    world.EntityManager().DestroyEntities(spawn_entities, spawn_count);
+  }
+
+  // The destroy list of the benchmark above shuffled. A shuffled list still compacts each chunk once.
+
+  auto shuffle = MemAllocArray<int>(MEM_ALLOC_HEAP, spawn_count);
+  for (int i = 0; i < spawn_count; i++) {
+    shuffle[i] = i;
+  }
+  Shuffle(shuffle, spawn_count);
+
+  auto destroy_entities = MemAllocArray<Entity>(MEM_ALLOC_HEAP, spawn_count);
+
+  TEST_BENCHMARK("DestroyEntities (shuffled 100k entities)") {
+    world.EntityManager().Instantiate(prefab, spawn_entities, spawn_count);
+    for (int i = 0; i < spawn_count; i++) {
+      destroy_entities[i] = spawn_entities[shuffle[i]];
+    }
+    world.EntityManager().DestroyEntities(destroy_entities, spawn_count);
+  }
+
+  MemFree(MEM_ALLOC_HEAP, destroy_entities);
+  MemFree(MEM_ALLOC_HEAP, shuffle);
+  MemFree(MEM_ALLOC_HEAP, spawn_entities);
+
+  world.Destroy();
+
+  // Spawn 1M entities into a new world, the entity indices have never been used and are handed out in one run per
+  // chunk
+
+  const int bulk_count    = 1000 * 1000;
+  auto      bulk_entities = MemAllocArray<Entity>(MEM_ALLOC_HEAP, bulk_count);
+
+  test_benchmark_set_chunk_iter(1);
+
+  TEST_BENCHMARK("CreateEntities (1M entities)") {
+    world.Create(slice::FromArray(components));
+
+    archetype = world.EntityManager().CreateArchetype({ GetComponentTypeId<Position>() });
+    world.EntityManager().CreateEntities(archetype, bulk_entities, bulk_count);
+
+    world.Destroy();
+  }
+
+  MemFree(MEM_ALLOC_HEAP, bulk_entities);
+
+  test_benchmark_set_chunk_iter(10);
+
+  // Look up a component array in archetypes of 2, 8 and 32 component types. The component type that is looked up comes
+  // last in the archetype, the cost of the lookup should not depend on the width.
+
+  TypeInfo wide_components[Wide::COMPONENT_TYPE + 1];
+
+  wide_components[0] = GAME_COMPONENT(Entity);
+  for (int i = 1; i < Wide::COMPONENT_TYPE; i++) {
+    wide_components[i] = { ComponentTypeId{ u32(i) }, 4, 4, "Filler", 0, 0 };
+  }
+  wide_components[Wide::COMPONENT_TYPE] = GAME_COMPONENT(Wide);
+
+  auto create_wide_query = [&world, &wide_components](int width) {
+    world.Create(slice::FromArray(wide_components).Const());
+
+    ComponentTypeId types[Wide::COMPONENT_TYPE];
+    for (int i = 0; i < width - 2; i++) {
+      types[i] = ComponentTypeId{ u32(i + 1) };
+    }
+    types[width - 2] = GetComponentTypeId<Wide>();
+
+    Archetype* wide_archetype = world.EntityManager().CreateArchetype({ types, width - 1, width - 1 });
+
+    const int count    = 10 * 1000;
+    auto      entities = MemAllocArray<Entity>(MEM_ALLOC_HEAP, count);
+    world.EntityManager().CreateEntities(wide_archetype, entities, count);
+    MemFree(MEM_ALLOC_HEAP, entities);
+
+    return world.EntityManager().CreateQuery({ ComponentDataAccess::Read<Wide>() });
+  };
+
+  SumWideJob wide_job = {};
+
+  test_benchmark_set_chunk_iter(100);
+
+  query = create_wide_query(2);
+
+  TEST_BENCHMARK("GetArray (archetype width 2, 10k entities)") {
+    System::ExecuteJob(query, wide_job, SumWideJob::Kernel);
+  }
+
+  world.Destroy();
+
+  query = create_wide_query(8);
+
+  TEST_BENCHMARK("GetArray (archetype width 8, 10k entities)") {
+    System::ExecuteJob(query, wide_job, SumWideJob::Kernel);
+  }
+
+  world.Destroy();
+
+  query = create_wide_query(32);
+
+  TEST_BENCHMARK("GetArray (archetype width 32, 10k entities)") {
+    System::ExecuteJob(query, wide_job, SumWideJob::Kernel);
+  }
+
+  world.Destroy();
+
+  // Match a query with all, any and none component types against 4k archetypes, one per combination of 12 fillers
+
+  world.Create(slice::FromArray(wide_components).Const());
+
+  const int match_count = 1 << 12;
+  for (int i = 0; i < match_count; i++) {
+    ComponentTypeId types[12];
+    int             types_len = 0;
+    for (int j = 0; j < 12; j++) {
+      if (i & (1 << j)) {
+        types[types_len++] = ComponentTypeId{ u32(j + 1) };
+      }
+    }
+    world.EntityManager().CreateArchetype({ types, types_len, types_len });
+  }
+
+  const ComponentDataAccess match_desc[] = {
+    { ComponentTypeId{ 1 }, ComponentDataAccess::READ_ONLY },
+    { ComponentTypeId{ 2 }, ComponentDataAccess::ANY_READ_ONLY },
+    { ComponentTypeId{ 3 }, ComponentDataAccess::ANY_READ_ONLY },
+    { ComponentTypeId{ 4 }, ComponentDataAccess::EXCLUDE },
+  };
+
+  query = world.EntityManager().CreateQuery(match_desc, 4);
+
+  ASSERT_EQUAL_I32(match_count / 2 * 3 / 4 / 2, query->matching_archetypes_.Len());
+
+  int match_result = 0;
+
+  TEST_BENCHMARK("IsMatch (4k archetypes)") {
+    for (auto archetype : world.EntityManager().archetypes_.list_) {
+      match_result += query->IsMatch(archetype);
+    }
+  }
+
+  world.Destroy();
 }
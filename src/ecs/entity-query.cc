@@ -1,67 +1,132 @@
 #include "entity-query.hh"
 
 #include "archetype.hh"
+#include "entity-manager.hh"
 
 #include "../common/hash.hh"
 
 using namespace game;
 
-namespace {
-// Both query and archetype are sorted
-// Look for all the query component types in the archetype and if all of them are found return true otherwise false
-bool MergeJoinAll(const ComponentTypeId* query, i32 query_len, const ComponentTypeId* archetype, i32 archetype_len) {
-  int i = 0, j = 0, k = 0;
-  for (; i < query_len && j < archetype_len;) {
-    if (query[i] < archetype[j]) {
-      i++;
-      continue;
+bool EntityQuery::IsMatch(Archetype* archetype) {
+  assert(archetype->type_mask_words_ == type_mask_words_);
+
+  // The masks are padded to the SIMD width, 256 component types are tested at a time. vptest gives both (a & b) == 0
+  // (testz) and (~a & b) == 0 (testc).
+  bool any = any_len_ == 0;
+  for (i32 w = 0; w < type_mask_words_; w += 4) {
+    const __m256i types = _mm256_loadu_si256((const __m256i*)(archetype->type_mask_ + w));
+    if (!_mm256_testc_si256(types, _mm256_loadu_si256((const __m256i*)(all_type_mask_ + w)))) {
+      return false;
     }
-    if (archetype[j] < query[i]) {
-      j++;
-      continue;
+    if (!_mm256_testz_si256(types, _mm256_loadu_si256((const __m256i*)(none_type_mask_ + w)))) {
+      return false;
     }
-    if (query[i] == archetype[j]) {
-      i++;
-      j++;
-      k++;
-      continue;
+    any |= !_mm256_testz_si256(types, _mm256_loadu_si256((const __m256i*)(any_type_mask_ + w)));
+  }
+  return any;
+}
+
+void EntityQuery::_AddMatchingArchetype(Archetype* archetype) {
+  matching_archetypes_.Add(archetype);
+  archetype->matching_queries_.Add(this);
+
+  for (i32 c = 0; c < _ColumnCount(); c++) {
+    const i32 i = archetype->_TypeIndex(_ColumnType(c));
+    if (i == -1) {
+      matching_archetype_columns_.Add({ -1, 0, 0 });
+    } else {
+      matching_archetype_columns_.Add({ i, archetype->offsets_[i], archetype->sizes_[i] });
     }
-    return false; // all not found in archetype
   }
-  return k == query_len;
 }
 
-// bool MergeJoinAny(const ComponentTypeId* query, i32 query_len, const ComponentTypeId* archetype, i32 archetype_len) {
-//   int i = 0, j = 0;
-//   for (; i < query_len && j < archetype_len;) {
-//     if (query[i] < archetype[j]) {
-//       i++;
-//       continue;
-//     }
-//     if (archetype[j] < query[i]) {
-//       j++;
-//       continue;
-//     }
-//     if (query[i] == archetype[j]) {
-//       return true;
-//     }
-//   }
-//   return false;
-// }
-} // namespace
+bool EntityQuery::_IsChunkMatch(const Archetype* archetype, i32 chunk_index) const {
+  if (!(shared_filter_type_ == GetComponentTypeId<Entity>())) {
+    const i32 k = archetype->_SharedComponentIndex(shared_filter_type_);
+    if (!((k != -1) && (archetype->chunk_data_.SharedValueArray(k)[chunk_index] == shared_filter_value_))) {
+      return false;
+    }
+  }
 
-bool EntityQuery::IsMatch(Archetype* archetype) {
-  // required components
-  bool all = MergeJoinAll(all_, all_len_, archetype->types_, archetype->types_len_);
-  if (all) {
-    // optional components
-    // if (0 < any_len_) {
-    //   bool any = MergeJoinAny(any_, any_len_, archetype->types_, archetype->types_len_);
-    //   return any;
-    // }
-    return true;
+  if (0 < change_filter_len_) {
+    // The filtered types that the archetype doesn't have are skipped
+    const u32 version = entity_manager_->last_system_version_;
+    for (i32 f = 0; f < change_filter_len_; f++) {
+      const i32 i = archetype->_TypeIndex(change_filter_types_[f]);
+      if (i != -1 && DidChange(archetype->chunk_data_.ChangeVersionArray(i)[chunk_index], version)) {
+        return true;
+      }
+    }
+    return false;
   }
-  return false;
+
+  return true;
+}
+
+i32 EntityQuery::_EnabledMask(const EntityQueryChunk& chunk, u64* mask) const {
+  if (all_enableable_len_ == 0) {
+    return chunk.entity_count_;
+  }
+
+  const ArchetypeChunkData& chunk_data = chunk.archetype_->chunk_data_;
+
+  // Every matching archetype has the enableable component types of all_
+  auto bits = MemStackalloc(const u64*, all_enableable_len_, all_enableable_len_);
+  for (i32 k = 0; k < all_enableable_len_; k++) {
+    const i32 i = chunk.archetype_->_EnableableComponentIndex(all_enableable_[k]);
+    bits[k]     = chunk_data.EnabledBits(i, chunk.chunk_index_);
+  }
+
+  // The bits of a chunk are padded to the SIMD width and the bits beyond the entity count are clear, the mask is built
+  // 256 bits at a time. The bitwise AND of the pd variant is used because it only needs AVX.
+  const i32 words = i32(MemAlign(chunk.entity_count_, 256)) / 64;
+
+  i32 count = 0;
+  for (i32 w = 0; w < words; w += 4) {
+    __m256d m = _mm256_loadu_pd((const double*)(bits[0] + w));
+    for (i32 k = 1; k < all_enableable_len_; k++) {
+      m = _mm256_and_pd(m, _mm256_loadu_pd((const double*)(bits[k] + w)));
+    }
+
+    u64 m4[4];
+    _mm256_storeu_pd((double*)m4, m);
+
+    count += i32(popcnt_u64(m4[0]) + popcnt_u64(m4[1]) + popcnt_u64(m4[2]) + popcnt_u64(m4[3]));
+    if (mask != nullptr) {
+      MemCopy(mask + w, m4, i32(sizeof(m4)));
+    }
+  }
+  return count;
+}
+
+void EntityQuery::_UpdateChunkCache() {
+  const u32 version = entity_manager_->structural_change_version_;
+  if (matching_chunks_version_ == version) {
+    return;
+  }
+
+  i32 chunk_count = 0;
+  for (auto archetype : matching_archetypes_) {
+    chunk_count += archetype->chunk_data_.Len();
+  }
+
+  if (matching_chunks_.Cap() < chunk_count) {
+    matching_chunks_.SetCapacity(Max(2 * matching_chunks_.Cap(), chunk_count));
+  }
+  matching_chunks_.Resize(chunk_count);
+
+  i32 k = 0;
+  for (i32 a = 0; a < matching_archetypes_.Len(); a++) {
+    Archetype*                archetype  = matching_archetypes_[a];
+    const ArchetypeChunkData& chunk_data = archetype->chunk_data_;
+    for (i32 i = 0; i < chunk_data.Len(); i++, k++) {
+      matching_chunks_[k] = {
+        chunk_data.ChunkPtrArray()[i], archetype, i, chunk_data.EntityCountArray()[i], _ArchetypeColumns(a)
+      };
+    }
+  }
+
+  matching_chunks_version_ = version;
 }
 
 u32 EntityQuery::HashCode() {
@@ -78,6 +143,9 @@ u32 EntityQuery::HashCode() {
   h.Update(None());
   h.Update(NoneAccessMode());
 
+  h.Update(&shared_filter_type_, i32(sizeof(shared_filter_type_)));
+  h.Update(&shared_filter_value_, i32(sizeof(shared_filter_value_)));
+
   return h.Digest();
 }
 
@@ -101,17 +169,19 @@ bool EntityQuery::Equals(const EntityQuery& other) {
     if (memcmp(this->none_access_mode_, other.none_access_mode_, size_t(none_len_)) != 0) {
       return false;
     }
-    return true;
+    return (this->shared_filter_type_ == other.shared_filter_type_)
+           & (this->shared_filter_value_ == other.shared_filter_value_);
   }
   return false;
 }
 
 i32 EntityQuery::Count() {
+  _UpdateChunkCache();
+
   i32 c = 0;
-  for (auto archetype : matching_archetypes_) {
-    Chunk** chunks = archetype->chunk_data_.ChunkPtrArray();
-    for (i32 i = 0, n = archetype->chunk_data_.Len(); i < n; i++) {
-      c += chunks[i]->EntityCount();
+  for (const auto& chunk : matching_chunks_) {
+    if (_IsChunkMatch(chunk.archetype_, chunk.chunk_index_)) {
+      c += _EnabledMask(chunk, nullptr);
     }
   }
   return c;
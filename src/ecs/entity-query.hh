@@ -1,6 +1,7 @@
 #pragma once
 
 #include "../common/entity.hh"
+#include "../common/intrin.hh"
 #include "../common/list.hh"
 
 namespace game {
@@ -17,6 +18,7 @@ struct ComponentDataAccess {
     ANY_READ_ONLY   = ANY | READ_ONLY,
     ANY_READ_WRITE  = ANY | READ_WRITE,
     EXCLUDE         = 4, // None of the component types in this array can exist in the archetype
+    CHANGE_FILTER   = 8, // Only chunks where this component type has changed are matched (see WithChangeFilter)
   };
 
   ComponentTypeId type_id_;
@@ -26,6 +28,16 @@ struct ComponentDataAccess {
 
   bool Exclude() const { return (access_mode_ & EXCLUDE) == EXCLUDE; }
 
+  bool ChangeFilter() const { return (access_mode_ & CHANGE_FILTER) == CHANGE_FILTER; }
+
+  // Only chunks where at least one of the change filtered component types has changed since the system that is being
+  // updated last ran are matched. The filter is part of the query, a filtered query is not the same query as the
+  // unfiltered one.
+  ComponentDataAccess WithChangeFilter() const {
+    assert(!Exclude());
+    return ComponentDataAccess{ type_id_, Mode(access_mode_ | CHANGE_FILTER) };
+  }
+
   template <typename T> static ComponentDataAccess Read() {
     return ComponentDataAccess{ GetComponentTypeId<T>(), READ_ONLY };
   }
@@ -62,6 +74,50 @@ struct EntityQueryMask {
   EntityManager* entity_manager_; // ???
 };
 
+// Where the component array of a query column is found in the chunks of a matching archetype
+struct EntityQueryColumn {
+  i32 type_index_; // The index of the component type in the archetype, -1 if the archetype doesn't have it
+  i32 offset_;     // The offset of the component array in the chunk buffer
+  i32 size_;       // The size of one component in the array
+};
+
+// A chunk of a matching archetype in the chunk cache of a query
+struct EntityQueryChunk {
+  Chunk*                   chunk_;
+  Archetype*               archetype_;
+  i32                      chunk_index_;  // The index of the chunk in the chunk data of the archetype (for filters)
+  i32                      entity_count_;
+  const EntityQueryColumn* columns_;      // The column table of the archetype (see EntityQuery::_ArchetypeColumns)
+};
+
+// The index of the first bit at or after from (from < len) that has value, len if there is none
+inline i32 FindBit(const u64* mask, i32 from, i32 len, bool value) {
+  const u64 flip = value ? 0 : ~0ULL;
+  for (i32 w = from / 64; w * 64 < len; w++) {
+    u64 bits = mask[w] ^ flip;
+    if (w == from / 64) {
+      bits &= ~0ULL << (from & 63);
+    }
+    if (bits != 0) {
+      return Min(len, w * 64 + i32(tzcnt_u64(bits)));
+    }
+  }
+  return len;
+}
+
+// Call fn(begin, end) for each run of set bits within the first len bits of the mask
+template <typename F> void ForEachBitRun(const u64* mask, i32 len, F fn) {
+  for (i32 i = 0; i < len;) {
+    const i32 begin = FindBit(mask, i, len, true);
+    if (begin == len) {
+      break;
+    }
+    const i32 end = FindBit(mask, begin, len, false);
+    fn(begin, end);
+    i = end;
+  }
+}
+
 // An entity query is an expression of a data dependency.
 struct EntityQuery {
   ComponentTypeId*           all_;
@@ -88,29 +144,102 @@ struct EntityQuery {
 
   Slice<ComponentDataAccess::Mode> NoneAccessMode() { return { none_access_mode_, none_len_, none_len_ }; }
 
+  // all_, any_ and none_ as component type masks (see ComponentRegistry::TypeMaskWords)
+  u64* all_type_mask_;
+  u64* any_type_mask_;
+  u64* none_type_mask_;
+  i32  type_mask_words_;
+
+  // The enableable component types of all_. An entity is only matched if these components are enabled.
+  ComponentTypeId* all_enableable_;
+  i32              all_enableable_len_;
+
   EntityQueryMask mask_;
 
+  EntityManager* entity_manager_; // The entity manager that created the query
+
   List<Archetype*> matching_archetypes_;
-  List<Chunk*>     matching_chunks_; // the chunk cache is rebuilt when the cache has been invalidated
+
+  // The columns of the query are the component types of all_ followed by those of any_. Every matching archetype has a
+  // column table that tells where each column is found in its chunks so that a component array is found with one
+  // lookup, however many component types the archetype has.
+  i16*                    column_by_type_;             // The column of every registered component type (or -1)
+  i32                     column_by_type_len_;         // The number of registered component types
+  List<EntityQueryColumn> matching_archetype_columns_; // The column tables in the order of matching_archetypes_
+
+  // The chunk cache, all chunks of the matching archetypes in one array. The cache is rebuilt when the structural
+  // change version of the entity manager has moved. Filters are not applied to the cache, they are checked when the
+  // cache is iterated.
+  List<EntityQueryChunk> matching_chunks_;
+  u32                    matching_chunks_version_; // The structural change version the cache was built for
+
+  // Only chunks with this shared component value are matched (no filter when the type is Entity). The filter is part
+  // of the query, it is set up when the query is created (see EntityManager::WithSharedComponentFilter) and never
+  // changes.
+  ComponentTypeId shared_filter_type_;
+  i32             shared_filter_value_;
+
+  // Only chunks where at least one of these component types has changed since the system that is being updated last
+  // ran are matched (see EntityManager::last_system_version_). Adding or removing entities counts as a change. The
+  // change filter is set up from the query descriptor (see ComponentDataAccess::WithChangeFilter) and never changes.
+  static const i32 CHANGE_FILTER_MAX = 4;
+  ComponentTypeId  change_filter_types_[CHANGE_FILTER_MAX];
+  i32              change_filter_len_;
 
   // ---
 
   void Destroy() {
     matching_archetypes_.Destroy();
+    matching_archetype_columns_.Destroy();
     matching_chunks_.Destroy();
   }
 
   // ---
 
+  // The archetype has all of all_, at least one of any_ (unless any_ is empty) and none of none_
   bool IsMatch(Archetype* archetype);
 
+  // Add an archetype that matches the query and build its column table
+  void _AddMatchingArchetype(Archetype* archetype);
+
+  void _AddChangeFilter(ComponentTypeId type_id) {
+    assert(change_filter_len_ < CHANGE_FILTER_MAX);
+    change_filter_types_[change_filter_len_++] = type_id;
+  }
+
+  // Does the chunk at chunk_index of a matching archetype pass the filter. Only chunk metadata is read.
+  bool _IsChunkMatch(const Archetype* archetype, i32 chunk_index) const;
+
+  // The entities of a chunk in the chunk cache that have all of the enableable components of the query enabled. The
+  // return value is the number of entities, if mask is not null the entities are written to it as a bitmask of
+  // ArchetypeChunkData::EnabledWords() words. The mask is not written when the query has no enableable components.
+  i32 _EnabledMask(const EntityQueryChunk& chunk, u64* mask) const;
+
+  // Rebuild the chunk cache if anything structural has changed since it was built
+  void _UpdateChunkCache();
+
+  // The number of columns (one per all and any component type)
+  i32 _ColumnCount() const { return all_len_ + any_len_; }
+
+  ComponentTypeId _ColumnType(i32 column) const { return column < all_len_ ? all_[column] : any_[column - all_len_]; }
+
+  // The column of a component type, -1 if the component type is not in all_ or any_
+  i32 _ColumnIndex(ComponentTypeId type_id) const {
+    return type_id.Index() < column_by_type_len_ ? column_by_type_[type_id.Index()] : -1;
+  }
+
+  // The column table of the matching archetype at archetype_index (an index into matching_archetypes_)
+  const EntityQueryColumn* _ArchetypeColumns(i32 archetype_index) const {
+    return matching_archetype_columns_.ptr_ + archetype_index * _ColumnCount();
+  }
+
   // ---
 
   u32 HashCode();
 
   bool Equals(const EntityQuery& other);
 
-  // count the number of entities matched by query
+  // count the number of entities matched by query (and filter)
   i32 Count();
 };
 } // namespace game
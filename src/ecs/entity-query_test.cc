@@ -2,6 +2,7 @@
 
 #include "entity-query.hh"
 
+#include "system.hh"
 #include "world.hh"
 
 using namespace game;
@@ -25,6 +26,23 @@ struct LocalToWorld {
 
   float m_[16];
 };
+
+// Remember where the kernel finds the component arrays of the first chunk
+struct ColumnLookupJob {
+  ComponentDataReader<Entity>   entities_;
+  ComponentDataReader<Position> positions_;
+  ComponentDataReader<Rotation> rotations_;
+  const void*                   arrays_[3];
+  int                           calls_;
+
+  static void Kernel(ColumnLookupJob& job, const SystemChunk& chunk) {
+    if (job.calls_++ == 0) {
+      job.arrays_[0] = chunk.GetArray(job.entities_);
+      job.arrays_[1] = chunk.GetArray(job.positions_);
+      job.arrays_[2] = chunk.GetArray(job.rotations_);
+    }
+  }
+};
 } // namespace
 
 int main(int argc, char* argv[]) {
@@ -70,4 +88,219 @@ int main(int argc, char* argv[]) {
 
     world.Destroy();
   }
+
+  TEST_CASE("AnyNoneQueryTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    Archetype* p   = m.CreateArchetype({ GetComponentTypeId<Position>() });
+    Archetype* pr  = m.CreateArchetype({ GetComponentTypeId<Position>(), GetComponentTypeId<Rotation>() });
+    Archetype* pl  = m.CreateArchetype({ GetComponentTypeId<Position>(), GetComponentTypeId<LocalToWorld>() });
+    Archetype* prl = m.CreateArchetype(
+        { GetComponentTypeId<Position>(), GetComponentTypeId<Rotation>(), GetComponentTypeId<LocalToWorld>() });
+
+    EntityQuery* none =
+        m.CreateQuery({ ComponentDataAccess::Read<Position>(), ComponentDataAccess::Exclude<LocalToWorld>() });
+    ASSERT_EQUAL_I32(2, none->matching_archetypes_.Len());
+    ASSERT_TRUE(none->IsMatch(p));
+    ASSERT_TRUE(none->IsMatch(pr));
+
+    EntityQuery* any =
+        m.CreateQuery({ ComponentDataAccess::ReadAny<Rotation>(), ComponentDataAccess::ReadAny<LocalToWorld>() });
+    ASSERT_EQUAL_I32(3, any->matching_archetypes_.Len());
+    ASSERT_FALSE(any->IsMatch(p));
+
+    EntityQuery* all = m.CreateQuery({ ComponentDataAccess::Read<Position>(),
+                                       ComponentDataAccess::ReadAny<Rotation>(),
+                                       ComponentDataAccess::Exclude<LocalToWorld>() });
+    ASSERT_EQUAL_I32(1, all->matching_archetypes_.Len());
+    ASSERT_EQUAL_PTR(pr, all->matching_archetypes_[0]);
+    ASSERT_FALSE(all->IsMatch(pl));
+    ASSERT_FALSE(all->IsMatch(prl));
+
+    // archetypes that are created later are matched the same way
+    Archetype* r = m.CreateArchetype({ GetComponentTypeId<Rotation>() });
+    ASSERT_EQUAL_I32(4, any->matching_archetypes_.Len());
+    ASSERT_EQUAL_I32(2, none->matching_archetypes_.Len());
+    ASSERT_EQUAL_PTR(r, any->matching_archetypes_[3]);
+
+    world.Destroy();
+  }
+
+  TEST_CASE("QueryIndexTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    // queries that exist before the archetypes do
+    EntityQuery* all = m.CreateQuery({ ComponentDataAccess::Read<Position>(), ComponentDataAccess::Read<Rotation>() });
+    EntityQuery* any =
+        m.CreateQuery({ ComponentDataAccess::ReadAny<Rotation>(), ComponentDataAccess::ReadAny<LocalToWorld>() });
+    EntityQuery* none = m.CreateQuery({ ComponentDataAccess::Exclude<Position>() });
+
+    // the all query is found under one of its types, the any query under each of them
+    const int position_len = m.queries_by_type_[GetComponentTypeId<Position>().Index()].Len();
+    const int rotation_len = m.queries_by_type_[GetComponentTypeId<Rotation>().Index()].Len();
+    ASSERT_EQUAL_I32(2, position_len + rotation_len);
+    ASSERT_EQUAL_I32(1, m.queries_by_type_[GetComponentTypeId<LocalToWorld>().Index()].Len());
+    ASSERT_EQUAL_I32(1, m.unindexed_queries_.Len());
+    ASSERT_EQUAL_PTR(none, m.unindexed_queries_[0]);
+
+    // the entity only archetype was there first
+    ASSERT_EQUAL_I32(1, none->matching_archetypes_.Len());
+
+    // the any query is a candidate twice but the archetype is added once
+    Archetype* prl = m.CreateArchetype(
+        { GetComponentTypeId<Position>(), GetComponentTypeId<Rotation>(), GetComponentTypeId<LocalToWorld>() });
+    ASSERT_EQUAL_I32(1, all->matching_archetypes_.Len());
+    ASSERT_EQUAL_I32(1, any->matching_archetypes_.Len());
+    ASSERT_EQUAL_PTR(prl, any->matching_archetypes_[0]);
+    ASSERT_EQUAL_I32(1, none->matching_archetypes_.Len());
+
+    Archetype* l = m.CreateArchetype({ GetComponentTypeId<LocalToWorld>() });
+    ASSERT_EQUAL_I32(1, all->matching_archetypes_.Len());
+    ASSERT_EQUAL_I32(2, any->matching_archetypes_.Len());
+    ASSERT_EQUAL_I32(2, none->matching_archetypes_.Len());
+    ASSERT_EQUAL_PTR(l, none->matching_archetypes_[1]);
+
+    m.CreateArchetype({ GetComponentTypeId<Position>() });
+    ASSERT_EQUAL_I32(1, all->matching_archetypes_.Len());
+    ASSERT_EQUAL_I32(2, any->matching_archetypes_.Len());
+    ASSERT_EQUAL_I32(2, none->matching_archetypes_.Len());
+
+    world.Destroy();
+  }
+
+  TEST_CASE("ChunkCacheTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    Archetype* archetype1 = m.CreateArchetype({ GetComponentTypeId<Position>(), GetComponentTypeId<Rotation>() });
+    Archetype* archetype2 = m.CreateArchetype({ GetComponentTypeId<Position>(), GetComponentTypeId<LocalToWorld>() });
+
+    Entity entities[3];
+    m.CreateEntities(archetype1, entities, 2);
+    m.CreateEntities(archetype2, entities + 2, 1);
+
+    EntityQuery* q = m.CreateQuery({ ComponentDataAccess::Read<Position>(),
+                                     ComponentDataAccess::ReadAny<Rotation>(),
+                                     ComponentDataAccess::ReadAny<LocalToWorld>() });
+
+    ASSERT_EQUAL_I32(3, q->Count());
+    ASSERT_EQUAL_I32(2, q->matching_chunks_.Len());
+    ASSERT_EQUAL_I32(3, q->_ColumnCount());
+
+    // the component arrays are found up front, the archetype without rotation has no rotation column
+    for (int i = 0; i < 2; i++) {
+      const EntityQueryChunk&  chunk   = q->matching_chunks_[i];
+      const EntityQueryColumn* columns = chunk.columns_;
+      ASSERT_EQUAL_I32(chunk.archetype_->offsets_[1], columns[0].offset_);
+      ASSERT_TRUE((columns[1].type_index_ != -1) == (chunk.archetype_ == archetype1));
+      ASSERT_EQUAL_I32(chunk.archetype_ == archetype1 ? 2 : 1, chunk.entity_count_);
+    }
+
+    // writing component data isn't a structural change, the cache is kept
+    const u32 version = q->matching_chunks_version_;
+    m.SetComponentData(entities[0], Position{ { 1, 2, 3 } });
+    ASSERT_EQUAL_I32(3, q->Count());
+    ASSERT_EQUAL_U32(version, q->matching_chunks_version_);
+
+    // destroying an entity is
+    m.DestroyEntity(entities[1]);
+    ASSERT_EQUAL_I32(2, q->Count());
+    ASSERT_TRUE(q->matching_chunks_version_ != version);
+
+    m.DestroyEntity(entities[2]);
+    ASSERT_EQUAL_I32(1, q->Count());
+    ASSERT_EQUAL_I32(1, q->matching_chunks_.Len());
+
+    world.Destroy();
+  }
+
+  TEST_CASE("ColumnLookupTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    Archetype* archetype = m.CreateArchetype(
+        { GetComponentTypeId<Position>(), GetComponentTypeId<Rotation>(), GetComponentTypeId<LocalToWorld>() });
+
+    m.CreateEntity(archetype);
+
+    EntityQuery* q = m.CreateQuery({ ComponentDataAccess::Read<Rotation>(), ComponentDataAccess::ReadAny<Position>() });
+
+    // all_ comes before any_, component types that are not in the query have no column
+    ASSERT_EQUAL_I32(0, q->_ColumnIndex(GetComponentTypeId<Rotation>()));
+    ASSERT_EQUAL_I32(1, q->_ColumnIndex(GetComponentTypeId<Position>()));
+    ASSERT_EQUAL_I32(-1, q->_ColumnIndex(GetComponentTypeId<LocalToWorld>()));
+
+    const EntityQueryColumn* columns = q->_ArchetypeColumns(0);
+    ASSERT_EQUAL_I32(2, columns[0].type_index_);
+    ASSERT_EQUAL_I32(archetype->offsets_[2], columns[0].offset_);
+    ASSERT_EQUAL_I32(int(sizeof(Rotation)), columns[0].size_);
+    ASSERT_EQUAL_I32(1, columns[1].type_index_);
+
+    // the kernel gets the same arrays through the column table as through the archetype (Entity is not in the query)
+    ColumnLookupJob job = {};
+    System::ExecuteJob(q, job, ColumnLookupJob::Kernel);
+
+    Chunk* chunk = archetype->chunk_data_.ChunkPtrArray()[0];
+    ASSERT_EQUAL_I32(1, job.calls_);
+    ASSERT_EQUAL_PTR(chunk->EntityArray(), job.arrays_[0]);
+    ASSERT_EQUAL_PTR((byte*)chunk->Buffer() + archetype->offsets_[1], job.arrays_[1]);
+    ASSERT_EQUAL_PTR((byte*)chunk->Buffer() + archetype->offsets_[2], job.arrays_[2]);
+
+    world.Destroy();
+  }
+
+  TEST_CASE("ChangeFilterTest") {
+    World world;
+
+    world.Create(slice::FromArray(components));
+
+    EntityManager& m = world.EntityManager();
+
+    Archetype* archetype1 = m.CreateArchetype({ GetComponentTypeId<Position>(), GetComponentTypeId<Rotation>() });
+    Archetype* archetype2 = m.CreateArchetype({ GetComponentTypeId<Position>() });
+
+    Entity a = m.CreateEntity(archetype1);
+    m.CreateEntity(archetype2);
+
+    EntityQuery* q = m.CreateQuery(
+        { ComponentDataAccess::ReadAny<Position>(), ComponentDataAccess::ReadAny<Rotation>().WithChangeFilter() });
+
+    // the filter is part of the query, the same query without the filter is another query
+    EntityQuery* unfiltered =
+        m.CreateQuery({ ComponentDataAccess::ReadAny<Position>(), ComponentDataAccess::ReadAny<Rotation>() });
+    ASSERT_TRUE(q != unfiltered);
+    ASSERT_EQUAL_I32(0, unfiltered->change_filter_len_);
+
+    // outside of a system update everything counts as changed, archetypes without the filtered type never pass
+    ASSERT_EQUAL_I32(1, q->Count());
+
+    // a system that ran after the entities were created sees no change
+    m.global_system_version_++;
+    m.last_system_version_ = m.global_system_version_ - 1;
+    ASSERT_EQUAL_I32(0, q->Count());
+
+    m.SetComponentData(a, Position{ { 1, 2, 3 } });
+    ASSERT_EQUAL_I32(0, q->Count()); // not a filtered type
+
+    m.SetComponentData(a, Rotation{ { 0, 0, 1 }, 1 });
+    ASSERT_EQUAL_I32(1, q->Count());
+
+    ASSERT_EQUAL_I32(2, unfiltered->Count());
+
+    world.Destroy();
+  }
 }
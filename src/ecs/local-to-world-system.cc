@@ -71,13 +71,21 @@ void TRS_LocalToWorldJobKernel(TRS_LocalToWorldJobData& data, const SystemChunk&
 } // namespace
 
 void TRS_LocalToWorldSystem::OnCreate(SystemState& state) {
-  q_ = state.EntityManager().CreateQuery({ ComponentDataAccess::Write<LocalToWorld>(),
-                                           ComponentDataAccess::ReadAny<Translation>(),
-                                           ComponentDataAccess::ReadAny<Rotation>(),
-                                           ComponentDataAccess::ReadAny<Scale>() });
+  // Most transforms are static, only chunks where the inputs have changed are recomputed. LocalToWorld is part of the
+  // filter so that chunks without any inputs (identity) are computed when entities are added to them.
+  q_ = state.EntityManager().CreateQuery({ ComponentDataAccess::Write<LocalToWorld>().WithChangeFilter(),
+                                           ComponentDataAccess::ReadAny<Translation>().WithChangeFilter(),
+                                           ComponentDataAccess::ReadAny<Rotation>().WithChangeFilter(),
+                                           ComponentDataAccess::ReadAny<Scale>().WithChangeFilter() });
+
+  identity_q_ = state.EntityManager().CreateQuery({ ComponentDataAccess::Write<LocalToWorld>().WithChangeFilter(),
+                                                    ComponentDataAccess::Exclude<Translation>(),
+                                                    ComponentDataAccess::Exclude<Rotation>(),
+                                                    ComponentDataAccess::Exclude<Scale>() });
 }
 
 void TRS_LocalToWorldSystem::OnUpdate(SystemState& state) {
   TRS_LocalToWorldJobData data{};
   ExecuteJob(q_, data, TRS_LocalToWorldJobKernel);
+  ExecuteJob(identity_q_, data, TRS_LocalToWorldJobKernel);
 }
\ No newline at end of file
@@ -9,6 +9,7 @@ struct EntityQuery;
 
 struct TRS_LocalToWorldSystem : public System {
   EntityQuery* q_;
+  EntityQuery* identity_q_; // Entities with a LocalToWorld but no translation, rotation or scale
 
   void OnCreate(SystemState& state) override;
 
@@ -29,10 +29,17 @@ int main(int argc, char* argv[]) {
         GetComponentTypeId<Scale>(),
     });
 
+    Archetype* identity = world.EntityManager().CreateArchetype({
+        GetComponentTypeId<LocalToWorld>(),
+    });
+
     world.EntityManager().CreateEntity(t);
     world.EntityManager().CreateEntity(r);
     world.EntityManager().CreateEntity(s);
 
+    Entity e = world.EntityManager().CreateEntity(identity);
+    world.EntityManager().SetComponentData(e, LocalToWorld{});
+
     SystemState state;
     MemZeroInit(&state);
     state.entity_manger_ = world.entity_manager_;
@@ -44,6 +51,48 @@ int main(int argc, char* argv[]) {
     transform_system.OnUpdate(state);
     transform_system.OnDestroy(state);
 
+    // without translation, rotation or scale the entity gets the identity transform
+    Chunk*        chunk          = world.EntityManager()._Record(e.index_).chunk_;
+    LocalToWorld* local_to_world = (LocalToWorld*)((byte*)chunk->Buffer() + identity->offsets_[1]);
+    ASSERT_TRUE(local_to_world->value_.c0.x == 1);
+    ASSERT_TRUE(local_to_world->value_.c3.w == 1);
+
+    world.Destroy();
+  }
+
+  TEST_CASE("SystemChangeFilterTest") {
+    World world;
+
+    world.Create(GetComponentTypeInfoArray());
+
+    EntityManager& m = world.EntityManager();
+
+    Archetype* archetype = m.CreateArchetype({
+        GetComponentTypeId<LocalToWorld>(),
+        GetComponentTypeId<Translation>(),
+    });
+
+    Entity entity = m.CreateEntity(archetype);
+    m.SetComponentData(entity, Translation{ { 1, 2, 3 } });
+
+    TRS_LocalToWorldSystem transform_system{};
+
+    world.Register(&transform_system);
+    world.Update();
+
+    Chunk*        chunk          = m._Record(entity.index_).chunk_;
+    LocalToWorld* local_to_world = (LocalToWorld*)((byte*)chunk->Buffer() + archetype->offsets_[1]);
+    ASSERT_TRUE(local_to_world->value_.c3.x == 1);
+
+    // the translation hasn't changed, the chunk is skipped
+    local_to_world->value_.c3.x = 100;
+    world.Update();
+    ASSERT_TRUE(local_to_world->value_.c3.x == 100);
+
+    m.SetComponentData(entity, Translation{ { 4, 5, 6 } });
+    world.Update();
+    ASSERT_TRUE(local_to_world->value_.c3.x == 4);
+
     world.Destroy();
   }
 }
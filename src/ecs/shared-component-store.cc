@@ -0,0 +1,74 @@
+#include "shared-component-store.hh"
+
+using namespace game;
+
+namespace {
+bool IsZero(const void* data, i32 size) {
+  for (i32 i = 0; i < size; i++) {
+    if (((const byte*)data)[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+} // namespace
+
+void SharedComponentStore::Create() {
+  MemZeroInit(this);
+
+  map_.Create(MEM_ALLOC_HEAP, 0);
+  values_ = List<SharedComponentValue>::WithAllocator(MEM_ALLOC_HEAP);
+  data_   = List<u64>::WithAllocator(MEM_ALLOC_HEAP);
+
+  values_.Add({ { 0 }, 0, 0 }); // The zero value
+}
+
+void SharedComponentStore::Destroy() {
+  map_.Destroy();
+  values_.Destroy();
+  data_.Destroy();
+}
+
+i32 SharedComponentStore::Intern(ComponentTypeId type_id, const void* data, i32 size) {
+  if (IsZero(data, size)) {
+    return 0;
+  }
+
+  const u32 hash = HashData(data, size, type_id.v_);
+
+  for (auto m : map_.Scan(hash)) {
+    const SharedComponentValue& value = values_[m.Value()];
+    if ((value.type_id_ == type_id) && (value.size_ == size)
+        && (memcmp(data_.ptr_ + value.offset_, data, size_t(size)) == 0)) {
+      return m.Value();
+    }
+  }
+
+  const i32 offset = data_.Len();
+  const i32 len    = offset + (size + 7) / 8;
+  if (data_.Cap() < len) {
+    data_.SetCapacity(Max(2 * data_.Cap(), len));
+  }
+  data_.Resize(len);
+  memcpy(data_.ptr_ + offset, data, size_t(size));
+
+  const i32 index = values_.Len();
+  values_.Add({ type_id, size, offset });
+
+  map_.Add(hash, index);
+
+  return index;
+}
+
+void SharedComponentStore::Get(ComponentTypeId type_id, i32 index, void* data, i32 size) const {
+  if (index == 0) {
+    memset(data, 0, size_t(size));
+    return;
+  }
+
+  const SharedComponentValue& value = values_.ptr_[index];
+
+  assert((value.type_id_ == type_id) && (value.size_ == size));
+
+  memcpy(data, data_.ptr_ + value.offset_, size_t(size));
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "../common/hash-map.hh"
+#include "../common/list.hh"
+
+#include "component-registry.hh"
+
+namespace game {
+// A shared component value. The data is found at offset_ (in words) in the data buffer of the store.
+struct SharedComponentValue {
+  ComponentTypeId type_id_;
+  i32             size_;
+  i32             offset_;
+};
+
+// Interned shared component values. Chunks refer to shared component values by index and two chunks have the same value
+// if they have the same index. Index 0 is the zero value of every shared component type, it is never stored.
+//
+// Values are never removed, we expect the number of distinct values (materials, LOD buckets, cells) to be small.
+struct SharedComponentStore {
+  HashMap<i32>               map_; // Maps hashes of values to indices in values_
+  List<SharedComponentValue> values_;
+  List<u64>                  data_; // Value data (padded to 8 bytes)
+
+  void Create();
+
+  void Destroy();
+
+  // ---
+
+  // Find the index of a value, the value is added if it isn't found
+  i32 Intern(ComponentTypeId type_id, const void* data, i32 size);
+
+  // Copy the value at index to data
+  void Get(ComponentTypeId type_id, i32 index, void* data, i32 size) const;
+};
+} // namespace game
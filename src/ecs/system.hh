@@ -21,48 +21,136 @@ template <typename T> struct ComponentDataReaderWriter {
 
 // A slice of a chunk for processing in a job kernel. ChunkDataView?
 struct SystemChunk {
-  Chunk* chunk_;
-  int    batch_begin_index_;
-  int    batch_end_index_;
+  Chunk*                   chunk_;
+  int                      batch_begin_index_;
+  int                      batch_end_index_;
+  u32                      global_system_version_; // Written component data gets this change version
+  BufferAllocator*         buffer_allocator_;      // Overflow storage of dynamic buffers
+  const EntityQuery*       query_;                 // The query that matched the chunk (null outside of a job)
+  const EntityQueryColumn* columns_;               // The column table of the archetype for the query
 
   int Len() const { return batch_end_index_ - batch_begin_index_; }
 
-  void* _GetArray(ComponentTypeId component_type_id) const {
-    Archetype&       archetype            = chunk_->Archetype();
-    ComponentTypeId* archetype_types      = archetype.types_;
-    i32              archetype_types_len_ = archetype.types_len_;
+  // Find index of component type in archetype, -1 if the archetype doesn't have the component type
+  i32 _FindComponentTypeIndex(ComponentTypeId component_type_id) const {
+    return chunk_->Archetype()._TypeIndex(component_type_id);
+  }
 
-    // Find index of component type in archetype
-    int i = 0;
-    for (; i < archetype_types_len_; i++) {
-      if (archetype_types[i] == component_type_id) {
-        break;
-      }
+  // Find where the component array of a component type is found in the chunk. The component types of the query are
+  // found in the column table, anything else (e.g. Entity) is looked up in the archetype.
+  EntityQueryColumn _FindColumn(ComponentTypeId component_type_id) const {
+    const i32 c = query_ != nullptr ? query_->_ColumnIndex(component_type_id) : -1;
+    if (c != -1) {
+      return columns_[c];
     }
-    if (!(i < archetype_types_len_)) {
-      return nullptr; // when using any queries, it is possible to not have any data for a particular component type
+
+    Archetype& archetype = chunk_->Archetype();
+
+    const i32 i = archetype._TypeIndex(component_type_id);
+    if (i == -1) {
+      return { -1, 0, 0 };
     }
+    return { i, archetype.offsets_[i], archetype.sizes_[i] };
+  }
 
-    i32 offset = archetype.offsets_[i];
-    i32 size   = archetype.sizes_[i];
+  void* _GetArray(ComponentTypeId component_type_id, bool write) const {
+    return _ColumnArray(_FindColumn(component_type_id), write);
+  }
+
+  // Get the array of an already found column, so callers that also need the column only look it up once
+  void* _ColumnArray(const EntityQueryColumn& column, bool write) const {
+    if (column.type_index_ == -1) {
+      return nullptr; // when using any queries, it is possible to not have any data for a particular component type
+    }
 
     // if this is a write we unconditionally set the global system version of the type in the chunk
-    // archetype->chunk_data_.ChangeVersionsPtr()[i] = component.global_system_version_;
+    if (write) {
+      chunk_->Archetype().chunk_data_.ChangeVersionArray(column.type_index_)[chunk_->ListIndex()] =
+          global_system_version_;
+    }
 
-    auto ptr1 = (byte*)chunk_->Buffer() + offset + size * i;
-    auto ptr2 = ptr1 + size * batch_begin_index_;
+    auto ptr1 = (byte*)chunk_->Buffer() + column.offset_;
+    auto ptr2 = ptr1 + column.size_ * batch_begin_index_;
 
     return ptr2;
   }
 
   template <typename T> const T* GetArray(const ComponentDataReader<T>& reader) const {
-    // todo: static assert for zero sized components
-    return (const T*)_GetArray(reader.type_id_);
+    static_assert(!std::is_empty<T>::value, "tag components have no data");
+    return (const T*)_GetArray(reader.type_id_, false);
   }
 
   template <typename T> T* GetArray(const ComponentDataReaderWriter<T>& reader) const {
-    // todo: static assert for zero sized components
-    return (T*)_GetArray(reader.type_id_);
+    static_assert(!std::is_empty<T>::value, "tag components have no data");
+    return (T*)_GetArray(reader.type_id_, true);
+  }
+
+  // The dynamic buffers of the entities in the chunk, the accessor is empty if the chunk doesn't have the buffer
+  // component type. Buffers can grow while the chunk is processed but the chunk must not be structurally changed.
+  template <typename T> BufferAccessor<T> _GetBufferAccessor(ComponentTypeId component_type_id, bool write) const {
+    const EntityQueryColumn column = _FindColumn(component_type_id);
+    if (column.type_index_ == -1) {
+      return { nullptr, 0, 0, buffer_allocator_ };
+    }
+    return { (byte*)_ColumnArray(column, write), column.size_, Len(), buffer_allocator_ };
+  }
+
+  template <typename T> BufferAccessor<T> GetBufferAccessor(const ComponentDataReader<T>& reader) const {
+    return _GetBufferAccessor<T>(reader.type_id_, false);
+  }
+
+  template <typename T> BufferAccessor<T> GetBufferAccessor(const ComponentDataReaderWriter<T>& reader) const {
+    return _GetBufferAccessor<T>(reader.type_id_, true);
+  }
+
+  // Chunk components have a single value for the whole chunk, null if the chunk doesn't have the chunk component type
+  void* _GetChunkComponentData(ComponentTypeId component_type_id, bool write) const {
+    Archetype& archetype = chunk_->Archetype();
+
+    const i32 i = _FindComponentTypeIndex(component_type_id);
+    if (i == -1) {
+      return nullptr;
+    }
+
+    if (write) {
+      archetype.chunk_data_.ChangeVersionArray(i)[chunk_->ListIndex()] = global_system_version_;
+    }
+
+    return (byte*)chunk_->Buffer() + archetype.offsets_[i];
+  }
+
+  template <typename T> const T* GetChunkComponentData(const ComponentDataReader<T>& reader) const {
+    return (const T*)_GetChunkComponentData(reader.type_id_, false);
+  }
+
+  template <typename T> T* GetChunkComponentData(const ComponentDataReaderWriter<T>& reader) const {
+    return (T*)_GetChunkComponentData(reader.type_id_, true);
+  }
+
+  // Has the component data of the chunk changed since version (usually the last system version of the system that is
+  // asking). Adding or removing entities counts as a change to every component type of the chunk.
+  bool _DidChange(ComponentTypeId component_type_id, u32 version) const {
+    const i32 i = _FindComponentTypeIndex(component_type_id);
+    if (i == -1) {
+      return false;
+    }
+    return ::game::DidChange(chunk_->Archetype().chunk_data_.ChangeVersionArray(i)[chunk_->ListIndex()], version);
+  }
+
+  template <typename T> bool DidChange(const ComponentDataReader<T>& reader, u32 version) const {
+    return _DidChange(reader.type_id_, version);
+  }
+
+  // The shared component value of the chunk as an index into the shared component store, -1 if the chunk doesn't have
+  // the shared component type. All entities in the chunk have the same value.
+  i32 _GetSharedComponentIndex(ComponentTypeId component_type_id) const {
+    Archetype& archetype = chunk_->Archetype();
+    const i32  k         = archetype._SharedComponentIndex(component_type_id);
+    return k != -1 ? archetype.chunk_data_.SharedValueArray(k)[chunk_->ListIndex()] : -1;
+  }
+
+  template <typename T> i32 GetSharedComponentIndex() const {
+    return _GetSharedComponentIndex(GetComponentTypeId<T>());
   }
 };
 
@@ -85,6 +173,8 @@ struct SystemState {
   u32 flags_;
 
   f32 dT_; // delta time in seconds since last frame
+
+  u32 last_system_version_; // The global system version of the last update (zero before the first update)
 };
 
 struct System {
@@ -102,13 +192,36 @@ struct System {
 
   template <typename T>
   static void ExecuteJob(EntityQuery* query, T& job_data, void (*job_kernel)(T& data, const SystemChunk& chunk)) {
-    for (auto archetype : query->matching_archetypes_) {
-      auto chunk_data = &archetype->chunk_data_;
-      for (int i = 0; i < chunk_data->Len(); i++) {
-        Chunk*      chunk           = chunk_data->ChunkPtrArray()[i];
-        SystemChunk archetype_chunk = { chunk, 0, chunk->EntityCount() };
+    const u32        global_system_version = query->entity_manager_->global_system_version_;
+    BufferAllocator* buffer_allocator      = &query->entity_manager_->buffer_allocator_;
+
+    query->_UpdateChunkCache();
+
+    // Room for the enabled mask of the largest chunk
+    auto mask = MemStackalloc(u64, CHUNK_ENTITY_CAPACITY_MAX / 64 + 1, CHUNK_ENTITY_CAPACITY_MAX / 64 + 1);
+
+    // The kernel must not make structural changes, the chunk cache stays valid while we iterate it
+    for (const auto& chunk : query->matching_chunks_) {
+      if (!query->_IsChunkMatch(chunk.archetype_, chunk.chunk_index_)) {
+        continue;
+      }
+
+      const i32 enabled_count = query->_EnabledMask(chunk, mask.ptr_);
+      if (enabled_count == chunk.entity_count_) {
+        SystemChunk archetype_chunk = {
+          chunk.chunk_, 0, chunk.entity_count_, global_system_version, buffer_allocator, query, chunk.columns_
+        };
         job_kernel(job_data, archetype_chunk);
+        continue;
       }
+
+      // Some entities have components turned off, the kernel is called once per run of entities that are enabled
+      ForEachBitRun(mask.ptr_, chunk.entity_count_, [&](i32 begin, i32 end) {
+        SystemChunk archetype_chunk = {
+          chunk.chunk_, begin, end, global_system_version, buffer_allocator, query, chunk.columns_
+        };
+        job_kernel(job_data, archetype_chunk);
+      });
     }
   }
 };
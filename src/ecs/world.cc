@@ -8,7 +8,8 @@ void World::Create(Slice<const TypeInfo> components) {
   type_registry_ = MemAllocZeroInit<ComponentRegistry>(MEM_ALLOC_HEAP);
   type_registry_->Initialize(components);
 
-  chunk_allocator_ = MemAllocZeroInit<ChunkAllocator>(MEM_ALLOC_HEAP);
+  chunk_allocator_ = MemAlloc<ChunkAllocator>(MEM_ALLOC_HEAP);
+  chunk_allocator_->Create();
 
   entity_manager_ = MemAllocZeroInit<game::EntityManager>(MEM_ALLOC_HEAP);
   entity_manager_->Create(this, 1024);
@@ -54,7 +55,24 @@ void World::Update() {
 
     // If the system is not paused we will update it
     if ((state.flags_ & (SystemState::FLAG_RUNNING)) == SystemState::FLAG_RUNNING) {
+      entity_manager_->global_system_version_++;
+      entity_manager_->last_system_version_ = state.last_system_version_;
       system->OnUpdate(state);
+      state.last_system_version_ = entity_manager_->global_system_version_;
     }
   }
+
+  entity_manager_->last_system_version_ = 0;
+
+  // Changes made outside of systems, until the next update, get a version of their own
+  entity_manager_->global_system_version_++;
+
+  if (0 < defragment_chunk_budget_) {
+    entity_manager_->Defragment(defragment_chunk_budget_);
+  }
+
+  // The chunk pools decide what to do with empty mega chunks, chunks cached by the entity manager don't count as empty
+  entity_manager_->FlushChunkMagazines();
+
+  chunk_allocator_->Update();
 }
\ No newline at end of file
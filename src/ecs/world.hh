@@ -9,6 +9,7 @@ struct World {
   EntityManager*     entity_manager_;
   List<System*>      system_list_;
   List<SystemState*> system_state_;
+  i32                defragment_chunk_budget_; // Chunks freed by defragmentation per update, off (0) by default
 
   void Create(Slice<const TypeInfo> components);
 
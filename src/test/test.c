@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #if _WIN32
 #define NOMINMAX
@@ -365,4 +366,20 @@ double test_time_diff_to_seconds(int64_t tick) {
   return (double)(test_time_now() - tick) / test_time_freq();
 }
 
+#else
+
+int64_t test_time_freq() {
+  return 1000000000; // nanoseconds
+}
+
+int64_t test_time_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + (int64_t)ts.tv_nsec;
+}
+
+double test_time_diff_to_seconds(int64_t tick) {
+  return (double)(test_time_now() - tick) / test_time_freq();
+}
+
 #endif
\ No newline at end of file
@@ -79,7 +79,9 @@ StaticLibrary {
     Sources = {
         "src/common/cli.cc",
         "src/common/mem.cc",
-        { "src/common/file_windows.cc"; Config = "win64-*-*" }
+        { "src/common/file_windows.cc"; Config = "win64-*-*" },
+        { "src/common/mem_windows.cc"; Config = "win64-*-*" },
+        { "src/common/mem_linux.cc"; Config = "linux-*-*" }
     }
 }
 
@@ -185,10 +187,14 @@ StaticLibrary {
     },
     Sources = {
         "src/ecs/archetype.cc",
+        "src/ecs/chunk-world-bounds-system.cc",
         "src/ecs/chunk.cc",
+        "src/ecs/dynamic-buffer.cc",
+        "src/ecs/entity-command-buffer.cc",
         "src/ecs/entity-manager.cc",
         "src/ecs/entity-query.cc",
         "src/ecs/local-to-world-system.cc",
+        "src/ecs/shared-component-store.cc",
         "src/ecs/world.cc"
     }
 }
@@ -209,6 +215,22 @@ Program {
     }
 }
 
+Program {
+    Name = "ecs_chunk-world-bounds-system_test",
+    Depends = {
+        "common",
+        { "windows"; Config = "win64-*-*" },
+        "xxhash",
+        "components",
+        "math",
+        "ecs",
+        "test"
+    },
+    Sources = {
+        "src/ecs/chunk-world-bounds-system_test.cc"
+    }
+}
+
 Program {
     Name = "ecs_chunk_test",
     Depends = {
@@ -257,6 +279,22 @@ Program {
     }
 }
 
+Program {
+    Name = "ecs_entity-command-buffer_test",
+    Depends = {
+        "common",
+        { "windows"; Config = "win64-*-*" },
+        "xxhash",
+        "components",
+        "math",
+        "ecs",
+        "test"
+    },
+    Sources = {
+        "src/ecs/entity-command-buffer_test.cc"
+    }
+}
+
 Program {
     Name = "ecs_entity-manager_test",
     Depends = {